@@ -743,6 +743,11 @@ static void auxsetstr (lua_State *L, const TValue *t, const char *k) {
   const TValue *slot;
   TString *str = luaS_new(L, k);
   api_checknelems(L, 1);
+  if (luaG_iswatched(t)) {
+    TValue key;
+    setsvalue(L, &key, str);
+    luaG_watchstore(L, hvalue(t), &key, 0);
+  }
   if (luaV_fastset(L, t, str, slot, luaH_getstr, L->top - 1))
     L->top--;  /* pop value */
   else {
@@ -767,6 +772,8 @@ LUA_API void lua_settable (lua_State *L, int idx) {
   lua_lock(L);
   api_checknelems(L, 2);
   t = index2addr(L, idx);
+  if (luaG_iswatched(t))
+    luaG_watchstore(L, hvalue(t), L->top - 2, 0);
   luaV_settable(L, t, L->top - 2, L->top - 1);
   L->top -= 2;  /* pop index and value */
   lua_unlock(L);
@@ -785,6 +792,11 @@ LUA_API void lua_seti (lua_State *L, int idx, lua_Integer n) {
   lua_lock(L);
   api_checknelems(L, 1);
   t = index2addr(L, idx);
+  if (luaG_iswatched(t)) {
+    TValue key;
+    setivalue(&key, n);
+    luaG_watchstore(L, hvalue(t), &key, 0);
+  }
   if (luaV_fastset(L, t, n, slot, luaH_getint, L->top - 1))
     L->top--;  /* pop value */
   else {
@@ -804,6 +816,8 @@ LUA_API void lua_rawset (lua_State *L, int idx) {
   api_checknelems(L, 2);
   o = index2addr(L, idx);
   api_check(L, ttistable(o), "table expected");
+  if (luaG_iswatched(o))
+    luaG_watchstore(L, hvalue(o), L->top - 2, 1);
   slot = luaH_set(L, hvalue(o), L->top - 2);
   setobj2t(L, slot, L->top - 1);
   invalidateTMcache(hvalue(o));
@@ -819,6 +833,11 @@ LUA_API void lua_rawseti (lua_State *L, int idx, lua_Integer n) {
   api_checknelems(L, 1);
   o = index2addr(L, idx);
   api_check(L, ttistable(o), "table expected");
+  if (luaG_iswatched(o)) {
+    TValue key;
+    setivalue(&key, n);
+    luaG_watchstore(L, hvalue(o), &key, 1);
+  }
   luaH_setint(L, hvalue(o), n, L->top - 1);
   luaC_barrierback(L, hvalue(o), L->top-1);
   L->top--;
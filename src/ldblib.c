@@ -10,6 +10,7 @@
 #include "lprefix.h"
 
 
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -19,6 +20,8 @@
 #include "lauxlib.h"
 #include "lualib.h"
 
+#include "ldebug.h"
+
 
 /*
 ** The hook table at registry[&HOOKKEY] maps threads to their current
@@ -433,6 +436,80 @@ static int db_pause(lua_State *L)
 	return 0;
 }
 
+/*
+** debug.capturestack([thread,] [level [, max]]) records the stack as
+** (function, pc) pairs in a userdata; debug.symbolize(capture [, i]) turns
+** it, or its frame 'i', into "file:line: in name" lines when needed.
+** The frames name Protos, so the captured functions are kept in the
+** userdata's user value: the code stays loaded while the capture lives.
+*/
+#define CAPTURE_MT		"debug.capture"
+#define CAPTURE_MAXFRAMES	256
+
+typedef struct Capture {
+  int n;
+  StackFrame frames[1];
+} Capture;
+
+static int db_capturestack (lua_State *L) {
+  StackFrame frames[CAPTURE_MAXFRAMES];
+  Capture *cap;
+  int arg, n, i;
+  lua_State *L1 = getthread(L, &arg);
+  int level = (int)luaL_optinteger(L, arg + 1, (L == L1) ? 1 : 0);
+  int max = (int)luaL_optinteger(L, arg + 2, CAPTURE_MAXFRAMES);
+  luaL_argcheck(L, level >= 0, arg + 1, "level must be non-negative");
+  luaL_argcheck(L, max > 0 && max <= CAPTURE_MAXFRAMES, arg + 2,
+                "out of range");
+  n = luaG_capturestack(L1, level, frames, max);
+  cap = (Capture *)lua_newuserdata(L, sizeof(Capture) +
+                                      (n > 0 ? n - 1 : 0) * sizeof(StackFrame));
+  cap->n = n;
+  memcpy(cap->frames, frames, n * sizeof(StackFrame));
+  luaL_setmetatable(L, CAPTURE_MT);
+  checkstack(L, L1, 1);
+  lua_createtable(L, n, 0);
+  for (i = 0; i < n; i++) {
+    lua_Debug ar;
+    if (!lua_getstack(L1, level + i, &ar))
+      break;
+    lua_getinfo(L1, "f", &ar);
+    lua_xmove(L1, L, 1);
+    lua_rawseti(L, -2, i + 1);
+  }
+  lua_setuservalue(L, -2);
+  return 1;
+}
+
+static int db_symbolize (lua_State *L) {
+  Capture *cap = (Capture *)luaL_checkudata(L, 1, CAPTURE_MT);
+  char buff[LUA_IDSIZE + 256];
+  luaL_Buffer b;
+  int i;
+  if (!lua_isnoneornil(L, 2)) {
+    i = (int)luaL_checkinteger(L, 2);
+    luaL_argcheck(L, i >= 1 && i <= cap->n, 2, "frame out of range");
+    lua_pushstring(L, luaG_symbolize(L, cap->frames, cap->n, i - 1,
+                                     buff, sizeof(buff)));
+    return 1;
+  }
+  luaL_buffinit(L, &b);
+  for (i = 0; i < cap->n; i++) {
+    if (i > 0)
+      luaL_addchar(&b, '\n');
+    luaL_addstring(&b, luaG_symbolize(L, cap->frames, cap->n, i,
+                                      buff, sizeof(buff)));
+  }
+  luaL_pushresult(&b);
+  return 1;
+}
+
+static int db_capturelen (lua_State *L) {
+  Capture *cap = (Capture *)luaL_checkudata(L, 1, CAPTURE_MT);
+  lua_pushinteger(L, cap->n);
+  return 1;
+}
+
 static int db_startserver (lua_State *L) {
 	const char *mode = luaL_optstring(L, 1, "i");
 	const char *addr = luaL_optstring(L, 2, "0.0.0.0");
@@ -440,6 +517,20 @@ static int db_startserver (lua_State *L) {
 	return 1;
 }
 
+static int db_armpause (lua_State *L) {
+	int signo = (int)luaL_optinteger(L, 1, SIGUSR2);
+	const char *path = luaL_optstring(L, 2, NULL);
+	lua_pushinteger(L, luaG_armpause(L, signo, path));
+	return 1;
+}
+
+
+static int db_markrequest (lua_State *L) {
+	int start = lua_isnoneornil(L, 1) || lua_toboolean(L, 1);
+	lua_pushboolean(L, luaG_markrequest(L, start));
+	return 1;
+}
+
 
 static const luaL_Reg dblib[] = {
   {"debug", db_debug},
@@ -460,12 +551,20 @@ static const luaL_Reg dblib[] = {
   {"traceback", db_traceback},
   {"pause", db_pause},
   {"startserver", db_startserver},
+  {"armpause", db_armpause},
+  {"markrequest", db_markrequest},
+  {"capturestack", db_capturestack},
+  {"symbolize", db_symbolize},
   {NULL, NULL}
 };
 
 
 LUAMOD_API int luaopen_debug (lua_State *L) {
   luaL_newlib(L, dblib);
+  luaL_newmetatable(L, CAPTURE_MT);
+  lua_pushcfunction(L, db_capturelen);
+  lua_setfield(L, -2, "__len");
+  lua_pop(L, 1);
   return 1;
 }
 
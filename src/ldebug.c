@@ -21,6 +21,7 @@
 #include "ldebug.h"
 #include "ldo.h"
 #include "lfunc.h"
+#include "lgc.h"
 #include "lobject.h"
 #include "lopcodes.h"
 #include "lstate.h"
@@ -40,6 +41,8 @@
 
 static const char *funcnamefromcode (lua_State *L, CallInfo *ci,
                                     const char **name);
+static const char *funcnamefrompc (lua_State *L, Proto *p, int pc,
+                                   const char **name);
 
 static int currentpc (CallInfo *ci) {
   lua_assert(isLua(ci));
@@ -489,14 +492,22 @@ static const char *getobjname (Proto *p, int lastpc, int reg,
 */
 static const char *funcnamefromcode (lua_State *L, CallInfo *ci,
                                      const char **name) {
-  TMS tm = (TMS)0;  /* (initial value avoids warnings) */
-  Proto *p = ci_func(ci)->p;  /* calling function */
-  int pc = currentpc(ci);  /* calling instruction index */
-  Instruction i = p->code[pc];  /* calling instruction */
   if (ci->callstatus & CIST_HOOKED) {  /* was it called inside a hook? */
     *name = "?";
     return "hook";
   }
+  return funcnamefrompc(L, ci_func(ci)->p, currentpc(ci), name);
+}
+
+
+/*
+** Name of the function called by instruction 'pc' of 'p', which is
+** the calling instruction of a frame.
+*/
+static const char *funcnamefrompc (lua_State *L, Proto *p, int pc,
+                                   const char **name) {
+  TMS tm = (TMS)0;  /* (initial value avoids warnings) */
+  Instruction i = p->code[pc];  /* calling instruction */
   switch (GET_OPCODE(i)) {
     case OP_CALL:
     case OP_TAILCALL:
@@ -711,20 +722,28 @@ void luaG_traceexec (lua_State *L) {
 #include <setjmp.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <signal.h>
 #include <arpa/inet.h>
 #include <poll.h>
 #include <errno.h>
 #include <ctype.h>
 #include <assert.h>
 #include <pthread.h>
+#include <time.h>
+#include <limits.h>
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
 
 
 /* 7609 -> 0x1db9 -> ldbg */
 #define LDBG_PORT 			7609
 
-#define MAX_VARFIELD	  	16
 #define MAX_IBUFSIZ 		(64 * 1024 - 1)
-#define MAX_ARGV			32
+#define ARENA_BLOCKSIZE		4096
+#define ARENA_ALIGN			16  /* must be a power of 2 */
 
 #define SETPAUSE_CLI		1
 #define SETPAUSE_NEXT		3
@@ -733,25 +752,111 @@ void luaG_traceexec (lua_State *L) {
 
 #define MAX_BREAKPOINT 		99
 #define ID_PSEUDOBP 		(MAX_BREAKPOINT+1)
+#define PROBE_BASE			128  /* OP_INTERRUPT Ax of coverage probe 0 */
+#define MAX_PROBES			(MAXARG_Ax - PROBE_BASE + 1)
+#define WATCH_BASE			ID_PSEUDOBP  /* OP_INTERRUPT Ax of watchpoint n is WATCH_BASE+n */
+#define MAX_WATCHPOINT		16  /* must keep WATCH_BASE+n below PROBE_BASE */
+#define WATCH_TEXTSIZE		80  /* old value of a field as text, see valuetext */
 
 #define SIZEDCSTR(str)		str,sizeof(str)-1
 
 #define BP_TEMP 			0x01
 #define BP_DISABLED 		0x02
 
+#define WATCH_FIELD			1
+#define WATCH_LOCAL			2
+
+#define NPENDINGBUCKETS		16  /* must be a power of 2 */
+
+#define PROF_DEFAULTHZ		1000
+#define PROF_MAXHZ			10000
+#define PROF_MAXDEPTH		128
+#define FT_MAXFUNCS			4096
+#define FT_HASHSIZE			(2 * FT_MAXFUNCS)  /* must be a power of 2 */
+#define PROF_TOPN			20
+#define COUNT_TOPN			50
+#define TRACE_MAXPATTERN	256
+#define TRACE_MAXINDENT		32
+#define MEMPROF_TOPN		20
+#define MEMPROF_MINSITES	1024  /* must be a power of 2 */
+#define COUNT_MINBUCKETS	64  /* must be a power of 2 */
+#define PROTOREF_MINBUCKETS	64  /* must be a power of 2 */
+#define NAMECACHE_SIZE		512  /* must be a power of 2 */
+#define CALLNAME_SIZE		48  /* longer names are not cached */
+#define CFN_MAX				1024
+#define CFN_NAMESIZE		48
+#define WD_TICK				10  /* ms between checks with no client attached */
+#define WD_MAXFRAMES		64
+#define WD_REPORTSIZE		8192
+
+
+typedef struct BreakSite {
+	Proto *p;
+	int codepos;
+	Instruction code;  /* the user instruction replaced by OP_INTERRUPT */
+	struct BreakSite *next;
+}BreakSite;
 
 typedef struct BreakPoint {
 	short id;
 	short flags;
 	SrcFile *srcfile;
 	int line;
-	Proto *p;
-	int codepos;
-	Instruction code;
+	BreakSite *sites;  /* one per loaded version of the file */
 	struct BreakPoint *next;
+	/* for breakpoints set before the file is loaded */
+	char *pendingpath;
+	unsigned int pendinghash;  /* hash of the basename of 'pendingpath' */
+	struct BreakPoint *pendingnext;
 }BreakPoint;
 
+typedef struct WatchSite {
+	Proto *p;
+	int codepos;
+	Instruction code;  /* the instruction replaced by OP_INTERRUPT */
+	struct WatchSite *next;
+}WatchSite;
+
+typedef struct WatchPoint {
+	short id;
+	short kind;  /* WATCH_FIELD or WATCH_LOCAL */
+	char *expr;  /* as given to `watch` */
+	/* WATCH_FIELD: stores into 't' with the key 'key' or 'ikey' */
+	Table *t;  /* kept alive in the registry and marked, see markwatched */
+	char *key;  /* NULL for the integer key 'ikey' */
+	size_t keylen;
+	unsigned int keyhash;  /* of a short string key */
+	lua_Integer ikey;
+	char oldtext[WATCH_TEXTSIZE];  /* before the first store not reported yet */
+	/* WATCH_LOCAL: stores to register 'reg' of one activation of 'p' */
+	lua_State *L;
+	CallInfo *ci;
+	Proto *p;
+	int reg;
+	int startpc;
+	int endpc;
+	WatchSite *sites;
+	struct WatchPoint *next;
+}WatchPoint;
+
+typedef struct Watcher {
+	WatchPoint *list;  /* by id */
+	/* the trapped store being run, see hitwatch */
+	WatchSite *site;  /* NULL if none */
+	WatchSite scratch;
+	Instruction above;  /* put back at the site once the store is fetched */
+	int rearmed;
+	lua_State *L;
+	CallInfo *ci;
+	unsigned int hits;  /* bit id-1 of each watchpoint hit by the store */
+	unsigned int fhits;  /* bit id-1 of each field stored into, see luaG_watchstore */
+	char *oldtext;
+	size_t sizeoldtext;
+	size_t lenoldtext;
+}Watcher;
+
 typedef struct FileContent {
+	char *mem;
 	char *text;
 	size_t fsize;
 	int lines;
@@ -760,11 +865,292 @@ typedef struct FileContent {
 	struct FileContent *next;
 }FileContent;
 
+typedef struct LinePos {
+	int line;
+	int codepos;  /* first instruction of 'line' a breakpoint may replace */
+}LinePos;
+
+typedef struct FuncLines {
+	Proto *p;
+	int parent;  /* index of the enclosing function, -1 for the main chunk */
+	LinePos *lines;  /* sorted by line, built on first use */
+	int nlines;  /* -1 until 'lines' is built */
+}FuncLines;
+
+/*
+** Functions of one loaded version in preorder, which is also the order of
+** 'linedefined'; kept in a list hung on SrcFile.lineidx.
+*/
+typedef struct LineIndex {
+	Proto *top;
+	FuncLines *funcs;
+	int nfuncs;
+	struct LineIndex *next;
+}LineIndex;
+
+/*
+** Functions loaded from source files while the debugger is attached, by
+** address. Nothing here keeps them alive: luaG_freeproto forgets each one
+** with whatever the debugger patched in it. A version of a file is a
+** function without parent, the top of a load or a function outliving it.
+*/
+typedef struct ProtoRef {
+	Proto *p;
+	Proto *parent;  /* NULL for the top of a version */
+	SrcFile *srcfile;
+	struct ProtoRef *next;
+}ProtoRef;
+
+typedef struct ProtoRefs {
+	ProtoRef **buckets;
+	int nbuckets;
+	int nrefs;
+}ProtoRefs;
+
+/*
+** A sample is a header frame with 'func' -1 and 'line' the number of
+** frames which follow it, innermost first.
+*/
+typedef struct ProfFrame {
+	int func;  /* index in Profiler.ft */
+	int line;
+}ProfFrame;
+
+typedef struct FuncEntry {
+	const void *key;  /* Proto or lua_CFunction */
+	const TString *source;  /* with 'linedefined', tells reused addresses apart */
+	int linedefined;
+	char *name;
+	int traced;  /* for the tracer: matches the pattern, -1 not checked yet */
+	/* for the profile report */
+	size_t self;
+	size_t total;
+	size_t lastsample;
+}FuncEntry;
+
+/*
+** Functions seen by the VM thread, numbered so that events can refer to
+** them without keeping the functions alive.
+*/
+typedef struct FuncTable {
+	FuncEntry *funcs;
+	int nfuncs;
+	int *hash;  /* index + 1 into 'funcs', 0 when free */
+}FuncTable;
+
+typedef struct Profiler {
+	pthread_t thread;
+	int running;  /* accessed atomically, read by the timer thread */
+	int hz;
+	ProfFrame *ring;
+	size_t ringmask;
+	size_t head;  /* frames written so far, the ring keeps the last ones */
+	size_t nsamples;
+	size_t ntruncated;
+	FuncTable ft;
+}Profiler;
+
+/*
+** Counts of one function. They outlive it: when it is freed, the line of
+** each instruction is kept instead, see luaG_freeproto.
+*/
+typedef struct CountProto {
+	Proto *p;  /* NULL once freed */
+	char *source;
+	int linedefined;
+	int sizecode;
+	int *lines;  /* line of each instruction once 'p' is freed */
+	unsigned long *counts;  /* one per instruction */
+	struct CountProto *next;
+}CountProto;
+
+typedef struct Counter {
+	int on;
+	CountProto **buckets;
+	int nbuckets;
+	int nprotos;
+	CountProto *retired;  /* counted functions which have been freed */
+	CountProto *last;  /* the function counted last, nearly always the next */
+	unsigned long nlost;  /* instructions not counted for lack of memory */
+}Counter;
+
+typedef struct Probe {
+	Proto *p;  /* NULL once freed */
+	SrcFile *srcfile;
+	int codepos;
+	int line;
+	Instruction code;  /* the user instruction */
+	int hit;
+}Probe;
+
+typedef struct Coverage {
+	int on;
+	Probe *probes;  /* index is the probe's Ax - PROBE_BASE */
+	int nprobes;
+	int sizeprobes;
+}Coverage;
+
+typedef struct TraceEvent {
+	unsigned long long ts;  /* tracetime() ticks */
+	const lua_State *L;
+	int func;  /* index in Tracer.ft */
+	int what;  /* LUAG_TRACECALL etc. */
+	int depth;  /* frames below, up to TRACE_MAXINDENT */
+}TraceEvent;
+
+/*
+** Single producer ring: only the VM thread writes events and moves 'head',
+** only the consumer moves 'tail'. While streaming, the producer drops
+** events when the ring is full; otherwise it overwrites the oldest ones,
+** which are then read while the VM is paused.
+*/
+typedef struct Tracer {
+	int on;
+	int streaming;  /* accessed atomically, the server thread turns it off */
+	char pattern[TRACE_MAXPATTERN];  /* substring of "source:linedefined" */
+	TraceEvent *ring;
+	size_t ringmask;
+	size_t head;
+	size_t tail;
+	unsigned long ndropped;
+	unsigned long nuntraced;  /* calls of functions 'ft' has no room for */
+	int fullsent;  /* the stream told the client about 'nuntraced' */
+	unsigned long long start;  /* tracetime() when tracing started */
+	double ticksperus;
+	FuncTable ft;
+}Tracer;
+
+typedef struct MemSite {
+	int func;  /* index in MemProfiler.ft, -1 for a free slot */
+	int line;
+	unsigned long nalloc;
+	unsigned long nfree;
+	size_t allocated;
+	size_t freed;
+}MemSite;
+
+typedef struct MemProfiler {
+	int on;
+	lua_Alloc frealloc;  /* the allocator being wrapped */
+	void *ud;
+	MemSite *sites;  /* open addressing by (func, line) */
+	size_t sizesites;
+	size_t nsites;
+	unsigned long nlost;  /* events not recorded for lack of memory */
+	FuncTable ft;
+}MemProfiler;
+
+enum {
+	HT_TABLE, HT_SHRSTR, HT_LNGSTR, HT_USERDATA, HT_LCL, HT_CCL, HT_PROTO,
+	HT_THREAD, HT_OTHER, HT_NTYPES
+};
+
+typedef struct SnapTable {
+	Table *t;  /* NULL for a free slot */
+	size_t bytes;
+}SnapTable;
+
+typedef struct HeapSnapshot {
+	int taken;
+	lu_mem total;
+	size_t count[HT_NTYPES];
+	size_t bytes[HT_NTYPES];
+	SnapTable *tables;  /* open addressing by table address */
+	size_t sizetables;
+	size_t ntables;
+}HeapSnapshot;
+
+/*
+** Scratch memory of the command being run: argv, variable paths and the
+** strings they name. It is all released when the command is done.
+*/
+typedef struct ArenaBlock {
+	struct ArenaBlock *next;
+	size_t size;
+	size_t used;
+}ArenaBlock;
+
+#define ARENA_HDRSIZE		((sizeof(ArenaBlock) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+/* a C function of a loaded module, named for busy reports */
+typedef struct CFuncName {
+	lua_CFunction f;
+	char name[CFN_NAMESIZE];  /* the last byte stays 0 */
+}CFuncName;
+
+typedef struct CFuncIndex {
+	int n;
+	CFuncName names[CFN_MAX];
+}CFuncIndex;
+
+/* a name visible in the selected frame */
+typedef struct FrameSym {
+	TString *name;
+	char kind;  /* 'l' for a local, 'u' for an upvalue */
+	int idx;  /* register or upvalue index */
+}FrameSym;
+
+/*
+** The locals and upvalues of the selected frame, built at the first lookup
+** after the frame changes. Locals come first, by register, so a shadowed
+** local is still listed while lookups find the innermost one.
+*/
+typedef struct FrameSyms {
+	const CallInfo *ci;  /* NULL when out of date */
+	const Instruction *savedpc;
+	FrameSym *syms;
+	int nsyms;
+	int nlocals;
+	int sizesyms;
+	int *hash;  /* 1-based indices into 'syms', 0 for a free slot */
+	int sizehash;  /* a power of 2 */
+}FrameSyms;
+
+/*
+** How the function called at 'pc' of 'p' is named, see funcnamefromcode.
+** The entries of 'p' go with it, see forgetcallnames.
+*/
+typedef struct CallName {
+	const Proto *p;
+	int pc;
+	const char *namewhat;  /* NULL if the call has no name */
+	char name[CALLNAME_SIZE];  /* a copy, the constant it comes from may be freed */
+}CallName;
+
+/*
+** Hang detector. The VM marks where each request starts and ends, and the
+** server thread checks the running one against 'budget'. An overrun pauses
+** the VM when a client is attached; otherwise the VM captures its own stack
+** into 'report', which is also appended to "ldb-<pid>.watchdog".
+*/
+typedef struct Watchdog {
+	int budget;  /* ms, 0 when off */
+	long long reqstart;  /* ns, 0 between requests; accessed atomically */
+	unsigned long reqcalls;  /* progress counter when the request started; accessed atomically */
+	long long firedfor;  /* 'reqstart' of the last request reported */
+	unsigned long lastcalls;  /* progress counter at the last check */
+	long long lastprogress;  /* ns, when the counter last moved */
+	unsigned long noverruns;
+	int capture;  /* the VM is asked for a capture; accessed atomically */
+	char headline[256];  /* why, written before 'capture' is set */
+	char *report;
+	int logerr;  /* errno if 'report' could not be appended to the file */
+	size_t sizereport;  /* 0 while 'report' is written; accessed atomically */
+}Watchdog;
+
 typedef struct DebugConf {
 	int listsize;
+	size_t profringsize;  /* frames, must be a power of 2 */
+	size_t traceringsize;  /* events, must be a power of 2 */
+	int evalsteps;  /* instructions an `eval` may run */
+	int pausewait;  /* ms `pause` waits before reporting the VM busy */
 }DebugConf;
 static const DebugConf DBGCONF = {
 	.listsize = 10,
+	.profringsize = 1 << 20,
+	.traceringsize = 1 << 18,
+	.evalsteps = 10000000,
+	.pausewait = 100,
 };
 
 typedef struct DebugState {
@@ -772,29 +1158,51 @@ typedef struct DebugState {
 	const char *fatalerrmsg;
 	DebugConf conf;
 	void (*interact)(struct DebugState*);
-	pthread_mutex_t mutex;
-	pthread_cond_t cond;
 	char mode;
 	
 	BreakPoint *freebp;
 	BreakPoint *bplist;
 	BreakPoint pseudobp;
+	BreakSite pseudosite;
 	BreakPoint *restorebp;
+	BreakSite *restoresite;
 	size_t nr_bp;
 	int bpid;  /* count from 1 */
+	BreakPoint *pendingbp[NPENDINGBUCKETS];  /* by 'pendinghash' */
+	size_t nr_pendingbp;
 	
 	FileContent *fclist;
 
+	/* for command pause */
+	CFuncIndex *cfindex;  /* two buffers, see indexcfuncs */
+	CFuncIndex *cfnames;  /* the published one; accessed atomically */
+	size_t cfsig;  /* of package.loaded when 'cfnames' was built */
+	long long pausesince;  /* ns, when the pending pause was asked */
+	long long pauselatency;  /* ns, from the ask to the VM parking */
+	long long maxpauselatency;
+
+	/* for command watchdog */
+	Watchdog wd;
+
 	/* for lua VM */
+	int lazy;  /* armed by luaG_armpause, no server yet */
+	int bysignal;  /* the server was started by a requested pause */
 	int why_setpause;
-	volatile int luacont;
+	int vmstate;  /* VM_*, see setvmstate */
+	int resume;  /* a command let the VM continue, see resumevm */
+	int mailstate;  /* MAIL_*, see postcmd */
+	void (*mailcmd)(struct DebugState*);
+	int mailqueued;  /* 'mailcmd' is posted again once the reply is sent */
+	int clientgone;  /* accessed atomically, see dropclient */
 	BreakPoint *rtbp;
+	BreakSite *rtsite;
 	lua_State *L;
 	const Instruction *oldpc;
 	int oldline;
 	CallInfo *citop;
 	CallInfo *ci;
-	SrcFile *rtsrcfile;
+	SrcFile *rtsrcfile;  /* NULL if the function was not loaded from a file */
+	const char *rtsrcname;
 	int rtline;
 
 	/* for debugger client */
@@ -807,30 +1215,191 @@ typedef struct DebugState {
 	size_t sizeobuf;
 	size_t capobuf;
 	int argc;
-	const char *argv[MAX_ARGV];
-	char argvbuf[1024];
-	size_t argvbufsiz;
+	const char **argv;
+	const char *cmdline;  /* the raw line of the command being run */
+	ArenaBlock *arena;
 
 	/* for command print */
-	TValue varfields[MAX_VARFIELD];
+	TValue *varfields;
 	int nr_varfields;
+	FrameSyms syms;
+
+	/* loaded versions, for breakpoints and coverage */
+	ProtoRefs protos;
 
 	/* for command list */
 	SrcFile *lastlistsrcfile;
 	int lastlistline;
+
+	/* for command profile */
+	Profiler prof;
+
+	/* for command count */
+	Counter count;
+
+	/* for command coverage */
+	Coverage cov;
+
+	/* for command trace */
+	Tracer trace;
+
+	/* for command memprof */
+	MemProfiler memprof;
+
+	/* for command heap */
+	HeapSnapshot snap;
+
+	/* for command watch */
+	Watcher watch;
+
+	/* for command backtrace */
+	CallName namecache[NAMECACHE_SIZE];
+
+	/* for command eval */
+	int evaluating;
+	int evalsteps;  /* budget left, in units of EVAL_HOOKCOUNT */
+	int nevalcache;
 	
 	
 }DebugState;
 
+/* what a command may do while the VM runs in background mode */
+#define CMD_SERVER				0x01  /* run on the server thread */
+#define CMD_INVM				0x02  /* run by the VM at its next safe point */
+
 typedef struct CmdEntry {
 	const char *name;
 	const char *shortcut;
 	void (*handler)(DebugState*);
+	int flags;  /* CMD_*, 0 for commands that need a paused VM */
 }CmdEntry;
 
-#define SETPAUSE(ds)			G(ds->L)->dbgstate = cast(DebugState*, (cast(uintptr_t, ds) | 0x1))
-#define UNSETPAUSE(ds)			G(ds->L)->dbgstate = ds 
-#define GETDS(L)				cast(DebugState*, (cast(uintptr_t, G(L)->dbgstate) & ~0x01))
+/* the server and profiler threads set event bits while the VM clears them */
+#define DBGSTATEBITS(L)			cast(uintptr_t*, &G(L)->dbgstate)
+#define SETDBGEV(L, ev)			__atomic_fetch_or(DBGSTATEBITS(L), (ev), __ATOMIC_SEQ_CST)
+#define CLEARDBGEV(L, ev)		__atomic_fetch_and(DBGSTATEBITS(L), ~cast(uintptr_t, ev), __ATOMIC_SEQ_CST)
+
+/*
+** Who owns the VM state. The VM thread runs Lua while RUNNING or PAUSING
+** and parks in 'interact' while PAUSED or RESUMING; commands touch what the
+** VM uses (its stack, DebugState, Proto code) only while it is parked.
+** Stores release and loads acquire, so whatever one thread wrote before a
+** transition is seen by the other after it.
+**   RUNNING -> PAUSING   a pause is asked (cmd_pause, watchdog, signal)
+**   any -> PAUSED        the VM parks, in luaG_interrupt
+**   PAUSED -> RESUMING   the server thread, once a command asked to
+**                        continue ('resume') and its output is sent
+**   RESUMING -> RUNNING  the VM unparks
+*/
+#define VM_RUNNING				0
+#define VM_PAUSING				1
+#define VM_PAUSED				2
+#define VM_RESUMING				3
+
+/*
+** A command handed to the running VM, see postcmd:
+**   EMPTY -> POSTED      the server thread posts 'mailcmd'
+**   POSTED -> EMPTY      the server thread takes it back, to run it itself
+**                        on a parked VM or to reply that it is queued
+**   POSTED -> TAKEN      the VM runs it at a safe point
+**   TAKEN -> DONE        the output is in 'obuf'
+**   DONE -> EMPTY        the output is sent, the VM goes on
+*/
+#define MAIL_EMPTY				0
+#define MAIL_POSTED				1
+#define MAIL_TAKEN				2
+#define MAIL_DONE				3
+
+#define GETVMSTATE(ds)			__atomic_load_n(&(ds)->vmstate, __ATOMIC_ACQUIRE)
+#define GETMAILSTATE(ds)		__atomic_load_n(&(ds)->mailstate, __ATOMIC_ACQUIRE)
+#define VMPARKED(ds)			(GETVMSTATE(ds) == VM_PAUSED)
+
+#define SETPAUSE(ds)			SETDBGEV(ds->L, DBGEV_PAUSE)
+#define UNSETPAUSE(ds)			CLEARDBGEV(ds->L, DBGEV_PAUSE)
+#define GETDS(L)				cast(DebugState*, (cast(uintptr_t, G(L)->dbgstate) & ~cast(uintptr_t, DBGEV_MASK)))
+
+static long long monotonicns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Sleep while '*addr' is 'val', at most 'ns' (-1 for no limit). */
+static void futexwait(int *addr, int val, long long ns)
+{
+#if defined(__linux__)
+	struct timespec ts;
+	ts.tv_sec = ns / 1000000000LL;
+	ts.tv_nsec = ns % 1000000000LL;
+	syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, ns < 0 ? NULL : &ts, NULL, 0);
+#else
+	struct timespec ts = {0, 100000};  /* poll where there is no futex */
+	(void)ns;
+	if (__atomic_load_n(addr, __ATOMIC_ACQUIRE) == val) {
+		nanosleep(&ts, NULL);
+	}
+#endif
+}
+
+static void futexwake(int *addr)
+{
+#if defined(__linux__)
+	syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+#else
+	(void)addr;
+#endif
+}
+
+static void setvmstate(DebugState *ds, int state)
+{
+	__atomic_store_n(&ds->vmstate, state, __ATOMIC_RELEASE);
+	futexwake(&ds->vmstate);
+}
+
+/*
+** Let the VM continue if a command asked to. Called only after the
+** command's output is flushed: the VM may print as soon as it runs.
+*/
+static void resumevm(DebugState *ds)
+{
+	if (ds->resume) {
+		ds->resume = 0;
+		setvmstate(ds, VM_RESUMING);
+	}
+}
+
+static void setmailstate(DebugState *ds, int state)
+{
+	__atomic_store_n(&ds->mailstate, state, __ATOMIC_RELEASE);
+	futexwake(&ds->mailstate);
+}
+
+/* The output of a posted command is sent: let the VM go on. */
+static void releasemail(DebugState *ds)
+{
+	if (GETMAILSTATE(ds) == MAIL_DONE) {
+		setmailstate(ds, MAIL_EMPTY);
+	}
+}
+
+/* A posted command the VM has not finished; its argv is in the arena. */
+static int mailwaiting(DebugState *ds)
+{
+	int state = GETMAILSTATE(ds);
+	return state == MAIL_POSTED || state == MAIL_TAKEN;
+}
+
+/* A pause is asked while the VM runs; the VM measures how long it takes. */
+static void markpausing(DebugState *ds, long long since)
+{
+	int state = VM_RUNNING;
+	if (GETVMSTATE(ds) == VM_RUNNING) {
+		ds->pausesince = since;  /* published by the exchange */
+		__atomic_compare_exchange_n(&ds->vmstate, &state, VM_PAUSING, 0,
+			__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+	}
+}
 
 #define DBGTHROW(ds, errmsg)	if (1) { ds->fatalerrmsg = errmsg; longjmp(ds->jmpbuf, 1); }
 
@@ -853,6 +1422,43 @@ static void* DBGREALLOC(DebugState *ds, void *oldp, size_t siz)
 
 #define DBGFREE(ds, p)			free(p)
 
+static void* arenaalloc(DebugState *ds, size_t size)
+{
+	ArenaBlock *b = ds->arena;
+	void *p;
+	size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+	if (!b || b->size - b->used < size) {
+		size_t bsize = size > ARENA_BLOCKSIZE ? size : ARENA_BLOCKSIZE;
+		b = DBGMALLOC(ds, ARENA_HDRSIZE + bsize);
+		b->next = ds->arena;
+		b->size = bsize;
+		b->used = 0;
+		ds->arena = b;
+	}
+	p = (char*)b + ARENA_HDRSIZE + b->used;
+	b->used += size;
+	return p;
+}
+
+/* drop everything allocated by the last command, keeping one block of the usual size */
+static void arenareset(DebugState *ds)
+{
+	ArenaBlock *b = ds->arena;
+	if (b) {
+		while (b->next) {
+			ArenaBlock *next = b->next->next;
+			DBGFREE(ds, b->next);
+			b->next = next;
+		}
+		if (b->size > ARENA_BLOCKSIZE) {
+			DBGFREE(ds, b);
+			ds->arena = NULL;
+		} else {
+			b->used = 0;
+		}
+	}
+}
+
 static void obpushstr(DebugState *ds, const char *str, size_t len)
 {
 	size_t needed;
@@ -912,6 +1518,61 @@ static void obflush(DebugState *ds)
 	}
 	ds->sizeobuf = 0;
 }
+
+/* all of 'buff' to 'fd', through short writes and signals; 0 or errno */
+static int writefull(int fd, const char *buff, size_t len)
+{
+	while (len > 0) {
+		ssize_t n = write(fd, buff, len);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return errno;
+		}
+		buff += n;
+		len -= n;
+	}
+	return 0;
+}
+/*
+** The live short string 'str' of hash 'h', or NULL if nobody uses it.
+** Unlike luaS_newlstr, this neither creates nor resurrects a string.
+*/
+static TString* findshrstr(global_State *g, const char *str, size_t len, unsigned int h)
+{
+	TString *ts;
+	for (ts = g->strt.hash[lmod(h, g->strt.size)]; ts; ts = ts->u.hnext) {
+		if (ts->shrlen == len && memcmp(str, getstr(ts), len) == 0) {
+			return isdead(g, ts) ? NULL : ts;
+		}
+	}
+	return NULL;
+}
+
+/* luaT_objtypename, without creating "__name" */
+static const char* valuetypename(DebugState *ds, const TValue *v)
+{
+	global_State *g = G(ds->L);
+	Table *mt = NULL;
+	TString *name;
+	const TValue *tn;
+
+	if (ttistable(v)) {
+		mt = hvalue(v)->metatable;
+	} else if (ttisfulluserdata(v)) {
+		mt = uvalue(v)->metatable;
+	}
+	if (mt) {
+		name = findshrstr(g, SIZEDCSTR("__name"), luaS_hash(SIZEDCSTR("__name"), g->seed));
+		tn = name ? luaH_getshortstr(mt, name) : luaO_nilobject;
+		if (ttisstring(tn)) {
+			return getstr(tsvalue(tn));
+		}
+	}
+	return ttypename(ttnov(v));
+}
+
 static void printvalue(DebugState *ds, TValue *v, int nested);
 static void printtable(DebugState *ds, Table *t, int nested)
 {
@@ -1005,7 +1666,7 @@ static void printvalue(DebugState *ds, TValue *v, int nested)
 		break;}
 
     default: {
-		const char *tname = luaT_objtypename(ds->L, v);
+		const char *tname = valuetypename(ds, v);
 		obpushstr(ds, tname, strlen(tname)); }
   }
 }
@@ -1021,11 +1682,49 @@ static void newintfield(DebugState *ds, const char *tk, size_t len)
 	setivalue(v, intv);
 }
 
+/*
+** The string 'str' as a key, without creating it in the Lua heap. A short
+** string is looked up in the string table; when nobody uses it, a copy in
+** the arena stands for it, equal to no live string. A long string is
+** compared by contents, so a copy in the arena works as it is.
+** Such copies must never be stored into Lua objects.
+*/
+static TString* peekstring(DebugState *ds, const char *str, size_t len)
+{
+	global_State *g = G(ds->L);
+	TString *ts;
+	unsigned int h = 0;
+
+	if (len <= LUAI_MAXSHORTLEN) {
+		h = luaS_hash(str, len, g->seed);
+		if ((ts = findshrstr(g, str, len, h)) != NULL) {
+			return ts;
+		}
+	}
+	ts = arenaalloc(ds, sizeof(UTString) + len + 1);
+	ts->next = NULL;
+	ts->marked = 0;
+	ts->extra = 0;
+	if (len <= LUAI_MAXSHORTLEN) {
+		ts->tt = LUA_TSHRSTR;
+		ts->shrlen = cast_byte(len);
+		ts->hash = h;
+		ts->u.hnext = NULL;
+	} else {
+		ts->tt = LUA_TLNGSTR;
+		ts->shrlen = 0;
+		ts->hash = g->seed;
+		ts->u.lnglen = len;
+	}
+	memcpy(getstr(ts), str, len);
+	getstr(ts)[len] = '\0';
+	return ts;
+}
+
 static void newstrfield(DebugState *ds, const char *tk, size_t len)
 {
 	TValue *v = &ds->varfields[ds->nr_varfields++];
-	TString *ts = luaS_newlstr(ds->L, tk, len);
-	setsvalue(ds->L, v, ts);
+	setsvalue(ds->L, v, peekstring(ds, tk, len));
 }
 
 static const char* parsevar(DebugState *ds, const char *str)
@@ -1042,6 +1741,8 @@ static const char* parsevar(DebugState *ds, const char *str)
 	const char *tk;
 	const char *s;
 
+	/* every field takes at least 2 characters but the first one */
+	ds->varfields = arenaalloc(ds, (strlen(str) / 2 + 1) * sizeof(TValue));
 	ds->nr_varfields = 0;
 	s = str;
 	
@@ -1132,37 +1833,103 @@ static const char* parsevar(DebugState *ds, const char *str)
 	return NULL;
 }
 
-static char findvar(DebugState *ds, TString *name, TValue *v)
+#define SYMHASH(name, size)		((cast(size_t, name) >> 4) & ((size) - 1))
+
+/* the slot of 'name' in the hash part, or the free slot where it would go */
+static int* symslot(FrameSyms *fs, const TString *name)
+{
+	size_t h = SYMHASH(name, fs->sizehash);
+	while (fs->hash[h] && fs->syms[fs->hash[h] - 1].name != name) {
+		h = (h + 1) & (fs->sizehash - 1);
+	}
+	return &fs->hash[h];
+}
+
+static void addsym(DebugState *ds, TString *name, char kind, int idx)
+{
+	FrameSyms *fs = &ds->syms;
+	FrameSym *sym;
+	int *slot;
+	if (fs->nsyms == fs->sizesyms) {
+		int size = fs->sizesyms ? fs->sizesyms * 2 : 16;
+		fs->syms = DBGREALLOC(ds, fs->syms, size * sizeof(FrameSym));
+		fs->sizesyms = size;  /* only once it is allocated, DBGREALLOC may throw */
+	}
+	slot = symslot(fs, name);
+	if (*slot && kind == 'u') {
+		return;  /* shadowed by a local, or an upvalue of the same name */
+	}
+	sym = &fs->syms[fs->nsyms++];
+	sym->name = name;
+	sym->kind = kind;
+	sym->idx = idx;
+	*slot = fs->nsyms;  /* a later local takes the name over */
+}
+
+/* resolve the names of the selected frame once per pause and frame */
+static FrameSyms* framesyms(DebugState *ds)
 {
+	FrameSyms *fs = &ds->syms;
 	CallInfo *ci = ds->ci;
-	LClosure *cl = clLvalue(ci->func);
-	Proto *p = cl->p;
-	int i;
-	/* for searching in locals */
-	LocVar *locs;
-	int pc;
-	/* for searching in upvals */
-	Upvaldesc *ups;
-	/* for searching in global table */
-	Table *reg;
-	const TValue *gt, *gv;
+	Proto *p = ci_func(ci)->p;
+	int pc, i, n;
+
+	if (fs->ci == ci && fs->savedpc == ci->u.l.savedpc) {
+		return fs;
+	}
+	fs->ci = NULL;  /* until it is complete, anything below may throw */
+	fs->nsyms = 0;
+	n = p->sizelocvars + p->sizeupvalues;
+	if (fs->sizehash < 2 * n) {
+		int size;
+		for (size = 16; size < 2 * n; size *= 2);
+		DBGFREE(ds, fs->hash);
+		fs->hash = NULL;
+		fs->sizehash = 0;
+		fs->hash = DBGMALLOC(ds, size * sizeof(int));
+		fs->sizehash = size;
+	}
+	memset(fs->hash, 0, fs->sizehash * sizeof(int));
 
-	locs = p->locvars;
 	pc = currentpc(ci);
-	for (i = p->sizelocvars - 1; i >= 0; i--) {
-		if (locs[i].varname == name && locs[i].startpc <= pc && locs[i].endpc > pc) {
-			setobj(ds->L, v, ci->u.l.base + i);
-			return 'l';
+	for (i = 0; i < p->sizelocvars && p->locvars[i].startpc <= pc; i++) {
+		if (pc < p->locvars[i].endpc) {
+			addsym(ds, p->locvars[i].varname, 'l', fs->nsyms);
 		}
 	}
-
-	ups = p->upvalues;
+	fs->nlocals = fs->nsyms;
 	for (i = 0; i < p->sizeupvalues; i++) {
-		if (ups[i].name == name) {
-			setobj(ds->L, v, cl->upvals[i]->v);
-			return 'u';
+		if (p->upvalues[i].name) {
+			addsym(ds, p->upvalues[i].name, 'u', i);
 		}
 	}
+	fs->ci = ci;
+	fs->savedpc = ci->u.l.savedpc;
+	return fs;
+}
+
+static const FrameSym* findsym(DebugState *ds, const TString *name)
+{
+	FrameSyms *fs = framesyms(ds);
+	int idx = *symslot(fs, name);
+	return idx ? &fs->syms[idx - 1] : NULL;
+}
+
+static char findvar(DebugState *ds, TString *name, TValue *v)
+{
+	CallInfo *ci = ds->ci;
+	const FrameSym *sym = findsym(ds, name);
+	/* for searching in global table */
+	Table *reg;
+	const TValue *gt, *gv;
+
+	if (sym && sym->kind == 'l') {
+		setobj(ds->L, v, ci->u.l.base + sym->idx);
+		return 'l';
+	} else if (sym) {
+		setobj(ds->L, v, clLvalue(ci->func)->upvals[sym->idx]->v);
+		return 'u';
+	}
 
 	reg = hvalue(&G(ds->L)->l_registry);
 	gt = luaH_getint(reg, LUA_RIDX_GLOBALS);
@@ -1219,7 +1986,23 @@ static void info_breaks(DebugState *ds)
 {
 	BreakPoint *bp = ds->bplist;
 	while (bp != NULL) {
-		obpushfstr(ds, "#%02d %s:%d\n", bp->id, getstr(bp->srcfile->filepath), bp->line);
+		BreakSite *site;
+		int nsites = 0;
+		for (site = bp->sites; site; site = site->next) {
+			nsites++;
+		}
+		if (bp->pendingpath) {
+			obpushfstr(ds, "#%02d %s:%d (pending)", bp->id, bp->pendingpath, bp->line);
+		} else {
+			obpushfstr(ds, "#%02d %s:%d", bp->id, bp->srcfile->filepath, bp->line);
+		}
+		if (nsites > 1) {
+			obpushfstr(ds, " (%d loaded versions)", nsites);
+		}
+		if (bp->flags & BP_DISABLED) {
+			obpushstr(ds, SIZEDCSTR(" disabled"));
+		}
+		obpushstr(ds, SIZEDCSTR("\n"));
 		bp = bp->next;
 	}
 }
@@ -1227,21 +2010,18 @@ static void info_breaks(DebugState *ds)
 static void info_locals(DebugState *ds)
 {
 	CallInfo *ci = ds->ci;
-	LClosure *cl = ci_func(ci);
-	Proto *p = cl->p;
+	Proto *p = ci_func(ci)->p;
+	FrameSyms *fs = framesyms(ds);
 	int i;
-	LocVar *locs;
-	int pc;
-	
-	locs = p->locvars;
-	pc = currentpc(ci);
-	for (i = p->sizelocvars - 1; i >= 0; i--) {
-		/* FIXME: we have the problem of conlicted locals with the same name  */
-		if (locs[i].startpc <= pc && locs[i].endpc > pc) {
-			obpushfstr(ds, "%s = ", getstr(locs[i].varname));
-			printvalue(ds, ci->u.l.base + i, 0);
-			obpushstr(ds, SIZEDCSTR("\n"));
+
+	for (i = fs->nlocals - 1; i >= 0; i--) {
+		FrameSym *sym = &fs->syms[i];
+		obpushfstr(ds, "%s = ", getstr(sym->name));
+		printvalue(ds, ci->u.l.base + sym->idx, 0);
+		if (findsym(ds, sym->name) != sym) {
+			obpushstr(ds, SIZEDCSTR(" (shadowed)"));
 		}
+		obpushstr(ds, SIZEDCSTR("\n"));
 	}
 
 	if (p->is_vararg) {
@@ -1301,48 +2081,601 @@ static void info_args(DebugState *ds)
 	}
 }
 
-static void cmd_info(DebugState *ds)
+/*
+** Heap statistics. The collector's object lists are walked directly and
+** nothing is allocated in the Lua heap, so measuring does not disturb
+** what is being measured.
+*/
+#define HEAP_TOPN			20
+#define HEAP_MAXTOPN		1000
+#define HEAP_PATHBUDGET		(1 << 20)	/* tables visited looking for paths */
+#define HEAP_MAXPATHLEN		32
+
+static const char *const heaptypenames[HT_NTYPES] = {
+	"table", "short string", "long string", "userdata", "Lua function",
+	"C function", "prototype", "thread", "other",
+};
+
+static const char *const gcstatenames[] = {
+	"propagate", "atomic", "sweep allgc", "sweep finobj", "sweep tobefnz",
+	"sweep end", "call finalizers", "pause",
+};
+
+typedef void (*HeapVisitor)(void *ud, GCObject *o);
+
+static void walkheap(global_State *g, HeapVisitor visit, void *ud)
 {
-	const struct InfoEntry {
-		const char *type;
-		void (*handler)(DebugState*);
-	}infotable[] = {
-		{"breaks", info_breaks},
-		{"upvals", info_upvals},
-		{"locals", info_locals},
-		{"args", info_args},
-		{NULL, NULL},
-	};
-	const char *what = ds->argv[1];
-	const struct InfoEntry *e = infotable;
-	while (e->type) {
-		if (strcmp(e->type, what) == 0) {
-			e->handler(ds);
-			return;
+	GCObject *lists[4];
+	GCObject *o;
+	int i;
+
+	lists[0] = g->allgc;
+	lists[1] = g->finobj;
+	lists[2] = g->tobefnz;
+	lists[3] = g->fixedgc;
+	for (i = 0; i < 4; i++) {
+		for (o = lists[i]; o != NULL; o = o->next) {
+			visit(ud, o);
 		}
-		e++;
 	}
-	obpushstr(ds, SIZEDCSTR("usage: info breaks|args|locals|upvals"));
 }
 
-static FileContent* newfilecontent(DebugState *ds, SrcFile *srcfile)
+static int heaptype(const GCObject *o)
 {
-	char *mem, *text;
-	struct stat fst;
-	int fd;
-	FileContent *fc;
-	int binary = 0;
-
-	if (stat(getstr(srcfile->filepath), &fst) < 0 || 
-		(fd = open(getstr(srcfile->filepath), O_RDONLY)) < 0) {
-		return NULL;
+	switch (o->tt) {
+	case LUA_TTABLE: return HT_TABLE;
+	case LUA_TSHRSTR: return HT_SHRSTR;
+	case LUA_TLNGSTR: return HT_LNGSTR;
+	case LUA_TUSERDATA: return HT_USERDATA;
+	case LUA_TLCL: return HT_LCL;
+	case LUA_TCCL: return HT_CCL;
+	case LUA_TPROTO: return HT_PROTO;
+	case LUA_TTHREAD: return HT_THREAD;
+	default: return HT_OTHER;
 	}
+}
 
-	mem = DBGMALLOC(ds, fst.st_size);
-	text = mem;
-	read(fd, mem, fst.st_size);
-	close(fd);
-	
+static size_t tableslots(Table *t)
+{
+	return t->sizearray + (isdummy(t) ? 0 : sizenode(t));
+}
+
+/* bytes owned by an object, as counted by the functions freeing it */
+static size_t objsize(GCObject *o)
+{
+	switch (o->tt) {
+	case LUA_TTABLE: {
+		Table *t = gco2t(o);
+		return sizeof(Table) + sizeof(TValue) * t->sizearray +
+			(isdummy(t) ? 0 : sizeof(Node) * sizenode(t));
+	}
+	case LUA_TSHRSTR:
+		return sizelstring(gco2ts(o)->shrlen);
+	case LUA_TLNGSTR:
+		return sizelstring(gco2ts(o)->u.lnglen);
+	case LUA_TUSERDATA:
+		return sizeudata(gco2u(o));
+	case LUA_TLCL:
+		return sizeLclosure(gco2lcl(o)->nupvalues);
+	case LUA_TCCL:
+		return sizeCclosure(gco2ccl(o)->nupvalues);
+	case LUA_TPROTO: {
+		Proto *p = gco2p(o);
+		return sizeof(Proto) + sizeof(Instruction) * p->sizecode +
+			sizeof(Proto*) * p->sizep + sizeof(TValue) * p->sizek +
+			sizeof(int) * p->sizelineinfo + sizeof(LocVar) * p->sizelocvars +
+			sizeof(Upvaldesc) * p->sizeupvalues;
+	}
+	case LUA_TTHREAD: {
+		lua_State *th = gco2th(o);
+		return sizeof(lua_State) + LUA_EXTRASPACE +
+			sizeof(TValue) * th->stacksize + sizeof(CallInfo) * th->nci;
+	}
+	default:
+		return 0;
+	}
+}
+
+typedef struct HeapTable {
+	Table *t;
+	size_t rank;  /* slot count, or growth in bytes for `heap diff` */
+	size_t slots;
+	size_t bytes;
+}HeapTable;
+
+typedef struct HeapStats {
+	DebugState *ds;
+	global_State *g;
+	int sweeping;
+	size_t count[HT_NTYPES];
+	size_t bytes[HT_NTYPES];
+	size_t ndead;
+	size_t deadbytes;
+	HeapTable *top;  /* min-heap on 'rank' */
+	int ntop;
+	int maxtop;
+	/* for `heap diff` */
+	size_t nmatched;  /* snapshot tables still alive */
+	size_t nnew;
+	size_t newbytes;
+}HeapStats;
+
+static void pushtoptable(HeapStats *hs, Table *t, size_t rank, size_t bytes)
+{
+	HeapTable *top = hs->top;
+	int i, c;
+
+	if (hs->ntop < hs->maxtop) {
+		i = hs->ntop++;
+		while (i > 0 && top[(i - 1) / 2].rank > rank) {
+			top[i] = top[(i - 1) / 2];
+			i = (i - 1) / 2;
+		}
+	} else if (hs->maxtop > 0 && rank > top[0].rank) {
+		i = 0;
+		while ((c = 2 * i + 1) < hs->ntop) {
+			if (c + 1 < hs->ntop && top[c + 1].rank < top[c].rank) {
+				c++;
+			}
+			if (top[c].rank >= rank) {
+				break;
+			}
+			top[i] = top[c];
+			i = c;
+		}
+	} else {
+		return;
+	}
+	top[i].t = t;
+	top[i].rank = rank;
+	top[i].slots = tableslots(t);
+	top[i].bytes = bytes;
+}
+
+static void initheapstats(DebugState *ds, HeapStats *hs)
+{
+	memset(hs, 0, sizeof(*hs));
+	hs->ds = ds;
+	hs->g = G(ds->L);
+	hs->sweeping = issweepphase(hs->g);
+}
+
+/* returns 0 if 'o' is dead and only waits to be swept */
+static int countobject(HeapStats *hs, GCObject *o, size_t bytes)
+{
+	int type;
+	if (hs->sweeping && isdead(hs->g, o)) {
+		hs->ndead++;
+		hs->deadbytes += bytes;
+		return 0;
+	}
+	type = heaptype(o);
+	hs->count[type]++;
+	hs->bytes[type] += bytes;
+	return 1;
+}
+
+static void visitheapstats(void *ud, GCObject *o)
+{
+	HeapStats *hs = ud;
+	size_t bytes = objsize(o);
+	if (countobject(hs, o, bytes) && o->tt == LUA_TTABLE && hs->maxtop > 0) {
+		Table *t = gco2t(o);
+		pushtoptable(hs, t, tableslots(t), bytes);
+	}
+}
+
+/*
+** Paths from the roots to the largest tables, found by a breadth first
+** walk over tables. Edges are table fields, tables used as keys,
+** metatables and the table upvalues of Lua functions stored in fields.
+*/
+enum { PATH_ROOT, PATH_FIELD, PATH_KEY, PATH_META, PATH_UPVAL };
+
+typedef struct PathNode {
+	Table *t;
+	TString *upname;	/* PATH_UPVAL: name of the upvalue */
+	TValue key;			/* PATH_FIELD, PATH_UPVAL: key in the parent */
+	int parent;			/* index of the referring node */
+	int how;
+}PathNode;
+
+typedef struct PathFinder {
+	PathNode *nodes;
+	int nnodes;
+	int maxnodes;
+	int *hash;			/* open addressing, node index + 1 */
+	size_t sizehash;
+	Table **targets;	/* sorted by address */
+	int ntargets;
+	int nfound;
+}PathFinder;
+
+static int cmptableptr(const void *a, const void *b)
+{
+	uintptr_t pa = (uintptr_t)*(Table* const*)a;
+	uintptr_t pb = (uintptr_t)*(Table* const*)b;
+	return pa < pb ? -1 : (pa > pb ? 1 : 0);
+}
+
+static size_t tablehash(const Table *t)
+{
+	return (size_t)(((uintptr_t)t >> 4) * 0x9E3779B97F4A7C15ull);
+}
+
+static int findpathnode(PathFinder *pf, const Table *t)
+{
+	size_t h = tablehash(t) & (pf->sizehash - 1);
+	while (pf->hash[h] != 0) {
+		if (pf->nodes[pf->hash[h] - 1].t == t) {
+			return pf->hash[h] - 1;
+		}
+		h = (h + 1) & (pf->sizehash - 1);
+	}
+	return -1;
+}
+
+static void addpathnode(DebugState *ds, PathFinder *pf, Table *t, int parent,
+	const TValue *key, TString *upname, int how)
+{
+	PathNode *node;
+	size_t h;
+
+	if (pf->nnodes >= pf->maxnodes) {
+		return;
+	}
+	h = tablehash(t) & (pf->sizehash - 1);
+	while (pf->hash[h] != 0) {
+		if (pf->nodes[pf->hash[h] - 1].t == t) {
+			return;
+		}
+		h = (h + 1) & (pf->sizehash - 1);
+	}
+	node = &pf->nodes[pf->nnodes];
+	node->t = t;
+	node->upname = upname;
+	if (key) {
+		setobj(ds->L, &node->key, key);
+	} else {
+		setnilvalue(&node->key);
+	}
+	node->parent = parent;
+	node->how = how;
+	pf->hash[h] = ++pf->nnodes;
+	if (bsearch(&t, pf->targets, pf->ntargets, sizeof(Table*), cmptableptr)) {
+		pf->nfound++;
+	}
+}
+
+static void addpathupvals(DebugState *ds, PathFinder *pf, LClosure *cl,
+	int parent, const TValue *key)
+{
+	int i;
+	for (i = 0; i < cl->nupvalues; i++) {
+		UpVal *uv = cl->upvals[i];
+		if (uv && ttistable(uv->v)) {
+			addpathnode(ds, pf, hvalue(uv->v), parent, key,
+				cl->p->upvalues[i].name, PATH_UPVAL);
+		}
+	}
+}
+
+static void addpathvalue(DebugState *ds, PathFinder *pf, const TValue *v,
+	int parent, const TValue *key)
+{
+	if (ttistable(v)) {
+		addpathnode(ds, pf, hvalue(v), parent, key, NULL, PATH_FIELD);
+	} else if (ttisLclosure(v)) {
+		addpathupvals(ds, pf, clLvalue(v), parent, key);
+	}
+}
+
+static void findtablepaths(DebugState *ds, PathFinder *pf)
+{
+	global_State *g = G(ds->L);
+	Table *reg = hvalue(&g->l_registry);
+	const TValue *gt = luaH_getint(reg, LUA_RIDX_GLOBALS);
+	TValue rootname;
+	int i;
+
+	if (ttistable(gt)) {
+		setivalue(&rootname, 0);
+		addpathnode(ds, pf, hvalue(gt), -1, &rootname, NULL, PATH_ROOT);
+	}
+	setivalue(&rootname, 1);
+	addpathnode(ds, pf, reg, -1, &rootname, NULL, PATH_ROOT);
+
+	for (i = 0; i < pf->nnodes && pf->nfound < pf->ntargets; i++) {
+		Table *t = pf->nodes[i].t;
+		unsigned int k;
+		TValue key;
+
+		if (t->metatable) {
+			addpathnode(ds, pf, t->metatable, i, NULL, NULL, PATH_META);
+		}
+		for (k = 0; k < t->sizearray; k++) {
+			if (!ttisnil(&t->array[k])) {
+				setivalue(&key, (lua_Integer)k + 1);
+				addpathvalue(ds, pf, &t->array[k], i, &key);
+			}
+		}
+		if (isdummy(t)) {
+			continue;
+		}
+		for (k = 0; k < (unsigned int)sizenode(t); k++) {
+			Node *n = gnode(t, k);
+			if (ttisnil(gval(n))) {
+				continue;
+			}
+			addpathvalue(ds, pf, gval(n), i, gkey(n));
+			if (ttistable(gkey(n))) {
+				addpathnode(ds, pf, hvalue(gkey(n)), i, NULL, NULL, PATH_KEY);
+			}
+		}
+	}
+}
+
+static int isidentifier(const char *s, size_t len)
+{
+	size_t i;
+	if (len == 0 || !(isalpha((unsigned char)s[0]) || s[0] == '_')) {
+		return 0;
+	}
+	for (i = 1; i < len; i++) {
+		if (!(isalnum((unsigned char)s[i]) || s[i] == '_')) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static void pushpathkey(DebugState *ds, const TValue *k)
+{
+	if (ttisstring(k)) {
+		const char *s = svalue(k);
+		size_t len = vslen(k);
+		if (isidentifier(s, len)) {
+			obpushstr(ds, SIZEDCSTR("."));
+			obpushstr(ds, s, len);
+		} else {
+			obpushstr(ds, SIZEDCSTR("[\""));
+			obpushstr(ds, s, len > 40 ? 40 : len);
+			obpushstr(ds, len > 40 ? "...\"]" : "\"]", len > 40 ? 5 : 2);
+		}
+	} else if (ttisinteger(k)) {
+		obpushfstr(ds, "[%lld]", (long long)ivalue(k));
+	} else if (ttisfloat(k)) {
+		obpushfstr(ds, "[%.14g]", (double)fltvalue(k));
+	} else if (ttisboolean(k)) {
+		obpushfstr(ds, "[%s]", bvalue(k) ? "true" : "false");
+	} else {
+		obpushfstr(ds, "[<%s>]", ttypename(ttnov(k)));
+	}
+}
+
+static void pushtablepath(DebugState *ds, PathFinder *pf, int idx)
+{
+	int chain[HEAP_MAXPATHLEN];
+	int n = 0;
+
+	while (idx >= 0 && n < HEAP_MAXPATHLEN) {
+		chain[n++] = idx;
+		idx = pf->nodes[idx].parent;
+	}
+	if (idx >= 0) {
+		obpushstr(ds, SIZEDCSTR("..."));
+	}
+	while (n-- > 0) {
+		PathNode *node = &pf->nodes[chain[n]];
+		switch (node->how) {
+		case PATH_ROOT:
+			if (ivalue(&node->key) == 0) {
+				obpushstr(ds, SIZEDCSTR("_G"));
+			} else {
+				obpushstr(ds, SIZEDCSTR("registry"));
+			}
+			break;
+		case PATH_FIELD:
+			pushpathkey(ds, &node->key);
+			break;
+		case PATH_KEY:
+			obpushstr(ds, SIZEDCSTR("[<key>]"));
+			break;
+		case PATH_META:
+			obpushstr(ds, SIZEDCSTR("<metatable>"));
+			break;
+		case PATH_UPVAL:
+			pushpathkey(ds, &node->key);
+			obpushfstr(ds, "<upvalue %s>", node->upname ? getstr(node->upname) : "?");
+			break;
+		}
+	}
+}
+
+static int cmpheaptable(const void *a, const void *b)
+{
+	const HeapTable *ta = a, *tb = b;
+	return ta->rank < tb->rank ? 1 : (ta->rank > tb->rank ? -1 : 0);
+}
+
+/*
+** Sort 'hs->top' by rank and look for paths to its tables. Every table
+** is visited once at most, so the search needs no more nodes than there
+** are live tables. It all lives in the arena, gone after the command
+** even if it throws.
+*/
+static void preparepaths(DebugState *ds, PathFinder *pf, HeapStats *hs)
+{
+	size_t ntables = hs->count[HT_TABLE];
+	int i;
+
+	qsort(hs->top, hs->ntop, sizeof(HeapTable), cmpheaptable);
+	memset(pf, 0, sizeof(*pf));
+	pf->maxnodes = ntables < HEAP_PATHBUDGET ? (int)ntables + 1 : HEAP_PATHBUDGET;
+	pf->sizehash = 16;
+	while (pf->sizehash < (size_t)pf->maxnodes * 2) {
+		pf->sizehash *= 2;
+	}
+	pf->nodes = arenaalloc(ds, sizeof(PathNode) * pf->maxnodes);
+	pf->hash = arenaalloc(ds, sizeof(int) * pf->sizehash);
+	memset(pf->hash, 0, sizeof(int) * pf->sizehash);
+	pf->targets = arenaalloc(ds, sizeof(Table*) * (hs->ntop + 1));
+	for (i = 0; i < hs->ntop; i++) {
+		pf->targets[i] = hs->top[i].t;
+	}
+	pf->ntargets = hs->ntop;
+	qsort(pf->targets, pf->ntargets, sizeof(Table*), cmptableptr);
+	findtablepaths(ds, pf);
+}
+
+static void pushpathof(DebugState *ds, PathFinder *pf, Table *t)
+{
+	int idx = findpathnode(pf, t);
+	if (idx >= 0) {
+		pushtablepath(ds, pf, idx);
+	} else {
+		obpushstr(ds, SIZEDCSTR("(no path found)"));
+	}
+	obpushstr(ds, SIZEDCSTR("\n"));
+}
+
+static void notepathbudget(DebugState *ds, PathFinder *pf)
+{
+	if (pf->nfound < pf->ntargets && pf->nnodes >= HEAP_PATHBUDGET) {
+		obpushfstr(ds, "\npath search stopped after %d tables\n", pf->nnodes);
+	}
+}
+
+static void heaptables(DebugState *ds, HeapStats *hs)
+{
+	PathFinder pf;
+	int i;
+
+	preparepaths(ds, &pf, hs);
+	obpushstr(ds, SIZEDCSTR("\n      slots        bytes  table\n"));
+	for (i = 0; i < hs->ntop; i++) {
+		HeapTable *ht = &hs->top[i];
+		obpushfstr(ds, "%11lu %12lu  %p  ", (unsigned long)ht->slots,
+			(unsigned long)ht->bytes, (void*)ht->t);
+		pushpathof(ds, &pf, ht->t);
+	}
+	notepathbudget(ds, &pf);
+}
+
+/* info heap [tables [top] [n]] */
+static void info_heap(DebugState *ds)
+{
+	global_State *g = G(ds->L);
+	HeapStats hs;
+	size_t objcount = 0, objbytes = 0;
+	lu_mem total = gettotalbytes(g);
+	int i;
+
+	initheapstats(ds, &hs);
+	if (ds->argc > 2) {
+		int argi = 3;
+		if (strcmp(ds->argv[2], "tables") != 0) {
+			obpushstr(ds, SIZEDCSTR("usage: info heap [tables [top] [n]]"));
+			return;
+		}
+		if (argi < ds->argc && strcmp(ds->argv[argi], "top") == 0) {
+			argi++;
+		}
+		hs.maxtop = argi < ds->argc ? atoi(ds->argv[argi]) : HEAP_TOPN;
+		if (hs.maxtop <= 0) {
+			hs.maxtop = HEAP_TOPN;
+		} else if (hs.maxtop > HEAP_MAXTOPN) {
+			hs.maxtop = HEAP_MAXTOPN;
+		}
+		hs.top = arenaalloc(ds, sizeof(HeapTable) * hs.maxtop);
+	}
+	walkheap(g, visitheapstats, &hs);
+
+	obpushfstr(ds, "%lu bytes in use (GCdebt %ld), collector state: %s\n",
+		(unsigned long)total, (long)g->GCdebt,
+		g->gcstate < sizeof(gcstatenames) / sizeof(gcstatenames[0]) ?
+			gcstatenames[g->gcstate] : "?");
+	obpushstr(ds, SIZEDCSTR("\ntype               objects          bytes\n"));
+	for (i = 0; i < HT_NTYPES; i++) {
+		if (hs.count[i] == 0) {
+			continue;
+		}
+		obpushfstr(ds, "%-14s %11lu %14lu\n", heaptypenames[i],
+			(unsigned long)hs.count[i], (unsigned long)hs.bytes[i]);
+		objcount += hs.count[i];
+		objbytes += hs.bytes[i];
+	}
+	obpushfstr(ds, "%-14s %11lu %14lu\n", "total", (unsigned long)objcount,
+		(unsigned long)objbytes);
+	if (hs.ndead > 0) {
+		obpushfstr(ds, "\n%lu dead objects (%lu bytes) not yet swept\n",
+			(unsigned long)hs.ndead, (unsigned long)hs.deadbytes);
+	}
+	if (total > objbytes + hs.deadbytes) {
+		obpushfstr(ds, "\n%lu bytes outside objects (upvalues, string table, buffers)\n",
+			(unsigned long)(total - objbytes - hs.deadbytes));
+	}
+	if (hs.top) {
+		heaptables(ds, &hs);
+	}
+}
+
+static void info_watches(DebugState *ds);
+
+static void cmd_info(DebugState *ds)
+{
+	const struct InfoEntry {
+		const char *type;
+		void (*handler)(DebugState*);
+	}infotable[] = {
+		{"breaks", info_breaks},
+		{"upvals", info_upvals},
+		{"locals", info_locals},
+		{"args", info_args},
+		{"heap", info_heap},
+		{"watches", info_watches},
+		{NULL, NULL},
+	};
+	const char *what = ds->argc > 1 ? ds->argv[1] : NULL;
+	const struct InfoEntry *e = infotable;
+	while (what && e->type) {
+		if (strcmp(e->type, what) == 0) {
+			e->handler(ds);
+			return;
+		}
+		e++;
+	}
+	obpushstr(ds, SIZEDCSTR("usage: info breaks|args|locals|upvals|heap|watches"));
+}
+
+static void freefilecontent(FileContent *fc)
+{
+	if (fc->text) {
+		free(fc->linepos);
+		free(fc->mem);
+	}
+	fc->srcfile->ud = NULL;
+	free(fc);
+}
+
+static FileContent* newfilecontent(DebugState *ds, SrcFile *srcfile)
+{
+	char *mem, *text;
+	struct stat fst;
+	int fd;
+	FileContent *fc;
+	int binary = 0;
+
+	if (stat(srcfile->filepath, &fst) < 0 || 
+		(fd = open(srcfile->filepath, O_RDONLY)) < 0) {
+		return NULL;
+	}
+
+	mem = DBGMALLOC(ds, fst.st_size);
+	text = mem;
+	read(fd, mem, fst.st_size);
+	close(fd);
+	
 	/* skip BOM */
 	if (fst.st_size >= 3) {
 		if (strncmp(mem, "\xEF\xBB\xBF", 3) == 0) {
@@ -1373,6 +2706,7 @@ static FileContent* newfilecontent(DebugState *ds, SrcFile *srcfile)
 
 	fc = DBGMALLOC(ds, sizeof(FileContent));
 	fc->srcfile = srcfile;
+	fc->mem = text ? mem : NULL;
 	fc->text = text;
 	if (text) {
 		const char *s, *e;
@@ -1427,10 +2761,16 @@ static void updatecifilepos(DebugState *ds)
 	LClosure *cl;
 	SrcFile *srcfile;
 	cl = clLvalue(ci->func);
+	ds->syms.ci = NULL;
 	ds->rtline = currentline(ci);
-	srcfile = cl->p->srcfile;
-	if (!srcfile->ud) {
-		newfilecontent(ds, srcfile);
+	srcfile = luaE_protosrcfile(ds->L, cl->p);
+	if (srcfile) {
+		if (!srcfile->ud) {
+			newfilecontent(ds, srcfile);
+		}
+		ds->rtsrcname = srcfile->filepath;
+	} else {
+		ds->rtsrcname = cl->p->source ? getstr(cl->p->source) : "?";
 	}
 	ds->rtsrcfile = srcfile;
 }
@@ -1447,7 +2787,7 @@ static void listsrc(DebugState *ds, SrcFile *srcfile, int sline,  int nline)
 	if (!fc) {
 		fc = newfilecontent(ds, srcfile);
 		if (!fc) {
-			obpushfstr(ds, "<failed to access \"%s\">", getstr(srcfile->filepath));
+			obpushfstr(ds, "<failed to access \"%s\">", srcfile->filepath);
 			return;
 		}
 	}
@@ -1485,6 +2825,10 @@ static void listsrc(DebugState *ds, SrcFile *srcfile, int sline,  int nline)
 
 static void listrtsrc(DebugState *ds)
 {
+	if (!ds->rtsrcfile) {
+		obpushstr(ds, SIZEDCSTR("<source not available>\n"));
+		return;
+	}
 	listsrc(ds, ds->rtsrcfile, ds->rtline - 2, ds->conf.listsize);
 }
 
@@ -1494,13 +2838,27 @@ static void listlast(DebugState *ds)
 	FileContent *fc;
 	assert(srcfile);
 	fc = (FileContent*)srcfile->ud;
-	if (ds->lastlistline > fc->lines) {
+	if (fc && ds->lastlistline > fc->lines) {
 		obpushstr(ds, "<EOF>", 5);
 	} else {
 		listsrc(ds, srcfile, ds->lastlistline, ds->conf.listsize);
 	}
 }
 
+static SrcFile* getsrcfile(DebugState *ds, const char *filepath)
+{
+	int nmatch;
+	SrcFile *srcfile = luaE_getsrcfile(ds->L, filepath, &nmatch);
+	if (!srcfile) {
+		if (nmatch > 1) {
+			obpushfstr(ds, "file \"%s\" is ambiguous (%d matches)", filepath, nmatch);
+		} else {
+			obpushfstr(ds, "file \"%s\" not found", filepath);
+		}
+	}
+	return srcfile;
+}
+
 static void cmd_list(DebugState *ds)
 {
 	SrcFile *srcfile;
@@ -1511,9 +2869,8 @@ static void cmd_list(DebugState *ds)
 		return;
 	}
 
-	srcfile = luaE_getsrcfile(ds->L, ds->argv[1]);
+	srcfile = getsrcfile(ds, ds->argv[1]);
 	if (!srcfile) {
-		obpushstr(ds, SIZEDCSTR("file not found"));
 		return;
 	}
 
@@ -1547,512 +2904,4313 @@ static void cmd_frame(DebugState *ds)
 	}
 	ds->ci = ci;
 	updatecifilepos(ds);
-	obpushfstr(ds, "in \"%s\":\n", getstr(ds->rtsrcfile->filepath));
+	obpushfstr(ds, "in \"%s\":\n", ds->rtsrcname);
 	listrtsrc(ds);
 }
 
-static void pushfuncname(DebugState *ds, lua_Debug *ar) 
+static CallName* namecacheslot(DebugState *ds, const Proto *p, int pc)
 {
-	if (*ar->namewhat != '\0') { /* is there a name from code? */
-    	obpushfstr(ds, "%s '%s'", ar->namewhat, ar->name);  /* use it */
-	} else if (*ar->what == 'm') { /* main? */
-		obpushstr(ds, SIZEDCSTR("main chunk"));
-	} else if (*ar->what != 'C') {/* for Lua functions, use <file:line> */
-		obpushfstr(ds, "function <%s:%d>", ar->short_src, ar->linedefined);
-	} else {/* nothing left... */
-    	obpushstr(ds, "?", 1);
-	}
+	return &ds->namecache[(cast(size_t, p) >> 3 ^ cast(size_t, pc) * 31) & (NAMECACHE_SIZE - 1)];
 }
 
-static void cmd_backtrace(DebugState *ds)
+/* 'p' is freed: another Proto may get its address */
+static void forgetcallnames(DebugState *ds, const Proto *p)
 {
-	lua_Debug ar;
-	lua_State *L = ds->L;
-	int level = 0;
-	while (lua_getstack(L, level++, &ar)) {
-		lua_getinfo(L, "Slnt", &ar);
-		obpushfstr(ds, ar.i_ci == ds->ci ? "->  %s:" : "    %s:", ar.short_src);
-		if (ar.currentline > 0) {
-			obpushfstr(ds, "%d:", ar.currentline);
-		}
-		obpushstr(ds, SIZEDCSTR(" in "));
-		pushfuncname(ds, &ar);
-		if (ar.istailcall) {
-			obpushstr(ds, SIZEDCSTR("\n    (...tail calls...)"));
+	int pc;
+	for (pc = 0; pc < p->sizecode; pc++) {
+		CallName *cn = namecacheslot(ds, p, pc);
+		if (cn->p == p) {
+			cn->p = NULL;
 		}
-		obpushstr(ds, SIZEDCSTR("\n"));
 	}
 }
 
-static Proto* findproto(Proto *p, int line)
-{	
-	int i;
-	Proto *retp;
-	if (p->linedefined && (line < p->linedefined || line > p->lastlinedefined)) {
+/*
+** The name getfuncname would give 'ci', with the decoding of the calling
+** instruction cached by (Proto, pc) across pauses.
+*/
+static const char* callname(DebugState *ds, CallInfo *ci, const char **name)
+{
+	CallInfo *caller = ci->previous;
+	CallName *cn;
+	Proto *p;
+	int pc;
+
+	if (ci->callstatus & CIST_FIN) {
+		*name = "__gc";
+		return "metamethod";
+	}
+	if ((ci->callstatus & CIST_TAIL) || !isLua(caller)) {
 		return NULL;
 	}
-	for (i = 0; i < p->sizep; i++) {
-		retp = findproto(p->p[i], line);
-		if (retp) {
-			return retp;
+	p = ci_func(caller)->p;
+	pc = currentpc(caller);
+	if ((caller->callstatus & CIST_HOOKED) || GET_OPCODE(p->code[pc]) == OP_INTERRUPT) {
+		/* not a property of the code, or the code is patched for now */
+		return funcnamefromcode(ds->L, caller, name);
+	}
+	cn = namecacheslot(ds, p, pc);
+	if (cn->p != p || cn->pc != pc) {
+		const char *namewhat = funcnamefromcode(ds->L, caller, name);
+		if (namewhat && strlen(*name) >= CALLNAME_SIZE) {
+			cn->p = NULL;
+			return namewhat;
+		}
+		cn->p = p;
+		cn->pc = pc;
+		cn->namewhat = namewhat;
+		if (namewhat) {
+			strcpy(cn->name, *name);
 		}
 	}
-	return p;
+	*name = cn->name;
+	return cn->namewhat;
 }
 
-
-static BreakPoint* newbreakpoint(DebugState *ds)
+static void pushframe(DebugState *ds, CallInfo *ci)
 {
-	BreakPoint *bp = ds->freebp;
-	if (!bp) {
-		bp = DBGMALLOC(ds, sizeof(*bp));
-		memset(bp, 0, sizeof(*bp));
-		bp->id = ds->bpid++;
+	char buff[LUA_IDSIZE];
+	const char *namewhat, *name;
+	Proto *p = isLua(ci) ? ci_func(ci)->p : NULL;
+
+	if (p) {
+		luaO_chunkid(buff, p->source ? getstr(p->source) : "=?", LUA_IDSIZE);
+		obpushfstr(ds, ci == ds->ci ? "->  %s:" : "    %s:", buff);
+		if (currentline(ci) > 0) {
+			obpushfstr(ds, "%d:", currentline(ci));
+		}
 	} else {
-		int id = bp->id;
-		ds->freebp = bp->next;
-		memset(bp, 0, sizeof(*bp));
-		bp->id = id;
+		obpushstr(ds, SIZEDCSTR("    [C]:"));
 	}
-	bp->flags = 0;
-	bp->next = ds->bplist;
-	ds->bplist = bp;
-	ds->nr_bp++;
-	return bp;
+	obpushstr(ds, SIZEDCSTR(" in "));
+	if ((namewhat = callname(ds, ci, &name)) != NULL) {
+		obpushfstr(ds, "%s '%s'", namewhat, name);
+	} else if (p && p->linedefined == 0) {
+		obpushstr(ds, SIZEDCSTR("main chunk"));
+	} else if (p) {
+		obpushfstr(ds, "function <%s:%d>", buff, p->linedefined);
+	} else {
+		obpushstr(ds, "?", 1);
+	}
+	if (ci->callstatus & CIST_TAIL) {
+		obpushstr(ds, SIZEDCSTR("\n    (...tail calls...)"));
+	}
+	obpushstr(ds, SIZEDCSTR("\n"));
 }
 
-static BreakPoint* getbreakpoint(DebugState *ds, int id)
+/*
+** backtrace [N|-N]: the innermost or outermost N frames. The CallInfo
+** chain is walked once, where lua_getstack would restart from the top
+** for every level.
+*/
+static void cmd_backtrace(DebugState *ds)
 {
-	if (id == ID_PSEUDOBP) {
-		return &ds->pseudobp;
-	} else {
-		BreakPoint *bp = ds->bplist;
-		while (bp && bp->id != id) {
-			bp = bp->next;
+	lua_State *L = ds->L;
+	CallInfo *ci;
+	int depth = 0, skip = 0, limit, n;
+
+	for (ci = L->ci; ci != &L->base_ci; ci = ci->previous) {
+		depth++;
+	}
+	limit = depth;
+	if (ds->argc > 1) {
+		n = atoi(ds->argv[1]);
+		if (n == 0) {
+			obpushstr(ds, SIZEDCSTR("usage: backtrace [N|-N]"));
+			return;
+		}
+		if (n > 0 && n < depth) {
+			limit = n;
+		} else if (n < 0 && -n < depth) {
+			skip = depth + n;
+			limit = -n;
 		}
-		return bp;
 	}
-}
 
-static void freebreakpoint(DebugState *ds, BreakPoint *bp)
-{
-	BreakPoint **pbp = &ds->bplist;
-	assert(bp != &ds->pseudobp);
-	while (*pbp != bp) {
-		pbp = &bp->next;
+	ci = L->ci;
+	for (n = 0; n < skip; n++) {
+		ci = ci->previous;
+	}
+	if (skip > 0) {
+		obpushfstr(ds, "    (... %d inner frames ...)\n", skip);
+	}
+	for (n = 0; n < limit; n++, ci = ci->previous) {
+		pushframe(ds, ci);
+	}
+	if (skip + limit < depth) {
+		obpushfstr(ds, "    (... %d outer frames ...)\n", depth - skip - limit);
 	}
-	*pbp = bp->next;
-	bp->next = ds->freebp;
-	ds->freebp = bp;
-	ds->nr_bp--;
 }
 
-static BreakPoint* setbreakpoint(DebugState *ds)
+static unsigned int refbucket(ProtoRefs *pr, const Proto *p)
 {
-	int line = 0;
-	SrcFile *srcfile;
-	Proto *p;
-	BreakPoint *bp;
-	int i, codepos;
+	return lmod(cast(unsigned int, cast(size_t, p) >> 3), pr->nbuckets);
+}
 
-	if (ds->nr_bp == MAX_BREAKPOINT) {
-		obpushstr(ds, SIZEDCSTR("too many breakpoints"));
-		return NULL;
+static int growprotorefs(ProtoRefs *pr)
+{
+	int n = pr->nbuckets ? pr->nbuckets * 2 : PROTOREF_MINBUCKETS;
+	ProtoRef **buckets = calloc(n, sizeof(ProtoRef*));
+	int i;
+	if (!buckets) {
+		return 0;
 	}
-	
-	if (ds->argc == 2) {
-		line = atoi(ds->argv[1]);
-		srcfile = ds->rtsrcfile;
-	} else if (ds->argc >= 3) {
-		line = atoi(ds->argv[2]);
-		srcfile = luaE_getsrcfile(ds->L, ds->argv[1]);
-		if (!srcfile) {
-			obpushfstr(ds, "file \"%s\" not found", ds->argv[1]);
-			return NULL;
+	for (i = 0; i < pr->nbuckets; i++) {
+		ProtoRef *ref = pr->buckets[i];
+		while (ref) {
+			ProtoRef *next = ref->next;
+			unsigned int h = lmod(cast(unsigned int, cast(size_t, ref->p) >> 3), n);
+			ref->next = buckets[h];
+			buckets[h] = ref;
+			ref = next;
 		}
 	}
-	
-	if (line <= 0 || !srcfile) {
-		obpushstr(ds, SIZEDCSTR("usage: break <file> <line>"));
+	free(pr->buckets);
+	pr->buckets = buckets;
+	pr->nbuckets = n;
+	return 1;
+}
+
+static ProtoRef* findprotoref(ProtoRefs *pr, const Proto *p)
+{
+	ProtoRef *ref;
+	if (pr->nbuckets == 0) {
 		return NULL;
 	}
+	for (ref = pr->buckets[refbucket(pr, p)]; ref && ref->p != p; ref = ref->next);
+	return ref;
+}
 
-	bp = ds->bplist;
-	while (bp) {
-		if (bp->srcfile == srcfile && bp->line == line) {
-			obpushfstr(ds, "breakpoint #%d already exists", bp->id);
-			return NULL;
-		}
-		bp = bp->next;
+/* Called from lua_load, so it must not throw. */
+static int addprotoref(ProtoRefs *pr, Proto *p, Proto *parent, SrcFile *srcfile)
+{
+	ProtoRef *ref;
+	if (pr->nrefs >= pr->nbuckets && !growprotorefs(pr)) {
+		return 0;
 	}
-
-	p = findproto(srcfile->p, line);
-	codepos = -1;
-	if (p) {
-		for (i = 0; i < p->sizelineinfo; i++) {
-			if (p->lineinfo[i] == line) {
-				codepos = i;
-				break;
-			}
-		}
+	ref = malloc(sizeof(ProtoRef));
+	if (!ref) {
+		return 0;
 	}
+	ref->p = p;
+	ref->parent = parent;
+	ref->srcfile = srcfile;
+	ref->next = pr->buckets[refbucket(pr, p)];
+	pr->buckets[refbucket(pr, p)] = ref;
+	pr->nrefs++;
+	return 1;
+}
 
-	if (codepos == -1) {
-		obpushstr(ds, SIZEDCSTR("invalid file line to set a breakpoint"));
+static ProtoRef* unlinkprotoref(ProtoRefs *pr, const Proto *p)
+{
+	ProtoRef **pref, *ref;
+	if (pr->nbuckets == 0) {
 		return NULL;
 	}
+	pref = &pr->buckets[refbucket(pr, p)];
+	while ((ref = *pref) != NULL && ref->p != p) {
+		pref = &ref->next;
+	}
+	if (ref) {
+		*pref = ref->next;
+		pr->nrefs--;
+	}
+	return ref;
+}
 
-	bp = newbreakpoint(ds);
-	if (bp == NULL) {
-		obpushstr(ds, SIZEDCSTR("too many breakponits"));
-		return NULL;
+static void freeprotorefs(ProtoRefs *pr)
+{
+	int i;
+	for (i = 0; i < pr->nbuckets; i++) {
+		ProtoRef *ref = pr->buckets[i];
+		while (ref) {
+			ProtoRef *next = ref->next;
+			free(ref);
+			ref = next;
+		}
 	}
-	bp->srcfile = srcfile;
-	bp->line = line;
-	bp->p = p;
-	bp->codepos = codepos;
-	bp->code = p->code[codepos];
-	p->code[codepos] = CREATE_Ax(OP_INTERRUPT, bp->id);
-	obpushfstr(ds, "breakpoint #%d set at %s:%d", bp->id, getstr(srcfile->filepath), line);
-	return bp;
+	free(pr->buckets);
+	pr->buckets = NULL;
+	pr->nbuckets = pr->nrefs = 0;
 }
 
-static void cmd_break(DebugState *ds)
+/*
+** A version is tracked entirely or not at all, or a function could be
+** patched and freed unnoticed. Recursion is bounded by the parser, which
+** limits how deeply functions nest.
+*/
+static int trackprotos(ProtoRefs *pr, SrcFile *srcfile, Proto *p, Proto *parent)
 {
-	setbreakpoint(ds);
+	int i;
+	if (!addprotoref(pr, p, parent, srcfile)) {
+		return 0;
+	}
+	for (i = 0; i < p->sizep; i++) {
+		if (!trackprotos(pr, srcfile, p->p[i], p)) {
+			return 0;
+		}
+	}
+	return 1;
 }
 
-static void cmd_tb(DebugState *ds)
+static void untrackprotos(ProtoRefs *pr, Proto *p)
 {
-	BreakPoint *bp = setbreakpoint(ds);
-	if (bp) {
-		bp->flags = BP_TEMP;
+	int i;
+	ProtoRef *ref = unlinkprotoref(pr, p);
+	if (!ref) {
+		return;
+	}
+	free(ref);
+	for (i = 0; i < p->sizep; i++) {
+		untrackprotos(pr, p->p[i]);
 	}
 }
 
-static void enable_breaks(DebugState *ds)
+typedef struct TrackWalk {
+	DebugState *ds;
+	int sweeping;
+	int failed;
+}TrackWalk;
+
+static void visittrackproto(void *ud, GCObject *o)
 {
-	int num = 0;
-	if (ds->argc > 2) {
-		int i;
-		BreakPoint *bp;
-		int id;
-		for (i = 2; i < ds->argc; i++) {
-			id = atoi(ds->argv[i]);
-			if (id > 0 && id <= MAX_BREAKPOINT) {
-				bp = getbreakpoint(ds, id);
-			} else {
-				bp = NULL;
-			}
-			if (bp) {
-				if (bp->flags & BP_DISABLED) {
-					bp->p->code[bp->codepos] = CREATE_Ax(OP_INTERRUPT, bp->id);
-					num++;
+	TrackWalk *tw = ud;
+	SrcFile *srcfile;
+	if (o->tt != LUA_TPROTO || tw->failed ||
+		(tw->sweeping && isdead(G(tw->ds->L), o))) {
+		return;
+	}
+	srcfile = luaE_protosrcfile(tw->ds->L, gco2p(o));
+	if (srcfile && !addprotoref(&tw->ds->protos, gco2p(o), NULL, srcfile)) {
+		tw->failed = 1;
+	}
+}
+
+/*
+** Functions loaded before the debugger was attached: find them in the
+** heap, then link each nested one to its parent. Without memory for all
+** of them, none is tracked.
+*/
+static void trackloaded(DebugState *ds)
+{
+	ProtoRefs *pr = &ds->protos;
+	TrackWalk tw;
+	int i, j;
+	tw.ds = ds;
+	tw.sweeping = issweepphase(G(ds->L));
+	tw.failed = 0;
+	walkheap(G(ds->L), visittrackproto, &tw);
+	if (tw.failed) {
+		freeprotorefs(pr);
+		return;
+	}
+	for (i = 0; i < pr->nbuckets; i++) {
+		ProtoRef *ref;
+		for (ref = pr->buckets[i]; ref; ref = ref->next) {
+			for (j = 0; j < ref->p->sizep; j++) {
+				ProtoRef *child = findprotoref(pr, ref->p->p[j]);
+				if (child) {
+					child->parent = ref->p;
 				}
-			} else {
-				obpushfstr(ds, "breakpoint #%d not found", id);
 			}
 		}
+	}
+}
+
+/*
+** The version after 'ref' (the first if NULL) of 'srcfile', of any file if
+** NULL. Versions already dead in the sweep in progress are skipped, as
+** their nested functions may be freed before them.
+*/
+static ProtoRef* nextversion(DebugState *ds, SrcFile *srcfile, ProtoRef *ref)
+{
+	ProtoRefs *pr = &ds->protos;
+	global_State *g = G(ds->L);
+	int sweeping = issweepphase(g);
+	int h;
+	if (pr->nbuckets == 0) {
+		return NULL;
+	}
+	if (ref) {
+		h = refbucket(pr, ref->p);
+		ref = ref->next;
 	} else {
-		BreakPoint*bp = ds->bplist;
-		while (bp != NULL) {
-			if ((bp->flags & BP_DISABLED)) {
-				bp->p->code[bp->codepos] = CREATE_Ax(OP_INTERRUPT, bp->id);
-				num++;
+		h = 0;
+		ref = pr->buckets[0];
+	}
+	for (;;) {
+		for (; ref; ref = ref->next) {
+			if (!ref->parent && (!srcfile || ref->srcfile == srcfile) &&
+				!(sweeping && isdead(g, obj2gco(ref->p)))) {
+				return ref;
 			}
-			bp = bp->next;
 		}
+		if (++h == pr->nbuckets) {
+			return NULL;
+		}
+		ref = pr->buckets[h];
 	}
-	obpushfstr(ds, "enabled %d breakpoint(s)", num);
 }
 
-static void cmd_enable(DebugState *ds)
+static void freelineindex(LineIndex *li)
 {
-	if (strncmp(ds->argv[1], SIZEDCSTR("breaks")) == 0) {
-		enable_breaks(ds);
+	int i;
+	for (i = 0; i < li->nfuncs; i++) {
+		free(li->funcs[i].lines);
 	}
+	free(li->funcs);
+	free(li);
 }
 
-static void disable_breaks(DebugState *ds)
+/* the index of the version 'top', which is being freed */
+static void droplineindex(SrcFile *srcfile, Proto *top)
 {
-	int num = 0;
-	if (ds->argc > 2) {
-		int i;
-		BreakPoint *bp;
-		int id;
-		for (i = 2; i < ds->argc; i++) {
-			id = atoi(ds->argv[i]);
-			if (id > 0 && id <= MAX_BREAKPOINT) {
-				bp = getbreakpoint(ds, id);
-			} else {
-				bp = NULL;
-			}
-			if (bp) {
-				if (!(bp->flags & BP_DISABLED)) {
-					bp->p->code[bp->codepos] = bp->code;
-					bp->flags |= BP_DISABLED;
-					num++;
-				}
-			} else {
-				obpushfstr(ds, "breakpoint #%d not found", id);
+	LineIndex **pli = (LineIndex**)&srcfile->lineidx;
+	while (*pli) {
+		LineIndex *li = *pli;
+		if (li->top == top) {
+			*pli = li->next;
+			freelineindex(li);
+			return;
+		}
+		pli = &li->next;
+	}
+}
+
+/* 'srcfile' is freed with the state: free the indexes hung on it */
+void luaG_freesrcfile(SrcFile *srcfile)
+{
+	LineIndex *li = srcfile->lineidx;
+	while (li) {
+		LineIndex *next = li->next;
+		freelineindex(li);
+		li = next;
+	}
+	srcfile->lineidx = NULL;
+}
+
+/*
+** Flatten the function tree of 'top' in preorder, with an explicit stack
+** so deeply nested chunks cannot overflow the C stack.
+*/
+static LineIndex* buildlineindex(Proto *top)
+{
+	LineIndex *li = malloc(sizeof(LineIndex));
+	int *stack = NULL;
+	int sizefuncs = 0, sizestack = 0, nstack = 0;
+	if (!li) {
+		return NULL;
+	}
+	li->top = top;
+	li->funcs = NULL;
+	li->nfuncs = 0;
+	li->next = NULL;
+
+	/* stack holds (function index, next child) pairs */
+	sizestack = 32;
+	stack = malloc(sizestack * sizeof(int));
+	sizefuncs = 16;
+	li->funcs = malloc(sizefuncs * sizeof(FuncLines));
+	if (!stack || !li->funcs) {
+		goto fail;
+	}
+	li->funcs[0].p = top;
+	li->funcs[0].parent = -1;
+	li->funcs[0].lines = NULL;
+	li->funcs[0].nlines = -1;
+	li->nfuncs = 1;
+	stack[0] = 0;
+	stack[1] = 0;
+	nstack = 2;
+	while (nstack > 0) {
+		int fi = stack[nstack - 2];
+		int ci = stack[nstack - 1];
+		Proto *p = li->funcs[fi].p;
+		FuncLines *fl;
+		if (ci >= p->sizep) {
+			nstack -= 2;
+			continue;
+		}
+		stack[nstack - 1] = ci + 1;
+		if (li->nfuncs == sizefuncs) {
+			FuncLines *funcs = realloc(li->funcs, 2 * sizefuncs * sizeof(FuncLines));
+			if (!funcs) {
+				goto fail;
 			}
+			li->funcs = funcs;
+			sizefuncs *= 2;
 		}
-	} else {
-		BreakPoint*bp = ds->bplist;
-		while (bp != NULL) {
-			if (!(bp->flags & BP_DISABLED)) {
-				bp->p->code[bp->codepos] = bp->code;
-				bp->flags |= BP_DISABLED;
-				num++;
+		if (nstack + 2 > sizestack) {
+			int *newstack = realloc(stack, 2 * sizestack * sizeof(int));
+			if (!newstack) {
+				goto fail;
 			}
-			bp = bp->next;
+			stack = newstack;
+			sizestack *= 2;
 		}
+		fl = &li->funcs[li->nfuncs];
+		fl->p = p->p[ci];
+		fl->parent = fi;
+		fl->lines = NULL;
+		fl->nlines = -1;
+		stack[nstack++] = li->nfuncs++;
+		stack[nstack++] = 0;
 	}
-	obpushfstr(ds, "disabled %d breakpoint(s)", num);
+	free(stack);
+	return li;
+
+fail:
+	free(stack);
+	freelineindex(li);
+	return NULL;
 }
 
+static LineIndex* getlineindex(SrcFile *srcfile, Proto *top)
+{
+	LineIndex *li = srcfile->lineidx;
+	while (li && li->top != top) {
+		li = li->next;
+	}
+	if (!li) {
+		li = buildlineindex(top);
+		if (li) {
+			li->next = srcfile->lineidx;
+			srcfile->lineidx = li;
+		}
+	}
+	return li;
+}
 
-static void cmd_disable(DebugState *ds)
+/*
+** The instruction at 'codepos' must not be replaced when the previous one
+** reads or skips it directly rather than through the dispatch loop.
+*/
+static int ispatchable(Proto *p, int codepos)
 {
-	if (strncmp(ds->argv[1], SIZEDCSTR("breaks")) == 0) {
-		disable_breaks(ds);
+	Instruction i;
+	OpCode op;
+	if (codepos == 0) {
+		return 1;
 	}
-	
+	i = p->code[codepos - 1];
+	op = GET_OPCODE(i);
+	return !(testTMode(op) || op == OP_LOADKX || op == OP_TFORCALL ||
+		(op == OP_SETLIST && GETARG_C(i) == 0));
 }
 
-static void* preparecontlua(DebugState *ds)
+static int cmplinepos(const void *a, const void *b)
 {
-	BreakPoint *bp;
-	CallInfo *ci = ds->ci;
-	if (ci != ds->citop) {
-		ci = ds->citop;
-		ds->ci = ci;
-		updatecifilepos(ds);
+	const LinePos *la = a, *lb = b;
+	if (la->line != lb->line) {
+		return la->line < lb->line ? -1 : 1;
 	}
+	return la->codepos - lb->codepos;
+}
 
-	bp = ds->rtbp;
-	if (bp) {
-		bp->p->code[bp->codepos] = bp->code; /*restore user opcode */
-		if (bp->id != ID_PSEUDOBP) {
-			ds->restorebp = bp;
+/*
+** Collect the first patchable instruction of every run of a line, then
+** keep the lowest one per line. Loops put some lines in several runs.
+*/
+static int buildfunclines(FuncLines *fl)
+{
+	Proto *p = fl->p;
+	LinePos *lines;
+	int i, n = 0, line = -1, pending = 0;
+	if (p->sizelineinfo == 0) {
+		fl->nlines = 0;
+		return 1;
+	}
+	lines = malloc(p->sizelineinfo * sizeof(LinePos));
+	if (!lines) {
+		return 0;
+	}
+	for (i = 0; i < p->sizelineinfo; i++) {
+		if (p->lineinfo[i] != line) {
+			line = p->lineinfo[i];
+			pending = 1;
+		}
+		if (pending && ispatchable(p, i)) {
+			lines[n].line = line;
+			lines[n].codepos = i;
+			n++;
+			pending = 0;
 		}
-		ci->u.l.savedpc--;
 	}
-	return ci;
+	qsort(lines, n, sizeof(LinePos), cmplinepos);
+	for (i = 0, line = 0; i < n; i++) {
+		if (line == 0 || lines[i].line != lines[line - 1].line) {
+			lines[line++] = lines[i];
+		}
+	}
+	fl->lines = lines;
+	fl->nlines = line;
+	return 1;
 }
 
-static void setpseudobp(DebugState *ds, Proto *p, int codepos)
+static int getfunclines(FuncLines *fl)
 {
-	BreakPoint *bp;
-	bp = &ds->pseudobp;
-	bp->codepos = codepos;
-	bp->p = p;
-	bp->code = p->code[bp->codepos];
-	p->code[bp->codepos] = CREATE_Ax(OP_INTERRUPT, bp->id);
+	return fl->nlines >= 0 || buildfunclines(fl);
 }
 
-static void cmd_step(DebugState *ds)
+static int funclinepos(FuncLines *fl, int line)
 {
-	ds->why_setpause = SETPAUSE_STEP;
-	SETPAUSE(ds);
-	preparecontlua(ds);
-	ds->luacont = 1;
+	int lo = 0, hi;
+	if (!getfunclines(fl)) {
+		return -1;
+	}
+	hi = fl->nlines;
+	while (lo < hi) {
+		int mid = lo + (hi - lo) / 2;
+		if (fl->lines[mid].line < line) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo < fl->nlines && fl->lines[lo].line == line ? fl->lines[lo].codepos : -1;
 }
 
-static void cmd_next(DebugState *ds)
+/*
+** The functions spanning 'line' are the last one defined at or before it
+** and its ancestors; take the innermost of them with code on that line.
+*/
+static int findcodepos(SrcFile *srcfile, Proto *top, int line, Proto **pp)
 {
-	CallInfo *ci;
-	Proto *p;
-	Instruction code;
-	int op;
-	int codepos;
-	int thisline;
-
+	LineIndex *li = getlineindex(srcfile, top);
+	int lo = 0, hi, i;
+	if (!li) {
+		return -1;
+	}
+	hi = li->nfuncs;
+	while (lo < hi) {
+		int mid = lo + (hi - lo) / 2;
+		if (li->funcs[mid].p->linedefined <= line) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	for (i = lo - 1; i >= 0; i = li->funcs[i].parent) {
+		FuncLines *fl = &li->funcs[i];
+		int codepos;
+		if (fl->parent >= 0 && line > fl->p->lastlinedefined) {
+			continue;
+		}
+		codepos = funclinepos(fl, line);
+		if (codepos >= 0) {
+			*pp = fl->p;
+			return codepos;
+		}
+	}
+	return -1;
+}
+
+static void armbreakpoint(BreakPoint *bp)
+{
+	BreakSite *site;
+	for (site = bp->sites; site; site = site->next) {
+		site->p->code[site->codepos] = CREATE_Ax(OP_INTERRUPT, bp->id);
+	}
+}
+
+static void disarmbreakpoint(BreakPoint *bp)
+{
+	BreakSite *site;
+	for (site = bp->sites; site; site = site->next) {
+		site->p->code[site->codepos] = site->code;
+	}
+}
+
+static BreakSite* findbreaksite(BreakPoint *bp, Proto *p, int codepos)
+{
+	BreakSite *site = bp->sites;
+	while (site && (site->p != p || site->codepos != codepos)) {
+		site = site->next;
+	}
+	return site;
+}
+
+/*
+** Instructions replaced by a breakpoint or watchpoint are kept in its
+** sites; a probe installed or removed under one must update them as well.
+*/
+static void replacesavedcode(DebugState *ds, Proto *p, int codepos,
+	Instruction from, Instruction to)
+{
+	BreakPoint *bp;
+	BreakSite *site;
+	WatchPoint *w;
+	WatchSite *wsite;
+	for (bp = ds->bplist; bp; bp = bp->next) {
+		for (site = bp->sites; site; site = site->next) {
+			if (site->p == p && site->codepos == codepos && site->code == from) {
+				site->code = to;
+			}
+		}
+	}
+	site = &ds->pseudosite;
+	if (site->p == p && site->codepos == codepos && site->code == from) {
+		site->code = to;
+	}
+	for (w = ds->watch.list; w; w = w->next) {
+		for (wsite = w->sites; wsite; wsite = wsite->next) {
+			if (wsite->p == p && wsite->codepos == codepos && wsite->code == from) {
+				wsite->code = to;
+			}
+		}
+	}
+}
+
+static int savedcode(DebugState *ds, Proto *p, int codepos, Instruction *code)
+{
+	BreakPoint *bp;
+	BreakSite *site;
+	WatchPoint *w;
+	WatchSite *wsite;
+	for (bp = ds->bplist; bp; bp = bp->next) {
+		for (site = bp->sites; site; site = site->next) {
+			if (site->p == p && site->codepos == codepos &&
+				GET_OPCODE(site->code) != OP_INTERRUPT) {
+				*code = site->code;
+				return 1;
+			}
+		}
+	}
+	site = &ds->pseudosite;
+	if (site->p == p && site->codepos == codepos &&
+		GET_OPCODE(site->code) != OP_INTERRUPT) {
+		*code = site->code;
+		return 1;
+	}
+	for (w = ds->watch.list; w; w = w->next) {
+		for (wsite = w->sites; wsite; wsite = wsite->next) {
+			if (wsite->p == p && wsite->codepos == codepos &&
+				GET_OPCODE(wsite->code) != OP_INTERRUPT) {
+				*code = wsite->code;
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
+
+/*
+** 'site' is about to give its instruction back to run it: if that is a
+** coverage probe, the line is reached, so hand back the user instruction.
+*/
+static void resolveprobe(DebugState *ds, BreakSite *site)
+{
+	Instruction code = site->code;
+	if (GET_OPCODE(code) == OP_INTERRUPT && GETARG_Ax(code) >= PROBE_BASE) {
+		Probe *pr = &ds->cov.probes[GETARG_Ax(code) - PROBE_BASE];
+		pr->hit = 1;
+		replacesavedcode(ds, site->p, site->codepos, code, pr->code);
+	}
+}
+
+/*
+** Resolve 'bp' in one loaded version of its file and patch it there.
+** The site goes away with its function, see luaG_freeproto.
+** Called from lua_load as well, so it must not throw.
+*/
+static int addbreaksite(BreakPoint *bp, Proto *top)
+{
+	BreakSite *site;
+	Proto *p;
+	int codepos = findcodepos(bp->srcfile, top, bp->line, &p);
+	if (codepos < 0 || findbreaksite(bp, p, codepos)) {
+		return 0;
+	}
+	site = malloc(sizeof(BreakSite));
+	if (!site) {
+		return 0;
+	}
+	site->p = p;
+	site->codepos = codepos;
+	site->code = p->code[codepos];
+	site->next = bp->sites;
+	bp->sites = site;
+	if (!(bp->flags & BP_DISABLED)) {
+		p->code[codepos] = CREATE_Ax(OP_INTERRUPT, bp->id);
+	}
+	return 1;
+}
+
+static BreakPoint* newbreakpoint(DebugState *ds)
+{
+	BreakPoint *bp = ds->freebp;
+	if (!bp) {
+		bp = DBGMALLOC(ds, sizeof(*bp));
+		memset(bp, 0, sizeof(*bp));
+		bp->id = ds->bpid++;
+	} else {
+		int id = bp->id;
+		ds->freebp = bp->next;
+		memset(bp, 0, sizeof(*bp));
+		bp->id = id;
+	}
+	bp->flags = 0;
+	bp->next = ds->bplist;
+	ds->bplist = bp;
+	ds->nr_bp++;
+	return bp;
+}
+
+static BreakPoint* getbreakpoint(DebugState *ds, int id)
+{
+	if (id == ID_PSEUDOBP) {
+		return &ds->pseudobp;
+	} else {
+		BreakPoint *bp = ds->bplist;
+		while (bp && bp->id != id) {
+			bp = bp->next;
+		}
+		return bp;
+	}
+}
+
+static BreakPoint** pendingbucket(DebugState *ds, unsigned int h)
+{
+	return &ds->pendingbp[lmod(h, NPENDINGBUCKETS)];
+}
+
+static void unlinkpendingbp(DebugState *ds, BreakPoint *bp)
+{
+	BreakPoint **pbp = pendingbucket(ds, bp->pendinghash);
+	while (*pbp != bp) {
+		pbp = &(*pbp)->pendingnext;
+	}
+	*pbp = bp->pendingnext;
+	DBGFREE(ds, bp->pendingpath);
+	bp->pendingpath = NULL;
+	ds->nr_pendingbp--;
+}
+
+/*
+** Keep a breakpoint for a file which is not loaded yet. It is hashed by
+** the basename of the given path, which is all luaG_srcloaded needs to
+** find the candidates for a newly loaded file.
+*/
+static void setpendingbp(DebugState *ds, BreakPoint *bp, const char *filepath)
+{
+	const char *base = strrchr(filepath, '/');
+	size_t len = strlen(filepath);
+	BreakPoint **pbp;
+
+	base = base ? base + 1 : filepath;
+	bp->pendingpath = DBGMALLOC(ds, len + 1);
+	memcpy(bp->pendingpath, filepath, len + 1);
+	bp->pendinghash = luaS_hash(base, len - (base - filepath), G(ds->L)->seed);
+	pbp = pendingbucket(ds, bp->pendinghash);
+	bp->pendingnext = *pbp;
+	*pbp = bp;
+	ds->nr_pendingbp++;
+}
+
+static void resolvependingbps(DebugState *ds, SrcFile *srcfile)
+{
+	BreakPoint **pbp = pendingbucket(ds, srcfile->bhash);
+	BreakPoint *bp;
+	while ((bp = *pbp) != NULL) {
+		if (bp->pendinghash == srcfile->bhash &&
+			luaE_srcfilematch(srcfile, bp->pendingpath, strlen(bp->pendingpath))) {
+			*pbp = bp->pendingnext;
+			DBGFREE(ds, bp->pendingpath);
+			bp->pendingpath = NULL;
+			bp->srcfile = srcfile;
+			ds->nr_pendingbp--;
+		} else {
+			pbp = &bp->pendingnext;
+		}
+	}
+}
+
+static void freebreakpoint(DebugState *ds, BreakPoint *bp)
+{
+	BreakPoint **pbp = &ds->bplist;
+	BreakSite *site;
+	assert(bp != &ds->pseudobp);
+	while (*pbp != bp) {
+		pbp = &(*pbp)->next;
+	}
+	*pbp = bp->next;
+	if (ds->rtbp == bp) {
+		ds->rtbp = NULL;
+		ds->rtsite = NULL;
+	}
+	if (ds->restorebp == bp) {
+		ds->restorebp = NULL;
+		ds->restoresite = NULL;
+	}
+	if (bp->pendingpath) {
+		unlinkpendingbp(ds, bp);
+	}
+	while ((site = bp->sites) != NULL) {
+		site->p->code[site->codepos] = site->code;
+		bp->sites = site->next;
+		DBGFREE(ds, site);
+	}
+	bp->next = ds->freebp;
+	ds->freebp = bp;
+	ds->nr_bp--;
+}
+
+static BreakPoint* setbreakpoint(DebugState *ds)
+{
+	int line = 0;
+	SrcFile *srcfile = NULL;
+	const char *pendingpath = NULL;
+	BreakPoint *bp;
+	ProtoRef *ref;
+	int nsites, nmatch;
+
+	if (ds->nr_bp == MAX_BREAKPOINT) {
+		obpushstr(ds, SIZEDCSTR("too many breakpoints"));
+		return NULL;
+	}
+	
+	if (ds->argc == 2) {
+		line = atoi(ds->argv[1]);
+		srcfile = ds->rtsrcfile;
+	} else if (ds->argc >= 3) {
+		line = atoi(ds->argv[2]);
+		srcfile = luaE_getsrcfile(ds->L, ds->argv[1], &nmatch);
+		if (!srcfile) {
+			if (nmatch > 1) {
+				obpushfstr(ds, "file \"%s\" is ambiguous (%d matches)", ds->argv[1], nmatch);
+				return NULL;
+			}
+			pendingpath = ds->argv[1];
+		}
+	}
+	
+	if (line <= 0 || (!srcfile && !pendingpath)) {
+		obpushstr(ds, SIZEDCSTR("usage: break <file> <line>"));
+		return NULL;
+	}
+
+	bp = ds->bplist;
+	while (bp) {
+		if (bp->line == line && (srcfile ? bp->srcfile == srcfile :
+			(bp->pendingpath && strcmp(bp->pendingpath, pendingpath) == 0))) {
+			obpushfstr(ds, "breakpoint #%d already exists", bp->id);
+			return NULL;
+		}
+		bp = bp->next;
+	}
+
+	if (pendingpath) {
+		bp = newbreakpoint(ds);
+		bp->line = line;
+		setpendingbp(ds, bp, pendingpath);
+		obpushfstr(ds, "breakpoint #%d pending at %s:%d, the file is not loaded yet",
+			bp->id, pendingpath, line);
+		return bp;
+	}
+
+	bp = newbreakpoint(ds);
+	bp->srcfile = srcfile;
+	bp->line = line;
+	nsites = 0;
+	for (ref = nextversion(ds, srcfile, NULL); ref; ref = nextversion(ds, srcfile, ref)) {
+		nsites += addbreaksite(bp, ref->p);
+	}
+
+	if (nsites == 0) {
+		freebreakpoint(ds, bp);
+		obpushstr(ds, SIZEDCSTR("invalid file line to set a breakpoint"));
+		return NULL;
+	}
+	obpushfstr(ds, "breakpoint #%d set at %s:%d", bp->id, srcfile->filepath, line);
+	if (nsites > 1) {
+		obpushfstr(ds, " in %d loaded versions", nsites);
+	}
+	return bp;
+}
+
+static void cmd_break(DebugState *ds)
+{
+	setbreakpoint(ds);
+}
+
+static void cmd_tb(DebugState *ds)
+{
+	BreakPoint *bp = setbreakpoint(ds);
+	if (bp) {
+		bp->flags = BP_TEMP;
+	}
+}
+
+static void enable_breaks(DebugState *ds)
+{
+	int num = 0;
+	if (ds->argc > 2) {
+		int i;
+		BreakPoint *bp;
+		int id;
+		for (i = 2; i < ds->argc; i++) {
+			id = atoi(ds->argv[i]);
+			if (id > 0 && id <= MAX_BREAKPOINT) {
+				bp = getbreakpoint(ds, id);
+			} else {
+				bp = NULL;
+			}
+			if (bp) {
+				if (bp->flags & BP_DISABLED) {
+					armbreakpoint(bp);
+					bp->flags &= ~BP_DISABLED;
+					num++;
+				}
+			} else {
+				obpushfstr(ds, "breakpoint #%d not found", id);
+			}
+		}
+	} else {
+		BreakPoint*bp = ds->bplist;
+		while (bp != NULL) {
+			if ((bp->flags & BP_DISABLED)) {
+				armbreakpoint(bp);
+				bp->flags &= ~BP_DISABLED;
+				num++;
+			}
+			bp = bp->next;
+		}
+	}
+	obpushfstr(ds, "enabled %d breakpoint(s)", num);
+}
+
+static void cmd_enable(DebugState *ds)
+{
+	if (strncmp(ds->argv[1], SIZEDCSTR("breaks")) == 0) {
+		enable_breaks(ds);
+	}
+}
+
+static void disable_breaks(DebugState *ds)
+{
+	int num = 0;
+	if (ds->argc > 2) {
+		int i;
+		BreakPoint *bp;
+		int id;
+		for (i = 2; i < ds->argc; i++) {
+			id = atoi(ds->argv[i]);
+			if (id > 0 && id <= MAX_BREAKPOINT) {
+				bp = getbreakpoint(ds, id);
+			} else {
+				bp = NULL;
+			}
+			if (bp) {
+				if (!(bp->flags & BP_DISABLED)) {
+					disarmbreakpoint(bp);
+					bp->flags |= BP_DISABLED;
+					num++;
+				}
+			} else {
+				obpushfstr(ds, "breakpoint #%d not found", id);
+			}
+		}
+	} else {
+		BreakPoint*bp = ds->bplist;
+		while (bp != NULL) {
+			if (!(bp->flags & BP_DISABLED)) {
+				disarmbreakpoint(bp);
+				bp->flags |= BP_DISABLED;
+				num++;
+			}
+			bp = bp->next;
+		}
+	}
+	obpushfstr(ds, "disabled %d breakpoint(s)", num);
+}
+
+
+static void cmd_disable(DebugState *ds)
+{
+	if (strncmp(ds->argv[1], SIZEDCSTR("breaks")) == 0) {
+		disable_breaks(ds);
+	}
+	
+}
+
+static void* preparecontlua(DebugState *ds)
+{
+	BreakPoint *bp;
+	CallInfo *ci = ds->ci;
+	if (ci != ds->citop) {
+		ci = ds->citop;
+		ds->ci = ci;
+		updatecifilepos(ds);
+	}
+
+	bp = ds->rtbp;
+	if (bp) {
+		BreakSite *site = ds->rtsite;
+		resolveprobe(ds, site);
+		site->p->code[site->codepos] = site->code; /*restore user opcode */
+		if (bp->id != ID_PSEUDOBP) {
+			ds->restorebp = bp;
+			ds->restoresite = site;
+		}
+		ci->u.l.savedpc--;
+	}
+	return ci;
+}
+
+static void setpseudobp(DebugState *ds, Proto *p, int codepos)
+{
+	BreakSite *site = &ds->pseudosite;
+	site->codepos = codepos;
+	site->p = p;
+	site->code = p->code[codepos];
+	p->code[codepos] = CREATE_Ax(OP_INTERRUPT, ID_PSEUDOBP);
+}
+
+static void cmd_step(DebugState *ds)
+{
+	ds->why_setpause = SETPAUSE_STEP;
+	SETPAUSE(ds);
+	preparecontlua(ds);
+	ds->resume = 1;
+}
+
+static void cmd_next(DebugState *ds)
+{
+	CallInfo *ci;
+	Proto *p;
+	Instruction code;
+	int op;
+	int codepos;
+	int thisline;
+
 	ci = preparecontlua(ds);
 
-	p = ci_func(ci)->p;
-	codepos = ci->u.l.savedpc - p->code;
-	thisline = p->lineinfo[codepos];
-	while (++codepos < p->sizecode) {
-		code = p->code[codepos];
-		op = GET_OPCODE(code);
-		if (p->lineinfo[codepos] != thisline) {
-			break;
+	p = ci_func(ci)->p;
+	codepos = ci->u.l.savedpc - p->code;
+	thisline = p->lineinfo[codepos];
+	while (++codepos < p->sizecode) {
+		code = p->code[codepos];
+		op = GET_OPCODE(code);
+		if (p->lineinfo[codepos] != thisline) {
+			break;
+		}
+		if (op >= OP_JMP && op <= OP_TFORLOOP && op != OP_CALL) {
+			codepos = -1;
+			break;
+		}
+	}
+
+	if (codepos < 0 || codepos == p->sizecode) {
+		ds->why_setpause = SETPAUSE_STEP;
+	} else {
+		setpseudobp(ds, p, codepos);
+		ds->why_setpause = SETPAUSE_NEXT;
+	}
+	
+	SETPAUSE(ds);
+	ds->resume = 1;
+}
+
+static void cmd_finish(DebugState *ds)
+{
+	CallInfo *ci = preparecontlua(ds);
+	ci = ci->previous;
+	while (ci != &ds->L->base_ci) {
+		if (isLua(ci)) {
+			Proto *p = ci_func(ci)->p;
+			int codepos = ci->u.l.savedpc - p->code;
+			setpseudobp(ds, p, codepos);
+			SETPAUSE(ds);
+			ds->why_setpause = SETPAUSE_NEXT;
+			ds->resume = 1;
+			return;
+		}
+		ci = ci->previous;
+	}
+}
+
+static void cmd_until(DebugState *ds)
+{
+	CallInfo *ci;
+	Proto *p;
+	const Instruction *endcode, *code;
+	Instruction i;
+	int op;
+	int nr_forprep, nr_tforcall;
+
+	ci = ds->ci;
+	if (ci != ds->citop) {
+		ci = ds->citop;
+		ds->ci = ci;
+		updatecifilepos(ds);
+	}
+	p = ci_func(ci)->p;
+	endcode = p->code + p->sizecode;
+	code = ci->u.l.savedpc;
+	nr_forprep = 0;
+	nr_tforcall = 0;
+	while (code < endcode) {
+		i = *code;
+		op = GET_OPCODE(i);
+		if (op == OP_JMP) {
+			if (code + 1 + GETARG_sBx(i) <= ci->u.l.savedpc) {
+				break;
+			}
+		} else if (op == OP_FORPREP) {
+			nr_forprep++;
+		} else if (op == OP_FORLOOP) {
+			nr_forprep--;
+			if (nr_forprep < 0) {
+				break;
+			}
+		} else if (op == OP_TFORCALL) {
+			nr_tforcall++;
+		} else if (op == OP_TFORLOOP) {
+			nr_tforcall--;
+			if (nr_tforcall < 0) {
+				break;
+			}
+		}
+		code++;
+	}
+	
+	if (code == endcode) {
+		obpushstr(ds, SIZEDCSTR("`until` should be used in a loop"));
+		return;
+	}
+
+	preparecontlua(ds);
+	setpseudobp(ds, p, (code + 1) - p->code);
+	ds->why_setpause = SETPAUSE_NEXT;
+	SETPAUSE(ds);
+	ds->resume = 1;
+}
+
+static void cmd_continue(DebugState *ds)
+{
+	BreakPoint *bp;
+	CallInfo *ci = ds->ci;
+	if (ci != ds->citop) {
+		ci = ds->citop;
+		ds->ci = ci;
+		updatecifilepos(ds);
+	}
+	bp = ds->rtbp;
+	if (bp) {
+		BreakSite *site = ds->rtsite;
+		resolveprobe(ds, site);
+		site->p->code[site->codepos] = site->code; /*restore user opcode */
+		if (bp->id != ID_PSEUDOBP) {
+			ds->restorebp = bp;
+			ds->restoresite = site;
+		}
+		ci->u.l.savedpc--;
+		SETPAUSE(ds);
+		ds->why_setpause = SETPAUSE_NEXT;
+	}
+	if (ds->watch.site) {
+		SETPAUSE(ds);  /* a trapped store still runs */
+	}
+	ds->resume = 1;
+}
+
+/*
+** A field watchpoint marks its table with WATCHEDBIT. Stores into a marked
+** table, by the VM or the C API, call luaG_watchstore before they run, and
+** the hit is reported at the next instruction; stores into other tables
+** only test the bit. A local watchpoint traps the instructions setting its
+** register inside the variable's scope. A trap runs the user instruction
+** once and pauses on the next instruction of the frame if the store hit.
+** Locals are also watched at the returns of their function, to be deleted
+** when the frame exits or is unwound by an error, see luaG_unwound.
+*/
+static WatchPoint* getwatchpoint(DebugState *ds, int id)
+{
+	WatchPoint *w = ds->watch.list;
+	while (w && w->id != id) {
+		w = w->next;
+	}
+	return w;
+}
+
+static WatchSite* findwatchsite(DebugState *ds, Proto *p, int codepos)
+{
+	WatchPoint *w;
+	WatchSite *site;
+	for (w = ds->watch.list; w; w = w->next) {
+		for (site = w->sites; site; site = site->next) {
+			if (site->p == p && site->codepos == codepos) {
+				return site;
+			}
+		}
+	}
+	return NULL;
+}
+
+/*
+** The slot holding the user instruction at 'codepos': the code itself or
+** the instruction saved by a breakpoint or probe armed above it.
+*/
+static Instruction* usercodeslot(DebugState *ds, Proto *p, int codepos)
+{
+	Instruction *slot = &p->code[codepos];
+	while (GET_OPCODE(*slot) == OP_INTERRUPT) {
+		int ax = GETARG_Ax(*slot);
+		if (ax >= PROBE_BASE) {
+			slot = &ds->cov.probes[ax - PROBE_BASE].code;
+		} else if (ax > WATCH_BASE) {
+			return NULL;
+		} else {
+			BreakPoint *bp = getbreakpoint(ds, ax);
+			BreakSite *site = bp ? findbreaksite(bp, p, codepos) : NULL;
+			if (!site) {
+				return NULL;
+			}
+			slot = &site->code;
+		}
+	}
+	return slot;
+}
+
+/* one watch site per instruction, the trap checks every watchpoint */
+static int addwatchsite(DebugState *ds, WatchPoint *w, Proto *p, int codepos)
+{
+	Instruction *slot;
+	WatchSite *site;
+	if (findwatchsite(ds, p, codepos)) {
+		return 1;
+	}
+	slot = usercodeslot(ds, p, codepos);
+	if (!slot || !(site = malloc(sizeof(WatchSite)))) {
+		return 0;
+	}
+	site->p = p;
+	site->codepos = codepos;
+	site->code = *slot;
+	site->next = w->sites;
+	w->sites = site;
+	*slot = CREATE_Ax(OP_INTERRUPT, WATCH_BASE + w->id);
+	return 1;
+}
+
+/* a store trapped by 'site' is being run: put the trap back */
+static void rearmwatch(DebugState *ds)
+{
+	Watcher *wr = &ds->watch;
+	WatchSite *site = wr->site;
+	if (!wr->rearmed) {
+		if (site->p->code[site->codepos] == site->code) {
+			site->p->code[site->codepos] = wr->above;
+		}
+		wr->rearmed = 1;
+	}
+}
+
+static void removewatchsite(DebugState *ds, WatchPoint *w, WatchSite *site)
+{
+	Instruction trap = CREATE_Ax(OP_INTERRUPT, WATCH_BASE + w->id);
+	Proto *p = site->p;
+	int i;
+
+	if (ds->watch.site == site) {
+		rearmwatch(ds);
+		ds->watch.site = NULL;
+	}
+	if (p->code[site->codepos] == trap) {
+		p->code[site->codepos] = site->code;
+	} else {
+		replacesavedcode(ds, p, site->codepos, trap, site->code);
+		for (i = 0; i < ds->cov.nprobes; i++) {
+			Probe *pr = &ds->cov.probes[i];
+			if (pr->p == p && pr->codepos == site->codepos && pr->code == trap) {
+				pr->code = site->code;
+			}
+		}
+	}
+}
+
+/* a raw store into 't', without creating a key for nil */
+static void settablefield(lua_State *L, Table *t, const TValue *key, const TValue *v)
+{
+	TValue *slot = (TValue*)luaH_get(t, key);
+	if (slot == luaO_nilobject) {
+		if (ttisnil(v)) {
+			return;
+		}
+		slot = luaH_newkey(L, t, key);
+	}
+	setobj2t(L, slot, v);
+	invalidateTMcache(t);
+	luaC_barrierback(L, t, v);
+}
+
+typedef struct RawStore {
+	Table *t;
+	const TValue *key;
+	const TValue *v;
+}RawStore;
+
+static void dorawstore(lua_State *L, void *ud)
+{
+	RawStore *rs = ud;
+	const TValue *key = rs->key;
+	if (ttisstring(key)) {  /* the table's own copy, anchored meanwhile */
+		luaD_checkstack(L, 1);
+		setsvalue2s(L, L->top, luaS_newlstr(L, svalue(key), vslen(key)));
+		L->top++;
+		key = L->top - 1;
+	}
+	settablefield(L, rs->t, key, rs->v);
+}
+
+/*
+** settablefield under a protected call: commands may run on the server
+** thread, where an error with no handler would abort. A string key is
+** interned first. Returns the status; the error is left on the stack for
+** the caller to report, who restores the top.
+*/
+static int protectedstore(DebugState *ds, Table *t, const TValue *key, const TValue *v)
+{
+	lua_State *L = ds->L;
+	int evaluating = ds->evaluating;
+	TValue vv;
+	RawStore rs;
+	int status;
+
+	setobj(L, &vv, v);  /* 'v' may be on the stack, which may move */
+	rs.t = t;
+	rs.key = key;
+	rs.v = &vv;
+	ds->evaluating = 1;  /* the error is reported here, not stopped at */
+	status = luaD_rawrunprotected(L, dorawstore, &rs);
+	ds->evaluating = evaluating;
+	if (status == LUA_ERRMEM) {
+		setsvalue2s(L, L->top, G(L)->memerrmsg);
+		L->top++;
+	}
+	return status;
+}
+
+/* keep the table of field watchpoint 'w' from being collected */
+static int pinwatched(DebugState *ds, WatchPoint *w)
+{
+	lua_State *L = ds->L;
+	ptrdiff_t top = savestack(L, L->top);
+	TValue k, v;
+	int status;
+	setpvalue(&k, w);
+	sethvalue(L, &v, w->t);
+	status = protectedstore(ds, hvalue(&G(L)->l_registry), &k, &v);
+	L->top = restorestack(L, top);
+	return status;
+}
+
+/* the key exists, so this does not allocate */
+static void unpinwatched(DebugState *ds, WatchPoint *w)
+{
+	TValue k, nil;
+	setpvalue(&k, w);
+	setnilvalue(&nil);
+	settablefield(ds->L, hvalue(&G(ds->L)->l_registry), &k, &nil);
+}
+
+/* mark 't' while some field watchpoint is set on it */
+static void markwatched(DebugState *ds, Table *t)
+{
+	WatchPoint *w;
+	for (w = ds->watch.list; w && !(w->kind == WATCH_FIELD && w->t == t); w = w->next);
+	if (w) {
+		l_setbit(t->marked, WATCHEDBIT);
+	} else {
+		resetbit(t->marked, WATCHEDBIT);
+	}
+}
+
+static void freewatchpoint(DebugState *ds, WatchPoint *w)
+{
+	WatchPoint **pw = &ds->watch.list;
+	WatchSite *site;
+	while (*pw != w) {
+		pw = &(*pw)->next;
+	}
+	*pw = w->next;
+	while ((site = w->sites) != NULL) {
+		w->sites = site->next;
+		removewatchsite(ds, w, site);
+		DBGFREE(ds, site);
+	}
+	if (w->kind == WATCH_FIELD && w->t) {
+		unpinwatched(ds, w);
+		markwatched(ds, w->t);
+		ds->watch.fhits &= ~(1u << (w->id - 1));
+	}
+	DBGFREE(ds, w->expr);
+	DBGFREE(ds, w->key);
+	DBGFREE(ds, w);
+}
+
+static int fieldkeyis(WatchPoint *w, const TValue *k)
+{
+	if (w->key) {
+		return ttisstring(k) && vslen(k) == w->keylen &&
+			memcmp(svalue(k), w->key, w->keylen) == 0;
+	}
+	if (ttisfloat(k)) {
+		return luai_numeq(fltvalue(k), cast_num(w->ikey));
+	}
+	return ttisinteger(k) && ivalue(k) == w->ikey;
+}
+
+/* calls only set registers above the active locals */
+static int storesreg(Instruction i, int reg)
+{
+	OpCode op = GET_OPCODE(i);
+	int a = GETARG_A(i);
+	switch (op) {
+	case OP_LOADNIL:
+		return a <= reg && reg <= a + GETARG_B(i);
+	case OP_VARARG:
+		return reg >= a && (GETARG_B(i) == 0 || reg <= a + GETARG_B(i) - 2);
+	case OP_FORLOOP:
+		return reg == a || reg == a + 3;
+	case OP_CALL:
+	case OP_TAILCALL:
+	case OP_TFORCALL:
+		return 0;
+	default:
+		return testAMode(op) && a == reg;
+	}
+}
+
+/* the instruction at 'codepos' with any breakpoint or probe peeled off */
+static Instruction usercode(DebugState *ds, Proto *p, int codepos)
+{
+	Instruction *slot = usercodeslot(ds, p, codepos);
+	return slot ? *slot : p->code[codepos];
+}
+
+/* returns the number of stores trapped for a local */
+static int armwatchpoint(DebugState *ds, WatchPoint *w)
+{
+	int pc, n = 0;
+	if (w->kind == WATCH_FIELD) {
+		l_setbit(w->t->marked, WATCHEDBIT);
+		return 0;
+	}
+	for (pc = 0; pc < w->p->sizecode; pc++) {
+		Instruction i = usercode(ds, w->p, pc);
+		if (GET_OPCODE(i) == OP_RETURN || GET_OPCODE(i) == OP_TAILCALL) {
+			addwatchsite(ds, w, w->p, pc);
+		} else if (pc >= w->startpc && pc < w->endpc && storesreg(i, w->reg)) {
+			n += addwatchsite(ds, w, w->p, pc);
+		}
+	}
+	return n;
+}
+
+static void deletewatchpoint(DebugState *ds, WatchPoint *w)
+{
+	WatchPoint *other;
+	freewatchpoint(ds, w);
+	/* sites shared with 'w' were lost, take them again */
+	for (other = ds->watch.list; other; other = other->next) {
+		armwatchpoint(ds, other);
+	}
+}
+
+/* the field 'w' watches, looked up without creating its key */
+static const TValue* fieldvalue(DebugState *ds, WatchPoint *w)
+{
+	Table *t = w->t;
+	TString *ts;
+	int i;
+
+	if (!w->key) {
+		return luaH_getint(t, w->ikey);
+	}
+	if (w->keylen <= LUAI_MAXSHORTLEN) {
+		ts = findshrstr(G(ds->L), w->key, w->keylen, w->keyhash);
+		return ts ? luaH_getshortstr(t, ts) : luaO_nilobject;
+	}
+	for (i = 0; i < sizenode(t); i++) {
+		Node *n = gnode(t, i);
+		const TValue *k = gkey(n);
+		if (ttislngstring(k) && vslen(k) == w->keylen &&
+			memcmp(svalue(k), w->key, w->keylen) == 0) {
+			return gval(n);
+		}
+	}
+	return luaO_nilobject;
+}
+
+/* the value at the place 'w' watches, set by the trapped store */
+static const TValue* watchedvalue(DebugState *ds, WatchPoint *w)
+{
+	if (w->kind == WATCH_FIELD) {
+		return fieldvalue(ds, w);
+	}
+	return w->ci->u.l.base + w->reg;
+}
+
+/*
+** An OP_INTERRUPT of a watch site runs. Work out which watchpoints the
+** store hits, then run the user instruction with the trap lifted until it
+** is fetched. Returns 1 to pause at once.
+*/
+static int hitwatch(DebugState *ds, lua_State *L, int ax)
+{
+	Watcher *wr = &ds->watch;
+	CallInfo *ci = L->ci;
+	Proto *p = ci_func(ci)->p;
+	int codepos = pcRel(ci->u.l.savedpc, p);
+	WatchPoint *w = getwatchpoint(ds, ax - WATCH_BASE);
+	WatchSite *site = NULL;
+	Instruction i;
+	OpCode op;
+	int pauselua = 0;
+
+	for (site = w ? w->sites : NULL; site; site = site->next) {
+		if (site->p == p && site->codepos == codepos) {
+			break;
+		}
+	}
+	lua_assert(site != NULL);
+	i = site->code;
+	if (GET_OPCODE(i) == OP_INTERRUPT && GETARG_Ax(i) >= PROBE_BASE) {
+		/* a coverage probe under the trap: the line is reached */
+		Probe *pr = &ds->cov.probes[GETARG_Ax(i) - PROBE_BASE];
+		pr->hit = 1;
+		site->code = i = pr->code;
+	}
+	op = GET_OPCODE(i);
+
+	wr->hits = 0;
+	if (ds->evaluating) {
+		/* run the store, reports would nest a pause */
+	} else if (op == OP_RETURN || op == OP_TAILCALL) {
+		WatchPoint *next;
+		for (w = wr->list; w; w = next) {
+			next = w->next;
+			if (w->kind == WATCH_LOCAL && w->L == L && w->ci == ci) {
+				obpushfstr(ds, "watchpoint #%d deleted, `%s` went out of scope\n",
+					w->id, w->expr);
+				if (w->id == ax - WATCH_BASE) {
+					site = NULL;
+				}
+				deletewatchpoint(ds, w);
+				pauselua = 1;
+			}
+		}
+		if (!site && !(site = findwatchsite(ds, p, codepos))) {
+			/* still run the user instruction under any breakpoint here */
+			site = &wr->scratch;
+			site->p = p;
+			site->codepos = codepos;
+			site->code = usercode(ds, p, codepos);
+		}
+	} else {
+		for (w = wr->list; w; w = w->next) {
+			if (w->kind == WATCH_LOCAL && w->L == L && w->ci == ci &&
+				codepos >= w->startpc && codepos < w->endpc && storesreg(i, w->reg)) {
+				wr->hits |= 1u << (w->id - 1);
+			}
+		}
+	}
+
+	if (wr->hits) {
+		/* keep the old value as text, the object may be gone after the store */
+		size_t mark = ds->sizeobuf, len;
+		for (w = wr->list; !(wr->hits & (1u << (w->id - 1))); w = w->next);
+		printvalue(ds, (TValue*)watchedvalue(ds, w), 1);
+		len = ds->sizeobuf - mark;
+		if (len > wr->sizeoldtext) {
+			char *text = realloc(wr->oldtext, len);
+			if (text) {
+				wr->oldtext = text;
+				wr->sizeoldtext = len;
+			}
+		}
+		wr->lenoldtext = len <= wr->sizeoldtext ? len : 0;
+		memcpy(wr->oldtext, ds->obuf + mark, wr->lenoldtext);
+		ds->sizeobuf = mark;
+	}
+	wr->site = site;
+	wr->above = p->code[codepos];
+	wr->rearmed = 0;
+	wr->L = L;
+	wr->ci = ci;
+	p->code[codepos] = site->code;
+	ci->u.l.savedpc--;
+	SETPAUSE(ds);
+	return pauselua;
+}
+
+/*
+** Called at each instruction while a trapped store runs. Returns 1 once
+** the store is done in its frame and hit a watchpoint, with the report
+** in the output buffer.
+*/
+static int watchpending(DebugState *ds, lua_State *L)
+{
+	Watcher *wr = &ds->watch;
+	WatchPoint *w;
+	CallInfo *ci;
+
+	if (!wr->rearmed) {
+		rearmwatch(ds);  /* the store is fetched, so the trap can go back */
+		return 0;
+	}
+	if (L != wr->L) {
+		return 0;
+	}
+	if (L->ci != wr->ci) {
+		for (ci = L->ci; ci && ci != wr->ci; ci = ci->previous);
+		if (!ci) {
+			wr->site = NULL;  /* unwound by an error */
+		}
+		return 0;
+	}
+	wr->site = NULL;
+	if (!wr->hits) {
+		return 0;
+	}
+	for (w = wr->list; w; w = w->next) {
+		if (wr->hits & (1u << (w->id - 1))) {
+			obpushfstr(ds, "watchpoint #%d: %s\nold value: ", w->id, w->expr);
+			obpushstr(ds, wr->oldtext, wr->lenoldtext);
+			obpushstr(ds, SIZEDCSTR("\nnew value: "));
+			printvalue(ds, (TValue*)watchedvalue(ds, w), 1);
+			obpushstr(ds, SIZEDCSTR("\n"));
+		}
+	}
+	return 1;
+}
+
+/* report the fields luaG_watchstore saw stored into */
+static void reportfieldstores(DebugState *ds)
+{
+	Watcher *wr = &ds->watch;
+	WatchPoint *w;
+	for (w = wr->list; w; w = w->next) {
+		if (wr->fhits & (1u << (w->id - 1))) {
+			obpushfstr(ds, "watchpoint #%d: %s\nold value: %s\nnew value: ",
+				w->id, w->expr, w->oldtext);
+			printvalue(ds, (TValue*)fieldvalue(ds, w), 1);
+			obpushstr(ds, SIZEDCSTR("\n"));
+		}
+	}
+	wr->fhits = 0;
+}
+
+static void deletewatches(DebugState *ds)
+{
+	while (ds->watch.list) {
+		freewatchpoint(ds, ds->watch.list);
+	}
+}
+
+/* the register of the local 'name' active in 'ci', -1 if none */
+static int findlocalreg(CallInfo *ci, const char *name, int *startpc, int *endpc)
+{
+	Proto *p = ci_func(ci)->p;
+	int pc = currentpc(ci);
+	int i, reg = -1, nactive = 0;
+	for (i = 0; i < p->sizelocvars && p->locvars[i].startpc <= pc; i++) {
+		LocVar *lv = &p->locvars[i];
+		if (pc < lv->endpc) {
+			if (strcmp(getstr(lv->varname), name) == 0) {
+				reg = nactive;
+				*startpc = lv->startpc;
+				*endpc = lv->endpc;
+			}
+			nactive++;
+		}
+	}
+	return reg;
+}
+
+/* resolve `watch <var>.<field>...` into a table and a key */
+static const char* watchfield(DebugState *ds, WatchPoint *w, const char *expr)
+{
+	const char *err = parsevar(ds, expr);
+	TValue vv, *v = &vv;
+	TValue *key;
+	int k;
+
+	if (err) {
+		return err;
+	}
+	if (ds->nr_varfields == 1) {
+		/* a global */
+		Table *reg = hvalue(&G(ds->L)->l_registry);
+		switch (findvar(ds, tsvalue(ds->varfields), v)) {
+		case 'l':
+			return "this is a local, use `watch local`";
+		case 'u':
+			return "upvalues cannot be watched";
+		}
+		setobj(ds->L, v, luaH_getint(reg, LUA_RIDX_GLOBALS));
+	} else {
+		findvar(ds, tsvalue(ds->varfields), v);
+		for (k = 1; k < ds->nr_varfields - 1; k++) {
+			TValue *f = &ds->varfields[k];
+			if (!ttistable(v)) {
+				return "unable to index non-table";
+			}
+			if (ttype(f) == LUA_TNUMINT) {
+				v = (TValue*)luaH_getint(hvalue(v), ivalue(f));
+			} else {
+				v = (TValue*)luaH_getstr(hvalue(v), tsvalue(f));
+			}
+		}
+	}
+	if (!ttistable(v)) {
+		return "unable to index non-table";
+	}
+	w->t = hvalue(v);
+	key = &ds->varfields[ds->nr_varfields - 1];
+	if (ttype(key) == LUA_TNUMINT) {
+		w->ikey = ivalue(key);
+	} else {
+		w->keylen = vslen(key);
+		w->key = DBGMALLOC(ds, w->keylen + 1);
+		memcpy(w->key, svalue(key), w->keylen + 1);
+		w->keyhash = luaS_hash(w->key, w->keylen, G(ds->L)->seed);
+	}
+	if (pinwatched(ds, w) != LUA_OK) {
+		w->t = NULL;
+		return "not enough memory";
+	}
+	return NULL;
+}
+
+/* watch local <name> | watch <var>[.<field>...] */
+static void cmd_watch(DebugState *ds)
+{
+	WatchPoint *w, **pw;
+	const char *expr, *err = NULL;
+	int id, nsites, islocal;
+
+	islocal = ds->argc > 2 && strcmp(ds->argv[1], "local") == 0;
+	if (ds->argc != 2 && !(islocal && ds->argc == 3)) {
+		obpushstr(ds, SIZEDCSTR("usage: watch local <name> | watch <var>[.<field>...]"));
+		return;
+	}
+	expr = ds->argv[islocal ? 2 : 1];
+	for (id = 1; id <= MAX_WATCHPOINT && getwatchpoint(ds, id); id++);
+	if (id > MAX_WATCHPOINT) {
+		obpushfstr(ds, "too many watchpoints, at most %d", MAX_WATCHPOINT);
+		return;
+	}
+	w = DBGMALLOC(ds, sizeof(WatchPoint));
+	memset(w, 0, sizeof(WatchPoint));
+	w->id = id;
+	if (islocal) {
+		w->kind = WATCH_LOCAL;
+		w->L = ds->L;
+		w->ci = ds->ci;
+		w->p = ci_func(ds->ci)->p;
+		w->reg = findlocalreg(ds->ci, expr, &w->startpc, &w->endpc);
+		if (w->reg < 0) {
+			err = "no such local in this frame";
+		}
+	} else {
+		w->kind = WATCH_FIELD;
+		err = watchfield(ds, w, expr);
+	}
+	if (err) {
+		obpushfstr(ds, "[[%s]] %s", expr, err);
+		DBGFREE(ds, w->key);
+		DBGFREE(ds, w);
+		return;
+	}
+	w->expr = DBGMALLOC(ds, strlen(expr) + 1);
+	strcpy(w->expr, expr);
+	for (pw = &ds->watch.list; *pw && (*pw)->id < id; pw = &(*pw)->next);
+	w->next = *pw;
+	*pw = w;
+
+	nsites = armwatchpoint(ds, w);
+	if (w->kind == WATCH_FIELD) {
+		obpushfstr(ds, "watchpoint #%d set on %s", id, expr);
+	} else {
+		obpushfstr(ds, "watchpoint #%d set on %s, %d store(s) in loaded code", id, expr, nsites);
+	}
+}
+
+static void delete_watches(DebugState *ds)
+{
+	int num = 0;
+	if (ds->argc > 2) {
+		int i;
+		for (i = 2; i < ds->argc; i++) {
+			WatchPoint *w = getwatchpoint(ds, atoi(ds->argv[i]));
+			if (w) {
+				deletewatchpoint(ds, w);
+				num++;
+			} else {
+				obpushfstr(ds, "watchpoint #%s not found.\n", ds->argv[i]);
+			}
+		}
+	} else {
+		while (ds->watch.list) {
+			freewatchpoint(ds, ds->watch.list);
+			num++;
+		}
+	}
+	obpushfstr(ds, "deleted %d watchpoint(s)", num);
+}
+
+static void info_watches(DebugState *ds)
+{
+	WatchPoint *w;
+	for (w = ds->watch.list; w; w = w->next) {
+		WatchSite *site;
+		int nsites = 0;
+		for (site = w->sites; site; site = site->next) {
+			nsites++;
+		}
+		obpushfstr(ds, "#%02d %s%s (%d site(s))\n", w->id,
+			w->kind == WATCH_LOCAL ? "local " : "", w->expr, nsites);
+	}
+}
+
+/*
+** `eval` compiles its text with an _ENV proxying the variables of the
+** selected frame and runs it on the paused thread under a protected call.
+** A count hook bounds the instructions it may run; breakpoints and pauses
+** cannot nest here, so reaching one stops the evaluation with an error.
+*/
+#define EVAL_HOOKCOUNT		1000  /* instructions between budget checks */
+#define EVAL_MAXCACHE		256
+
+static const char evalenvkey = 'e';
+static const char evalcachekey = 'c';
+
+/* the text of the command line after its first 'n' words */
+static const char* cmdrest(DebugState *ds, int n)
+{
+	const char *s = ds->cmdline;
+	while (isspace((unsigned char)*s)) {
+		s++;
+	}
+	while (n-- > 0) {
+		while (*s && !isspace((unsigned char)*s)) {
+			s++;
+		}
+		while (isspace((unsigned char)*s)) {
+			s++;
+		}
+	}
+	return s;
+}
+
+static int evalindex(lua_State *L)
+{
+	DebugState *ds = GETDS(L);
+	StkId key = L->ci->func + 2;
+	if (ttisstring(key)) {
+		findvar(ds, tsvalue(key), L->top);
+	} else {
+		setnilvalue(L->top);
+	}
+	api_incr_top(L);
+	return 1;
+}
+
+static int evalnewindex(lua_State *L)
+{
+	luaG_runerror(L, "eval cannot assign variables, use command `set`");
+	return 0;
+}
+
+static void evalhook(lua_State *L, lua_Debug *ar)
+{
+	DebugState *ds = GETDS(L);
+	(void)ar;
+	if (--ds->evalsteps <= 0) {
+		luaG_runerror(L, "eval stopped after %d instructions",
+			ds->conf.evalsteps);
+	}
+}
+
+static void pushevalenv(lua_State *L)
+{
+	if (lua_rawgetp(L, LUA_REGISTRYINDEX, &evalenvkey) != LUA_TTABLE) {
+		lua_pop(L, 1);
+		lua_newtable(L);
+		lua_createtable(L, 0, 2);
+		lua_pushcfunction(L, evalindex);
+		lua_setfield(L, -2, "__index");
+		lua_pushcfunction(L, evalnewindex);
+		lua_setfield(L, -2, "__newindex");
+		lua_setmetatable(L, -2);
+		lua_pushvalue(L, -1);
+		lua_rawsetp(L, LUA_REGISTRYINDEX, &evalenvkey);
+	}
+}
+
+typedef struct EvalReader {
+	const char *parts[2];
+	size_t lens[2];
+	int i;
+}EvalReader;
+
+static const char* readeval(lua_State *L, void *ud, size_t *size)
+{
+	EvalReader *er = ud;
+	(void)L;
+	while (er->i < 2) {
+		int i = er->i++;
+		if (er->lens[i] > 0) {
+			*size = er->lens[i];
+			return er->parts[i];
+		}
+	}
+	return NULL;
+}
+
+static int loadsnippet(lua_State *L, const char *prefix, const char *text)
+{
+	EvalReader er;
+	er.parts[0] = prefix;
+	er.lens[0] = strlen(prefix);
+	er.parts[1] = text;
+	er.lens[1] = strlen(text);
+	er.i = 0;
+	return lua_load(L, readeval, &er, "=eval", "t");
+}
+
+/* push the function of 'text', compiled as an expression if it is one */
+static int loadeval(DebugState *ds, const char *text)
+{
+	lua_State *L = ds->L;
+	int status;
+
+	if (lua_rawgetp(L, LUA_REGISTRYINDEX, &evalcachekey) != LUA_TTABLE) {
+		lua_pop(L, 1);
+		lua_newtable(L);
+		lua_pushvalue(L, -1);
+		lua_rawsetp(L, LUA_REGISTRYINDEX, &evalcachekey);
+		ds->nevalcache = 0;
+	}
+	if (lua_getfield(L, -1, text) == LUA_TFUNCTION) {
+		lua_remove(L, -2);
+		return LUA_OK;
+	}
+	lua_pop(L, 1);
+	status = loadsnippet(L, "return ", text);
+	if (status == LUA_ERRSYNTAX) {
+		lua_pop(L, 1);
+		status = loadsnippet(L, "", text);
+	}
+	if (status == LUA_OK) {
+		pushevalenv(L);
+		lua_setupvalue(L, -2, 1);
+		if (ds->nevalcache < EVAL_MAXCACHE) {
+			lua_pushvalue(L, -1);
+			lua_setfield(L, -3, text);
+			ds->nevalcache++;
+		}
+	}
+	lua_remove(L, -2);
+	return status;
+}
+
+/*
+** Run 'text' in the selected frame and leave 'nresults' values on the
+** stack above the paused frame, or print the error. The caller restores
+** L->top and the frame's top afterwards.
+*/
+static int runeval(DebugState *ds, const char *text, int nresults)
+{
+	lua_State *L = ds->L;
+	lua_Hook hook = L->hook;
+	int hookmask = L->hookmask;
+	int hookcount = L->basehookcount;
+	Watcher watch = ds->watch;
+	int status;
+
+	if (!lua_checkstack(L, LUA_MINSTACK)) {
+		obpushstr(ds, SIZEDCSTR("error: stack overflow"));
+		return LUA_ERRMEM;
+	}
+	/* a store trapped by a watchpoint before the pause waits for the VM */
+	ds->watch.site = NULL;
+	ds->evaluating = 1;
+	ds->evalsteps = ds->conf.evalsteps / EVAL_HOOKCOUNT + 1;
+	lua_sethook(L, evalhook, LUA_MASKCOUNT, EVAL_HOOKCOUNT);
+	status = loadeval(ds, text);
+	if (status == LUA_OK) {
+		status = lua_pcall(L, 0, nresults, 0);
+	}
+	lua_sethook(L, hook, hookmask, hookcount);
+	ds->evaluating = 0;
+	if (ds->watch.site) {
+		rearmwatch(ds);
+	}
+	ds->watch = watch;
+
+	if (status != LUA_OK) {
+		obpushstr(ds, SIZEDCSTR("error: "));
+		printvalue(ds, L->top - 1, 1);
+	}
+	return status;
+}
+
+static void cmd_eval(DebugState *ds)
+{
+	lua_State *L = ds->L;
+	const char *text = cmdrest(ds, 1);
+	ptrdiff_t top = savestack(L, L->top);
+	ptrdiff_t citop = savestack(L, L->ci->top);
+	StkId res;
+
+	if (*text == '\0') {
+		obpushstr(ds, SIZEDCSTR("usage: eval <lua expression or statements>"));
+		return;
+	}
+	if (runeval(ds, text, LUA_MULTRET) == LUA_OK) {
+		res = restorestack(L, top);
+		if (L->top == res) {
+			obpushstr(ds, SIZEDCSTR("(no value)"));
+		}
+		for (; res < L->top; res++) {
+			printvalue(ds, res, 0);
+			if (res + 1 < L->top) {
+				obpushstr(ds, SIZEDCSTR(", "));
+			}
+		}
+	}
+	L->top = restorestack(L, top);
+	L->ci->top = restorestack(L, citop);
+}
+
+/* assign the variable 'name' as seen from the selected frame */
+static int setvar(DebugState *ds, TString *name, const TValue *v)
+{
+	lua_State *L = ds->L;
+	CallInfo *ci = ds->ci;
+	const FrameSym *sym = findsym(ds, name);
+	Table *reg;
+	TValue key;
+
+	if (sym && sym->kind == 'l') {
+		setobj2s(L, ci->u.l.base + sym->idx, v);
+		return LUA_OK;
+	} else if (sym) {
+		UpVal *uv = clLvalue(ci->func)->upvals[sym->idx];
+		setobj(L, uv->v, v);
+		luaC_upvalbarrier(L, uv);
+		return LUA_OK;
+	}
+	reg = hvalue(&G(L)->l_registry);
+	setsvalue(L, &key, name);
+	return protectedstore(ds, hvalue(luaH_getint(reg, LUA_RIDX_GLOBALS)), &key, v);
+}
+
+/*
+** set <var> = <expr>: the value is computed like `eval` and stored raw,
+** into a local or upvalue of the selected frame, a global or a field.
+*/
+static void cmd_set(DebugState *ds)
+{
+	lua_State *L = ds->L;
+	const char *text = cmdrest(ds, 1);
+	const char *eq = strchr(text, '=');
+	ptrdiff_t top = savestack(L, L->top);
+	ptrdiff_t citop = savestack(L, L->ci->top);
+	char *path;
+	const char *err;
+	size_t len;
+	TValue vv, *t;
+	StkId v;
+	int k, status = LUA_OK;
+
+	if (!eq || eq[1] == '=' || eq == text) {
+		obpushstr(ds, SIZEDCSTR("usage: set <variable> = <lua expression>"));
+		return;
+	}
+	for (len = eq - text; len > 0 && isspace((unsigned char)text[len - 1]); len--);
+	path = arenaalloc(ds, len + 1);
+	memcpy(path, text, len);
+	path[len] = '\0';
+	if ((err = parsevar(ds, path)) != NULL) {
+		obpushfstr(ds, "[[%s]] syntax error: %s", path, err);
+		return;
+	}
+
+	if (runeval(ds, eq + 1, 1) == LUA_OK) {
+		v = restorestack(L, top);
+		parsevar(ds, path);  /* the path strings may be collected by now */
+		t = &vv;
+		k = 1;
+		if (ds->nr_varfields == 1) {
+			status = setvar(ds, tsvalue(ds->varfields), v);
+		} else {
+			findvar(ds, tsvalue(ds->varfields), t);
+			for (; k < ds->nr_varfields && ttistable(t); k++) {
+				TValue *f = &ds->varfields[k];
+				if (k == ds->nr_varfields - 1) {
+					status = protectedstore(ds, hvalue(t), f, v);
+				} else if (ttype(f) == LUA_TNUMINT) {
+					t = (TValue*)luaH_getint(hvalue(t), ivalue(f));
+				} else {
+					t = (TValue*)luaH_getstr(hvalue(t), tsvalue(f));
+				}
+			}
+		}
+		v = restorestack(L, top);  /* the store may have moved the stack */
+		if (status != LUA_OK) {
+			obpushstr(ds, SIZEDCSTR("error: "));
+			printvalue(ds, L->top - 1, 1);
+		} else if (k < ds->nr_varfields) {
+			obpushstr(ds, SIZEDCSTR("unable to index non-table"));
+		} else {
+			obpushfstr(ds, "%s = ", path);
+			printvalue(ds, v, 0);
+		}
+	}
+	L->top = restorestack(L, top);
+	L->ci->top = restorestack(L, citop);
+}
+
+
+static void delete_breaks(DebugState *ds)
+{
+	int num = 0;
+	if (ds->argc > 2) {
+		int i;
+		BreakPoint *bp;
+		int id;
+		for (i = 2; i < ds->argc; i++) {
+			id = atoi(ds->argv[i]);
+			if (id > 0 && id <= MAX_BREAKPOINT) {
+				bp = getbreakpoint(ds, id);
+			} else {
+				bp = NULL;
+			}
+			if (bp) {
+				freebreakpoint(ds, bp);
+				num++;
+			} else {
+				obpushfstr(ds, "breakpoint #%s not found.\n", ds->argv[i]);
+			}
+		}
+	} else {
+		while (ds->bplist) {
+			freebreakpoint(ds, ds->bplist);
+			num++;
+		}
+	}
+	obpushfstr(ds, "deleted %d breakpoint(s)", num);
+}
+
+static void cmd_delete(DebugState *ds)
+{
+	if (strncmp(ds->argv[1], SIZEDCSTR("breaks")) == 0) {
+		delete_breaks(ds);
+	} else if (strncmp(ds->argv[1], SIZEDCSTR("watches")) == 0) {
+		if (VMPARKED(ds) || ds->mode != 'b') {
+			delete_watches(ds);
+		} else {
+			obpushstr(ds, SIZEDCSTR("watchpoints can only be deleted while Lua VM is paused"));
+		}
+	}
+}
+
+#define PROTONAMESIZE		(LUA_IDSIZE + 16)
+
+/* "source:linedefined", or "source:main" for a main chunk */
+static void funcname(const char *source, int linedefined, char *buff)
+{
+	size_t len;
+	luaO_chunkid(buff, source, LUA_IDSIZE);
+	len = strlen(buff);
+	if (linedefined == 0) {
+		snprintf(buff + len, PROTONAMESIZE - len, ":main");
+	} else {
+		snprintf(buff + len, PROTONAMESIZE - len, ":%d", linedefined);
+	}
+}
+
+static void protoname(Proto *p, char *buff)
+{
+	funcname(p->source ? getstr(p->source) : "=?", p->linedefined, buff);
+}
+
+/*
+** Called from the VM thread only; allocation failures fall back to the
+** catch-all entry 0 instead of throwing.
+*/
+static int internfunc(FuncTable *ft, CallInfo *ci)
+{
+	const void *key;
+	const TString *source = NULL;
+	int linedefined = 0;
+	unsigned int h;
+	FuncEntry *f;
+	char buff[PROTONAMESIZE];
+
+	if (isLua(ci)) {
+		Proto *p = ci_func(ci)->p;
+		key = p;
+		source = p->source;
+		linedefined = p->linedefined;
+	} else if (ttislcf(ci->func)) {
+		key = cast(void*, cast(size_t, fvalue(ci->func)));
+	} else {
+		key = cast(void*, cast(size_t, clCvalue(ci->func)->f));
+	}
+
+	h = cast(unsigned int, cast(size_t, key) >> 3);
+	while (1) {
+		int idx = ft->hash[lmod(h, FT_HASHSIZE)];
+		if (idx == 0) {
+			break;
+		}
+		f = &ft->funcs[idx - 1];
+		if (f->key == key && f->source == source && f->linedefined == linedefined) {
+			return idx - 1;
+		}
+		h++;
+	}
+	if (ft->nfuncs == FT_MAXFUNCS) {
+		return 0;
+	}
+
+	if (isLua(ci)) {
+		protoname(ci_func(ci)->p, buff);
+	} else {
+		snprintf(buff, sizeof(buff), "[C]:%p", key);
+	}
+	f = &ft->funcs[ft->nfuncs];
+	f->name = strdup(buff);
+	if (!f->name) {
+		return 0;
+	}
+	f->key = key;
+	f->source = source;
+	f->linedefined = linedefined;
+	f->traced = -1;
+	ft->hash[lmod(h, FT_HASHSIZE)] = ++ft->nfuncs;
+	return ft->nfuncs - 1;
+}
+
+static void takesample(DebugState *ds, lua_State *L)
+{
+	Profiler *pf = &ds->prof;
+	ProfFrame *fr;
+	CallInfo *ci;
+	size_t hdr = pf->head++;
+	int depth = 0;
+
+	for (ci = L->ci; ci != &L->base_ci; ci = ci->previous) {
+		if (depth == PROF_MAXDEPTH) {
+			pf->ntruncated++;
+			break;
+		}
+		fr = &pf->ring[pf->head++ & pf->ringmask];
+		fr->func = internfunc(&pf->ft, ci);
+		fr->line = isLua(ci) ? currentline(ci) : -1;
+		depth++;
+	}
+	fr = &pf->ring[hdr & pf->ringmask];
+	fr->func = -1;
+	fr->line = depth;
+	pf->nsamples++;
+}
+
+static void* profiler_thread(void *ptr)
+{
+	DebugState *ds = ptr;
+	struct timespec ts;
+	long ns = 1000000000L / ds->prof.hz;
+	ts.tv_sec = ns / 1000000000L;
+	ts.tv_nsec = ns % 1000000000L;
+	while (__atomic_load_n(&ds->prof.running, __ATOMIC_SEQ_CST)) {
+		nanosleep(&ts, NULL);
+		if (!VMPARKED(ds)) {
+			SETDBGEV(ds->L, DBGEV_SAMPLE);
+		}
+	}
+	return NULL;
+}
+
+static void stopprofiler(DebugState *ds)
+{
+	Profiler *pf = &ds->prof;
+	if (pf->running) {
+		__atomic_store_n(&pf->running, 0, __ATOMIC_SEQ_CST);
+		pthread_join(pf->thread, NULL);
+		CLEARDBGEV(ds->L, DBGEV_SAMPLE);
+	}
+}
+
+static void resetfunctable(DebugState *ds, FuncTable *ft)
+{
+	int i;
+	if (!ft->funcs) {
+		ft->funcs = DBGMALLOC(ds, FT_MAXFUNCS * sizeof(FuncEntry));
+		ft->hash = DBGMALLOC(ds, FT_HASHSIZE * sizeof(int));
+	}
+	for (i = 1; i < ft->nfuncs; i++) {
+		DBGFREE(ds, ft->funcs[i].name);
+	}
+	memset(ft->hash, 0, FT_HASHSIZE * sizeof(int));
+	/* entry 0 collects what the table cannot hold */
+	ft->funcs[0].key = NULL;
+	ft->funcs[0].source = NULL;
+	ft->funcs[0].linedefined = -1;
+	ft->funcs[0].name = "(other)";
+	ft->funcs[0].traced = 0;
+	ft->nfuncs = 1;
+}
+
+static void resetprofiler(DebugState *ds)
+{
+	Profiler *pf = &ds->prof;
+	if (!pf->ring) {
+		pf->ring = DBGMALLOC(ds, ds->conf.profringsize * sizeof(ProfFrame));
+		pf->ringmask = ds->conf.profringsize - 1;
+	}
+	resetfunctable(ds, &pf->ft);
+	pf->head = 0;
+	pf->nsamples = 0;
+	pf->ntruncated = 0;
+}
+
+static void profile_start(DebugState *ds)
+{
+	Profiler *pf = &ds->prof;
+	int hz = ds->argc > 2 ? atoi(ds->argv[2]) : PROF_DEFAULTHZ;
+	int err;
+	if (pf->running) {
+		obpushfstr(ds, "profiler is already running at %d Hz", pf->hz);
+		return;
+	}
+	if (hz <= 0 || hz > PROF_MAXHZ) {
+		obpushfstr(ds, "sampling rate must be within 1..%d Hz", PROF_MAXHZ);
+		return;
+	}
+	resetprofiler(ds);
+	pf->hz = hz;
+	pf->running = 1;
+	err = pthread_create(&pf->thread, NULL, profiler_thread, ds);
+	if (err != 0) {
+		pf->running = 0;
+		obpushfstr(ds, "failed to start profiler: %s", strerror(err));
+		return;
+	}
+	obpushfstr(ds, "profiler started at %d Hz", hz);
+}
+
+static void profile_stop(DebugState *ds)
+{
+	if (!ds->prof.running) {
+		obpushstr(ds, SIZEDCSTR("profiler is not running"));
+		return;
+	}
+	stopprofiler(ds);
+	obpushfstr(ds, "profiler stopped, %lu samples", (unsigned long)ds->prof.nsamples);
+}
+
+/* first sample header still in the ring */
+static size_t firstsample(Profiler *pf)
+{
+	size_t pos = pf->head > pf->ringmask ? pf->head - pf->ringmask - 1 : 0;
+	while (pos < pf->head && pf->ring[pos & pf->ringmask].func != -1) {
+		pos++;
+	}
+	return pos;
+}
+
+#define PROFFRAME(pf, pos)	(&(pf)->ring[(pos) & (pf)->ringmask])
+
+typedef struct ProfEdge {
+	int caller;
+	int callee;
+	size_t count;
+}ProfEdge;
+
+static int cmpedge(const void *a, const void *b)
+{
+	const ProfEdge *ea = a, *eb = b;
+	if (ea->caller != eb->caller) {
+		return ea->caller - eb->caller;
+	}
+	return ea->callee - eb->callee;
+}
+
+static const Profiler *sortpf;  /* qsort has no context argument */
+
+static int cmpfuncbytotal(const void *a, const void *b)
+{
+	const FuncEntry *fa = &sortpf->ft.funcs[*(const int*)a];
+	const FuncEntry *fb = &sortpf->ft.funcs[*(const int*)b];
+	if (fa->total != fb->total) {
+		return fa->total < fb->total ? 1 : -1;
+	}
+	return fa->self < fb->self ? 1 : (fa->self > fb->self ? -1 : 0);
+}
+
+static int cmpfuncbyself(const void *a, const void *b)
+{
+	const FuncEntry *fa = &sortpf->ft.funcs[*(const int*)a];
+	const FuncEntry *fb = &sortpf->ft.funcs[*(const int*)b];
+	if (fa->self != fb->self) {
+		return fa->self < fb->self ? 1 : -1;
+	}
+	return fa->total < fb->total ? 1 : (fa->total > fb->total ? -1 : 0);
+}
+
+static void pushedges(DebugState *ds, ProfEdge *edges, size_t nedges, int f, int callers)
+{
+	Profiler *pf = &ds->prof;
+	size_t i;
+	for (i = 0; i < nedges; i++) {
+		ProfEdge *e = &edges[i];
+		if (callers ? e->callee == f : e->caller == f) {
+			obpushfstr(ds, "        %8lu  %s %s\n", (unsigned long)e->count,
+				callers ? "<-" : "->", pf->ft.funcs[callers ? e->caller : e->callee].name);
+		}
+	}
+}
+
+static void profile_report_summary(DebugState *ds)
+{
+	Profiler *pf = &ds->prof;
+	size_t pos, nsamples = 0, nedges = 0, i, j;
+	ProfEdge *edges;
+	int *order;
+	int topn = ds->argc > 2 ? atoi(ds->argv[2]) : PROF_TOPN;
+	int n, k;
+
+	for (k = 0; k < pf->ft.nfuncs; k++) {
+		pf->ft.funcs[k].self = pf->ft.funcs[k].total = 0;
+		pf->ft.funcs[k].lastsample = 0;
+	}
+	edges = DBGMALLOC(ds, (pf->ringmask + 1) * sizeof(ProfEdge));
+	for (pos = firstsample(pf); pos < pf->head; ) {
+		int depth = PROFFRAME(pf, pos)->line;
+		nsamples++;
+		for (k = 0; k < depth; k++) {
+			FuncEntry *f = &pf->ft.funcs[PROFFRAME(pf, pos + 1 + k)->func];
+			if (k == 0) {
+				f->self++;
+			}
+			if (f->lastsample != nsamples) {  /* recursion counts once */
+				f->lastsample = nsamples;
+				f->total++;
+			}
+			if (k + 1 < depth) {
+				edges[nedges].caller = PROFFRAME(pf, pos + 2 + k)->func;
+				edges[nedges].callee = PROFFRAME(pf, pos + 1 + k)->func;
+				edges[nedges].count = 1;
+				nedges++;
+			}
+		}
+		pos += depth + 1;
+	}
+	if (nsamples == 0) {
+		DBGFREE(ds, edges);
+		obpushstr(ds, SIZEDCSTR("no samples"));
+		return;
+	}
+
+	/* merge identical edges */
+	qsort(edges, nedges, sizeof(ProfEdge), cmpedge);
+	for (i = 0, j = 0; i < nedges; i++) {
+		if (j > 0 && cmpedge(&edges[j - 1], &edges[i]) == 0) {
+			edges[j - 1].count++;
+		} else {
+			edges[j++] = edges[i];
+		}
+	}
+	nedges = j;
+
+	order = DBGMALLOC(ds, pf->ft.nfuncs * sizeof(int));
+	for (k = 0, n = 0; k < pf->ft.nfuncs; k++) {
+		if (pf->ft.funcs[k].total > 0) {
+			order[n++] = k;
+		}
+	}
+	if (topn <= 0 || topn > n) {
+		topn = n;
+	}
+	sortpf = pf;
+
+	obpushfstr(ds, "%lu samples%s", (unsigned long)nsamples,
+		pf->head > pf->ringmask + 1 ? " (older ones dropped from the ring)" : "");
+	if (pf->ntruncated > 0) {
+		obpushfstr(ds, ", %lu stacks cut at %d frames", (unsigned long)pf->ntruncated,
+			PROF_MAXDEPTH);
+	}
+	obpushstr(ds, SIZEDCSTR("\n\n"));
+	obpushstr(ds, SIZEDCSTR("   self%     self  total%    total  function\n"));
+	qsort(order, n, sizeof(int), cmpfuncbyself);
+	for (k = 0; k < topn; k++) {
+		FuncEntry *f = &pf->ft.funcs[order[k]];
+		obpushfstr(ds, "%6.2f%% %8lu %6.2f%% %8lu  %s\n",
+			100.0 * f->self / nsamples, (unsigned long)f->self,
+			100.0 * f->total / nsamples, (unsigned long)f->total, f->name);
+	}
+
+	obpushstr(ds, SIZEDCSTR("\ncall graph (callers <-, callees ->):\n"));
+	qsort(order, n, sizeof(int), cmpfuncbytotal);
+	for (k = 0; k < topn; k++) {
+		FuncEntry *f = &pf->ft.funcs[order[k]];
+		obpushfstr(ds, "%6.2f%% %8lu  %s\n", 100.0 * f->total / nsamples,
+			(unsigned long)f->total, f->name);
+		pushedges(ds, edges, nedges, order[k], 1);
+		pushedges(ds, edges, nedges, order[k], 0);
+	}
+	DBGFREE(ds, order);
+	DBGFREE(ds, edges);
+}
+
+static int cmpstack(const void *a, const void *b)
+{
+	size_t pa = *(const size_t*)a, pb = *(const size_t*)b;
+	int da = PROFFRAME(sortpf, pa)->line, db = PROFFRAME(sortpf, pb)->line;
+	int k;
+	/* root first, as the folded format lists them */
+	for (k = 1; k <= da && k <= db; k++) {
+		int fa = PROFFRAME(sortpf, pa + da + 1 - k)->func;
+		int fb = PROFFRAME(sortpf, pb + db + 1 - k)->func;
+		if (fa != fb) {
+			return fa - fb;
+		}
+	}
+	return da - db;
+}
+
+/* one "root;...;leaf count" line per distinct stack, for flamegraph.pl */
+static void profile_report_folded(DebugState *ds)
+{
+	Profiler *pf = &ds->prof;
+	size_t *samples, nsamples = 0, pos, i;
+	FILE *fp = NULL;
+
+	if (ds->argc > 3) {
+		fp = fopen(ds->argv[3], "w");
+		if (!fp) {
+			obpushfstr(ds, "failed to open \"%s\": %s", ds->argv[3], strerror(errno));
+			return;
+		}
+	}
+	samples = DBGMALLOC(ds, pf->nsamples * sizeof(size_t) + 1);
+	for (pos = firstsample(pf); pos < pf->head; pos += PROFFRAME(pf, pos)->line + 1) {
+		samples[nsamples++] = pos;
+	}
+	sortpf = pf;
+	qsort(samples, nsamples, sizeof(size_t), cmpstack);
+
+	for (i = 0; i < nsamples; ) {
+		size_t count = 1, s = samples[i];
+		int depth = PROFFRAME(pf, s)->line;
+		int k;
+		while (i + count < nsamples && cmpstack(&samples[i], &samples[i + count]) == 0) {
+			count++;
+		}
+		i += count;
+		if (depth == 0) {
+			continue;
+		}
+		for (k = depth; k >= 1; k--) {
+			const char *name = pf->ft.funcs[PROFFRAME(pf, s + k)->func].name;
+			if (fp) {
+				fprintf(fp, k > 1 ? "%s;" : "%s", name);
+			} else {
+				obpushfstr(ds, k > 1 ? "%s;" : "%s", name);
+			}
+		}
+		if (fp) {
+			fprintf(fp, " %lu\n", (unsigned long)count);
+		} else {
+			obpushfstr(ds, " %lu\n", (unsigned long)count);
+		}
+	}
+	DBGFREE(ds, samples);
+	if (fp) {
+		fclose(fp);
+		obpushfstr(ds, "%lu samples written to \"%s\"", (unsigned long)nsamples, ds->argv[3]);
+	}
+}
+
+static void profile_report(DebugState *ds)
+{
+	if (!ds->prof.ring) {
+		obpushstr(ds, SIZEDCSTR("no profile, use `profile start [hz]` first"));
+	} else if (ds->argc > 2 && strcmp(ds->argv[2], "folded") == 0) {
+		profile_report_folded(ds);
+	} else {
+		profile_report_summary(ds);
+	}
+}
+
+static void cmd_profile(DebugState *ds)
+{
+	const struct ProfileEntry {
+		const char *what;
+		void (*handler)(DebugState*);
+	}profiletable[] = {
+		{"start", profile_start},
+		{"stop", profile_stop},
+		{"report", profile_report},
+		{NULL, NULL},
+	};
+	const struct ProfileEntry *e = profiletable;
+	while (ds->argc > 1 && e->what) {
+		if (strcmp(e->what, ds->argv[1]) == 0) {
+			e->handler(ds);
+			return;
+		}
+		e++;
+	}
+	obpushstr(ds, SIZEDCSTR("usage: profile start [hz]|stop|report [n]|report folded [file]"));
+}
+
+static unsigned int countbucket(Counter *ct, const Proto *p)
+{
+	return lmod(cast(unsigned int, cast(size_t, p) >> 3), ct->nbuckets);
+}
+
+static int growcounter(Counter *ct)
+{
+	int n = ct->nbuckets ? ct->nbuckets * 2 : COUNT_MINBUCKETS;
+	CountProto **buckets = calloc(n, sizeof(CountProto*));
+	int i;
+	if (!buckets) {
+		return 0;
+	}
+	for (i = 0; i < ct->nbuckets; i++) {
+		CountProto *cp = ct->buckets[i];
+		while (cp) {
+			CountProto *next = cp->next;
+			unsigned int h = lmod(cast(unsigned int, cast(size_t, cp->p) >> 3), n);
+			cp->next = buckets[h];
+			buckets[h] = cp;
+			cp = next;
+		}
+	}
+	free(ct->buckets);
+	ct->buckets = buckets;
+	ct->nbuckets = n;
+	return 1;
+}
+
+/* Called from the VM thread, so it must not throw. */
+static CountProto* getcountproto(DebugState *ds, Proto *p)
+{
+	Counter *ct = &ds->count;
+	CountProto *cp;
+	if (ct->nbuckets > 0) {
+		for (cp = ct->buckets[countbucket(ct, p)]; cp; cp = cp->next) {
+			if (cp->p == p) {
+				return cp;
+			}
+		}
+	}
+	if (ct->nprotos >= ct->nbuckets && !growcounter(ct)) {
+		return NULL;
+	}
+	cp = malloc(sizeof(CountProto));
+	if (!cp) {
+		return NULL;
+	}
+	cp->counts = calloc(p->sizecode, sizeof(unsigned long));
+	cp->source = strdup(p->source ? getstr(p->source) : "=?");
+	if (!cp->counts || !cp->source) {
+		free(cp->counts);
+		free(cp->source);
+		free(cp);
+		return NULL;
+	}
+	cp->p = p;
+	cp->linedefined = p->linedefined;
+	cp->sizecode = p->sizecode;
+	cp->lines = NULL;
+	cp->next = ct->buckets[countbucket(ct, p)];
+	ct->buckets[countbucket(ct, p)] = cp;
+	ct->nprotos++;
+	return cp;
+}
+
+/*
+** 'p' is being freed: keep its counts with the line of each instruction,
+** or give them up if that cannot be allocated.
+*/
+static void retirecounts(DebugState *ds, Proto *p)
+{
+	Counter *ct = &ds->count;
+	CountProto **pcp, *cp;
+	int pc;
+	if (ct->nbuckets == 0) {
+		return;
+	}
+	pcp = &ct->buckets[countbucket(ct, p)];
+	while ((cp = *pcp) != NULL && cp->p != p) {
+		pcp = &cp->next;
+	}
+	if (!cp) {
+		return;
+	}
+	*pcp = cp->next;
+	if (ct->last == cp) {
+		ct->last = NULL;
+	}
+	cp->lines = malloc(cp->sizecode * sizeof(int));
+	if (!cp->lines) {
+		for (pc = 0; pc < cp->sizecode; pc++) {
+			ct->nlost += cp->counts[pc];
+		}
+		ct->nprotos--;
+		DBGFREE(ds, cp->counts);
+		DBGFREE(ds, cp->source);
+		DBGFREE(ds, cp);
+		return;
+	}
+	for (pc = 0; pc < cp->sizecode; pc++) {
+		cp->lines[pc] = getfuncline(p, pc);
+	}
+	cp->p = NULL;
+	cp->next = ct->retired;
+	ct->retired = cp;
+}
+
+static void countinstr(DebugState *ds, lua_State *L)
+{
+	CallInfo *ci = L->ci;
+	Proto *p = ci_func(ci)->p;
+	CountProto *cp = ds->count.last;
+	if (!cp || cp->p != p) {
+		cp = getcountproto(ds, p);
+		if (!cp) {
+			ds->count.nlost++;
+			return;
+		}
+		ds->count.last = cp;
+	}
+	cp->counts[pcRel(ci->u.l.savedpc, p)]++;
+}
+
+static void freecountlist(CountProto *cp)
+{
+	while (cp) {
+		CountProto *next = cp->next;
+		free(cp->counts);
+		free(cp->lines);
+		free(cp->source);
+		free(cp);
+		cp = next;
+	}
+}
+
+static void freecounts(DebugState *ds)
+{
+	Counter *ct = &ds->count;
+	int i;
+	for (i = 0; i < ct->nbuckets; i++) {
+		freecountlist(ct->buckets[i]);
+		ct->buckets[i] = NULL;
+	}
+	freecountlist(ct->retired);
+	ct->retired = NULL;
+	ct->nprotos = 0;
+	ct->last = NULL;
+	ct->nlost = 0;
+}
+
+static void stopcounting(DebugState *ds)
+{
+	CLEARDBGEV(ds->L, DBGEV_COUNT);
+	ds->count.on = 0;
+}
+
+static void count_on(DebugState *ds)
+{
+	if (ds->count.on) {
+		obpushstr(ds, SIZEDCSTR("instruction counting is already on"));
+		return;
+	}
+	freecounts(ds);
+	ds->count.on = 1;
+	SETDBGEV(ds->L, DBGEV_COUNT);
+	obpushstr(ds, SIZEDCSTR("instruction counting on, previous counts cleared"));
+}
+
+static void count_off(DebugState *ds)
+{
+	if (!ds->count.on) {
+		obpushstr(ds, SIZEDCSTR("instruction counting is not on"));
+		return;
+	}
+	stopcounting(ds);
+	obpushfstr(ds, "instruction counting off, %d functions counted", ds->count.nprotos);
+}
+
+typedef struct LineCount {
+	const CountProto *cp;
+	int line;
+	unsigned long count;
+}LineCount;
+
+static int cmplinecount(const void *a, const void *b)
+{
+	const LineCount *la = a, *lb = b;
+	int c = la->cp == lb->cp ? 0 : strcmp(la->cp->source, lb->cp->source);
+	if (c != 0) {
+		return c;
+	}
+	return la->line - lb->line;
+}
+
+static int cmplinecountdesc(const void *a, const void *b)
+{
+	const LineCount *la = a, *lb = b;
+	if (la->count != lb->count) {
+		return la->count < lb->count ? 1 : -1;
+	}
+	return cmplinecount(a, b);
+}
+
+/*
+** One LineCount per executed line ('byfunc' 0) or per function, merging
+** the lines nested functions share with their parent.
+*/
+static LineCount* collectcounts(DebugState *ds, int byfunc, size_t *pn, unsigned long *ptotal)
+{
+	Counter *ct = &ds->count;
+	LineCount *lc;
+	size_t n = 0, cap = 64, i, j;
+	unsigned long total = 0;
+	int b, pc;
+
+	lc = DBGMALLOC(ds, cap * sizeof(LineCount));
+	for (b = -1; b < ct->nbuckets; b++) {
+		CountProto *cp;
+		for (cp = b < 0 ? ct->retired : ct->buckets[b]; cp; cp = cp->next) {
+			for (pc = 0; pc < cp->sizecode; pc++) {
+				if (cp->counts[pc] == 0) {
+					continue;
+				}
+				total += cp->counts[pc];
+				if (byfunc && n > 0 && lc[n - 1].cp == cp) {
+					lc[n - 1].count += cp->counts[pc];
+					continue;
+				}
+				if (n == cap) {
+					cap *= 2;
+					lc = DBGREALLOC(ds, lc, cap * sizeof(LineCount));
+				}
+				lc[n].cp = cp;
+				lc[n].line = byfunc ? cp->linedefined :
+					cp->lines ? cp->lines[pc] : getfuncline(cp->p, pc);
+				lc[n].count = cp->counts[pc];
+				n++;
+			}
+		}
+	}
+	if (!byfunc && n > 0) {
+		qsort(lc, n, sizeof(LineCount), cmplinecount);
+		for (i = 1, j = 0; i < n; i++) {
+			if (cmplinecount(&lc[j], &lc[i]) == 0) {
+				lc[j].count += lc[i].count;
+			} else {
+				lc[++j] = lc[i];
+			}
+		}
+		n = j + 1;
+	}
+	qsort(lc, n, sizeof(LineCount), cmplinecountdesc);
+	*pn = n;
+	*ptotal = total;
+	return lc;
+}
+
+static void count_report(DebugState *ds, int byfunc)
+{
+	LineCount *lc;
+	size_t n, i;
+	unsigned long total;
+	int topn = ds->argc > 2 ? atoi(ds->argv[2]) : COUNT_TOPN;
+	char buff[PROTONAMESIZE];
+
+	lc = collectcounts(ds, byfunc, &n, &total);
+	if (total == 0) {
+		DBGFREE(ds, lc);
+		obpushstr(ds, SIZEDCSTR("no instructions counted"));
+		return;
+	}
+	if (topn <= 0 || (size_t)topn > n) {
+		topn = (int)n;
+	}
+	obpushfstr(ds, "%lu instructions", total);
+	if (ds->count.nlost > 0) {
+		obpushfstr(ds, ", %lu not counted for lack of memory", ds->count.nlost);
+	}
+	obpushstr(ds, SIZEDCSTR("\n\n        count       %  "));
+	obpushstr(ds, byfunc ? "function\n" : "line\n", byfunc ? 9 : 5);
+	for (i = 0; i < (size_t)topn; i++) {
+		funcname(lc[i].cp->source, lc[i].cp->linedefined, buff);
+		obpushfstr(ds, "%13lu  %6.2f%%  ", lc[i].count, 100.0 * lc[i].count / total);
+		if (byfunc) {
+			obpushfstr(ds, "%s\n", buff);
+		} else {
+			*strrchr(buff, ':') = '\0';
+			obpushfstr(ds, "%s:%d\n", buff, lc[i].line);
+		}
+	}
+	DBGFREE(ds, lc);
+}
+
+static void count_top(DebugState *ds)
+{
+	count_report(ds, 0);
+}
+
+static void count_funcs(DebugState *ds)
+{
+	count_report(ds, 1);
+}
+
+static void cmd_count(DebugState *ds)
+{
+	const struct CountEntry {
+		const char *what;
+		void (*handler)(DebugState*);
+	}counttable[] = {
+		{"on", count_on},
+		{"off", count_off},
+		{"top", count_top},
+		{"funcs", count_funcs},
+		{NULL, NULL},
+	};
+	const struct CountEntry *e = counttable;
+	while (ds->argc > 1 && e->what) {
+		if (strcmp(e->what, ds->argv[1]) == 0) {
+			e->handler(ds);
+			return;
+		}
+		e++;
+	}
+	obpushstr(ds, SIZEDCSTR("usage: count on|off|top [n]|funcs [n]"));
+}
+
+/* Called from lua_load as well, so it must not throw. */
+static void addprobe(DebugState *ds, SrcFile *srcfile, Proto *p, int codepos, int line)
+{
+	Coverage *cov = &ds->cov;
+	Instruction code = p->code[codepos];
+	Instruction probe;
+	Probe *pr;
+
+	if (cov->nprobes == MAX_PROBES) {
+		return;
+	}
+	if (cov->nprobes == cov->sizeprobes) {
+		int size = cov->sizeprobes ? cov->sizeprobes * 2 : 1024;
+		Probe *probes = realloc(cov->probes, size * sizeof(Probe));
+		if (!probes) {
+			return;
+		}
+		cov->probes = probes;
+		cov->sizeprobes = size;
+	}
+	probe = CREATE_Ax(OP_INTERRUPT, PROBE_BASE + cov->nprobes);
+	if (GET_OPCODE(code) == OP_INTERRUPT) {
+		/* a breakpoint is armed here, slip the probe under it */
+		if (!savedcode(ds, p, codepos, &code)) {
+			return;
+		}
+		replacesavedcode(ds, p, codepos, code, probe);
+	} else {
+		p->code[codepos] = probe;
+	}
+	pr = &cov->probes[cov->nprobes++];
+	pr->p = p;
+	pr->srcfile = srcfile;
+	pr->codepos = codepos;
+	pr->line = line;
+	pr->code = code;
+	pr->hit = 0;
+}
+
+/* probe the first instruction of every line of a loaded version */
+static void coverversion(DebugState *ds, SrcFile *srcfile, Proto *top)
+{
+	LineIndex *li = getlineindex(srcfile, top);
+	int i, j;
+	if (!li) {
+		return;
+	}
+	for (i = 0; i < li->nfuncs; i++) {
+		FuncLines *fl = &li->funcs[i];
+		if (!getfunclines(fl)) {
+			continue;
+		}
+		for (j = 0; j < fl->nlines; j++) {
+			addprobe(ds, srcfile, fl->p, fl->lines[j].codepos, fl->lines[j].line);
+		}
+	}
+}
+
+/* A probe fired: record it and run the user instruction from now on. */
+static void hitprobe(DebugState *ds, lua_State *L, int idx)
+{
+	Probe *pr = &ds->cov.probes[idx];
+	lua_assert(idx < ds->cov.nprobes);
+	pr->p->code[pr->codepos] = pr->code;
+	replacesavedcode(ds, pr->p, pr->codepos,
+		CREATE_Ax(OP_INTERRUPT, PROBE_BASE + idx), pr->code);
+	pr->hit = 1;
+	L->ci->u.l.savedpc--;
+}
+
+static void stopcoverage(DebugState *ds)
+{
+	Coverage *cov = &ds->cov;
+	int i;
+	for (i = 0; i < cov->nprobes; i++) {
+		Probe *pr = &cov->probes[i];
+		Instruction probe = CREATE_Ax(OP_INTERRUPT, PROBE_BASE + i);
+		if (!pr->hit && pr->p) {
+			if (pr->p->code[pr->codepos] == probe) {
+				pr->p->code[pr->codepos] = pr->code;
+			}
+			replacesavedcode(ds, pr->p, pr->codepos, probe, pr->code);
+		}
+	}
+	cov->on = 0;
+}
+
+static void coverage_start(DebugState *ds)
+{
+	ProtoRef *ref;
+	if (ds->cov.on) {
+		obpushstr(ds, SIZEDCSTR("coverage is already on"));
+		return;
+	}
+	ds->cov.nprobes = 0;
+	ds->cov.on = 1;
+	for (ref = nextversion(ds, NULL, NULL); ref; ref = nextversion(ds, NULL, ref)) {
+		coverversion(ds, ref->srcfile, ref->p);
+	}
+	obpushfstr(ds, "coverage started, %d probes armed", ds->cov.nprobes);
+}
+
+static void coverage_stop(DebugState *ds)
+{
+	if (!ds->cov.on) {
+		obpushstr(ds, SIZEDCSTR("coverage is not on"));
+		return;
+	}
+	stopcoverage(ds);
+	obpushstr(ds, SIZEDCSTR("coverage stopped"));
+}
+
+static int cmpprobe(const void *a, const void *b)
+{
+	const Probe *pa = a, *pb = b;
+	if (pa->srcfile != pb->srcfile) {
+		return strcmp(pa->srcfile->filepath, pb->srcfile->filepath);
+	}
+	return pa->line - pb->line;
+}
+
+static void pushlcov(DebugState *ds, FILE *fp, const char *fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	if (fp) {
+		vfprintf(fp, fmt, ap);
+	} else {
+		obpushvstr(ds, fmt, ap);
+	}
+	va_end(ap);
+}
+
+/*
+** LCOV tracefile, one record per file. A line counts as hit if any of
+** its probes fired, in any version of the file.
+*/
+static void coverage_report(DebugState *ds)
+{
+	Coverage *cov = &ds->cov;
+	Probe *probes;
+	FILE *fp = NULL;
+	int i, nfiles = 0;
+
+	if (cov->nprobes == 0) {
+		obpushstr(ds, SIZEDCSTR("no coverage data, use `coverage start` first"));
+		return;
+	}
+	if (ds->argc > 2) {
+		fp = fopen(ds->argv[2], "w");
+		if (!fp) {
+			obpushfstr(ds, "failed to open \"%s\": %s", ds->argv[2], strerror(errno));
+			return;
+		}
+	}
+	/* sort a copy, the probe index is the Ax of armed probes */
+	probes = DBGMALLOC(ds, cov->nprobes * sizeof(Probe));
+	memcpy(probes, cov->probes, cov->nprobes * sizeof(Probe));
+	qsort(probes, cov->nprobes, sizeof(Probe), cmpprobe);
+
+	for (i = 0; i < cov->nprobes; ) {
+		SrcFile *srcfile = probes[i].srcfile;
+		int found = 0, hit = 0;
+		pushlcov(ds, fp, "TN:\nSF:%s\n", srcfile->filepath);
+		while (i < cov->nprobes && probes[i].srcfile == srcfile) {
+			int line = probes[i].line, lhit = 0;
+			while (i < cov->nprobes && probes[i].srcfile == srcfile &&
+				probes[i].line == line) {
+				lhit |= probes[i].hit;
+				i++;
+			}
+			pushlcov(ds, fp, "DA:%d,%d\n", line, lhit);
+			found++;
+			hit += lhit;
+		}
+		pushlcov(ds, fp, "LF:%d\nLH:%d\nend_of_record\n", found, hit);
+		nfiles++;
+	}
+	DBGFREE(ds, probes);
+	if (fp) {
+		fclose(fp);
+		obpushfstr(ds, "coverage of %d file(s) written to \"%s\"", nfiles, ds->argv[2]);
+	}
+}
+
+static void cmd_coverage(DebugState *ds)
+{
+	const struct CoverageEntry {
+		const char *what;
+		void (*handler)(DebugState*);
+	}coveragetable[] = {
+		{"start", coverage_start},
+		{"stop", coverage_stop},
+		{"report", coverage_report},
+		{NULL, NULL},
+	};
+	const struct CoverageEntry *e = coveragetable;
+	while (ds->argc > 1 && e->what) {
+		if (strcmp(e->what, ds->argv[1]) == 0) {
+			e->handler(ds);
+			return;
+		}
+		e++;
+	}
+	obpushstr(ds, SIZEDCSTR("usage: coverage start|stop|report [file]"));
+}
+
+/* a monotonic clock, the TSC where there is one */
+static unsigned long long tracetime(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+static double calibratetracetime(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	struct timespec c0, c1, ts = {0, 10000000};
+	unsigned long long t0, t1;
+	double us;
+	clock_gettime(CLOCK_MONOTONIC, &c0);
+	t0 = tracetime();
+	nanosleep(&ts, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &c1);
+	t1 = tracetime();
+	us = (c1.tv_sec - c0.tv_sec) * 1e6 + (c1.tv_nsec - c0.tv_nsec) / 1e3;
+	return us > 0 ? (t1 - t0) / us : 1.0;
+#else
+	return 1000.0;
+#endif
+}
+
+static int formatevent(Tracer *tr, const TraceEvent *ev, char *buff, size_t size)
+{
+	const char *name = tr->ft.funcs[ev->func].name;
+	double us = (ev->ts - tr->start) / tr->ticksperus;
+	return snprintf(buff, size, "%14.3f %p %*s%s %s%s\n", us, (const void*)ev->L,
+		2 * ev->depth, "", ev->what == LUAG_TRACECALL ? "->" : "<-", name,
+		ev->what == LUAG_TRACETAIL ? " (tail call)" : "");
+}
+
+/*
+** Called by the server thread between polls while the VM runs: send what
+** the VM has produced so far. It writes directly to the client, since
+** the output buffer belongs to whichever thread is paused in a command.
+** Events are consumed once sent; if the client cannot take them, streaming
+** stops and they are left for `trace dump`.
+*/
+static void streamtrace(DebugState *ds)
+{
+	Tracer *tr = &ds->trace;
+	size_t head = __atomic_load_n(&tr->head, __ATOMIC_ACQUIRE);
+	size_t tail = tr->tail;
+	char buff[4096];
+	size_t len = 0;
+	if (ds->fdout < 0) {
+		return;
+	}
+	if (!tr->fullsent && __atomic_load_n(&tr->nuntraced, __ATOMIC_RELAXED) > 0) {
+		len = snprintf(buff, sizeof(buff),
+			"(more than %d functions called, the others are not traced)\n", FT_MAXFUNCS - 1);
+		tr->fullsent = 1;
+	}
+	while (tail != head || len > 0) {
+		if (tail != head) {
+			len += formatevent(tr, &tr->ring[tail & tr->ringmask], buff + len, sizeof(buff) - len);
+			tail++;
+		}
+		if (tail == head || len >= sizeof(buff) - 512) {  /* no room for one more line */
+			if (writefull(ds->fdout, buff, len) != 0) {
+				__atomic_store_n(&tr->streaming, 0, __ATOMIC_RELAXED);
+				return;
+			}
+			len = 0;
+			__atomic_store_n(&tr->tail, tail, __ATOMIC_RELEASE);
+		}
+	}
+}
+
+static void stoptracing(DebugState *ds)
+{
+	CLEARDBGEV(ds->L, DBGEV_TRACE);
+	ds->trace.on = 0;
+	__atomic_store_n(&ds->trace.streaming, 0, __ATOMIC_RELAXED);
+}
+
+static void trace_calls(DebugState *ds)
+{
+	Tracer *tr = &ds->trace;
+	const char *pattern = ds->argc > 2 ? ds->argv[2] : "";
+	if (strlen(pattern) >= TRACE_MAXPATTERN) {
+		obpushstr(ds, SIZEDCSTR("pattern too long"));
+		return;
+	}
+	if (!tr->ring) {
+		tr->ring = DBGMALLOC(ds, ds->conf.traceringsize * sizeof(TraceEvent));
+		tr->ringmask = ds->conf.traceringsize - 1;
+		tr->ticksperus = calibratetracetime();
+	}
+	resetfunctable(ds, &tr->ft);
+	strcpy(tr->pattern, pattern);
+	tr->head = tr->tail = 0;
+	tr->ndropped = 0;
+	tr->nuntraced = 0;
+	tr->fullsent = 0;
+	tr->start = tracetime();
+	tr->on = 1;
+	SETDBGEV(ds->L, DBGEV_TRACE);
+	if (*pattern) {
+		obpushfstr(ds, "tracing calls of functions matching \"%s\"", pattern);
+	} else {
+		obpushstr(ds, SIZEDCSTR("tracing calls of all Lua functions"));
+	}
+}
+
+static void trace_stop(DebugState *ds)
+{
+	if (!ds->trace.on) {
+		obpushstr(ds, SIZEDCSTR("tracing is not on"));
+		return;
+	}
+	stoptracing(ds);
+	obpushfstr(ds, "tracing stopped, %lu events dropped", ds->trace.ndropped);
+	if (ds->trace.nuntraced > 0) {
+		obpushfstr(ds, ", %lu calls not traced: more than %d functions called",
+			ds->trace.nuntraced, FT_MAXFUNCS - 1);
+	}
+}
+
+static void trace_stream(DebugState *ds)
+{
+	Tracer *tr = &ds->trace;
+	if (ds->argc > 2 && strcmp(ds->argv[2], "off") == 0) {
+		__atomic_store_n(&tr->streaming, 0, __ATOMIC_RELAXED);
+		obpushstr(ds, SIZEDCSTR("trace streaming off"));
+	} else if (ds->mode != 'b') {
+		obpushstr(ds, SIZEDCSTR("trace streaming needs background mode"));
+	} else {
+		/* streaming reads from 'tail', skip what has been overwritten */
+		if (tr->head - tr->tail > tr->ringmask + 1) {
+			tr->tail = tr->head - tr->ringmask - 1;
+		}
+		__atomic_store_n(&tr->streaming, 1, __ATOMIC_RELAXED);
+		obpushstr(ds, SIZEDCSTR("trace streaming on, events are sent while the VM runs"));
+	}
+}
+
+/* events not consumed yet, read while the VM is paused */
+static void trace_dump(DebugState *ds)
+{
+	Tracer *tr = &ds->trace;
+	FILE *fp = NULL;
+	char buff[PROTONAMESIZE + 128];
+	size_t pos, n = 0;
+
+	if (!tr->ring) {
+		obpushstr(ds, SIZEDCSTR("no trace, use `trace calls [pattern]` first"));
+		return;
+	}
+	if (ds->argc > 2) {
+		fp = fopen(ds->argv[2], "w");
+		if (!fp) {
+			obpushfstr(ds, "failed to open \"%s\": %s", ds->argv[2], strerror(errno));
+			return;
+		}
+	}
+	pos = tr->tail;
+	if (tr->head - pos > tr->ringmask + 1) {
+		pos = tr->head - tr->ringmask - 1;
+		obpushfstr(ds, "(%lu older events overwritten)\n", (unsigned long)(pos - tr->tail));
+	}
+	if (tr->nuntraced > 0) {
+		obpushfstr(ds, "(%lu calls not traced: more than %d functions called)\n",
+			tr->nuntraced, FT_MAXFUNCS - 1);
+	}
+	for (; pos < tr->head; pos++, n++) {
+		int len = formatevent(tr, &tr->ring[pos & tr->ringmask], buff, sizeof(buff));
+		if (fp) {
+			fwrite(buff, 1, len, fp);
+		} else {
+			obpushstr(ds, buff, len);
+		}
+	}
+	tr->tail = tr->head;
+	if (fp) {
+		fclose(fp);
+		obpushfstr(ds, "%lu events written to \"%s\"", (unsigned long)n, ds->argv[2]);
+	} else if (n == 0) {
+		obpushstr(ds, SIZEDCSTR("no new events"));
+	}
+}
+
+static void cmd_trace(DebugState *ds)
+{
+	const struct TraceEntry {
+		const char *what;
+		void (*handler)(DebugState*);
+	}tracetable[] = {
+		{"calls", trace_calls},
+		{"stop", trace_stop},
+		{"stream", trace_stream},
+		{"dump", trace_dump},
+		{NULL, NULL},
+	};
+	const struct TraceEntry *e = tracetable;
+	while (ds->argc > 1 && e->what) {
+		if (strcmp(e->what, ds->argv[1]) == 0) {
+			e->handler(ds);
+			return;
 		}
-		if (op >= OP_JMP && op <= OP_TFORLOOP && op != OP_CALL) {
-			codepos = -1;
-			break;
+		e++;
+	}
+	obpushstr(ds, SIZEDCSTR("usage: trace calls [pattern]|stop|stream [on|off]|dump [file]"));
+}
+
+static size_t memsitehash(int func, int line)
+{
+	return cast(size_t, func) * 2654435761u + cast(size_t, line);
+}
+
+static int growmemsites(MemProfiler *mp)
+{
+	size_t size = mp->sizesites ? mp->sizesites * 2 : MEMPROF_MINSITES;
+	MemSite *sites = malloc(size * sizeof(MemSite));
+	size_t i;
+	if (!sites) {
+		return 0;
+	}
+	for (i = 0; i < size; i++) {
+		sites[i].func = -1;
+	}
+	for (i = 0; i < mp->sizesites; i++) {
+		MemSite *ms = &mp->sites[i];
+		if (ms->func >= 0) {
+			size_t h = memsitehash(ms->func, ms->line) & (size - 1);
+			while (sites[h].func >= 0) {
+				h = (h + 1) & (size - 1);
+			}
+			sites[h] = *ms;
+		}
+	}
+	free(mp->sites);
+	mp->sites = sites;
+	mp->sizesites = size;
+	return 1;
+}
+
+/*
+** The innermost Lua frame of the running thread is the site; allocations
+** made by C functions go to the Lua line which called them.
+*/
+static MemSite* getmemsite(DebugState *ds)
+{
+	MemProfiler *mp = &ds->memprof;
+	lua_State *L = G(ds->L)->running;
+	CallInfo *ci = L->ci;
+	int func = 0, line = -1;
+	size_t h;
+
+	while (ci != &L->base_ci && !isLua(ci)) {
+		ci = ci->previous;
+	}
+	if (ci != &L->base_ci) {
+		func = internfunc(&mp->ft, ci);
+		line = currentline(ci);
+	}
+	if (mp->nsites >= mp->sizesites / 4 * 3 && !growmemsites(mp)) {
+		return NULL;
+	}
+	h = memsitehash(func, line) & (mp->sizesites - 1);
+	while (mp->sites[h].func >= 0) {
+		if (mp->sites[h].func == func && mp->sites[h].line == line) {
+			return &mp->sites[h];
+		}
+		h = (h + 1) & (mp->sizesites - 1);
+	}
+	mp->sites[h].func = func;
+	mp->sites[h].line = line;
+	mp->sites[h].nalloc = mp->sites[h].nfree = 0;
+	mp->sites[h].allocated = mp->sites[h].freed = 0;
+	mp->nsites++;
+	return &mp->sites[h];
+}
+
+/*
+** Installed as the allocator of the state. The site is looked up before
+** calling the real allocator, which may be moving the very stack the
+** CallInfo chain points into.
+*/
+static void* memprof_alloc(void *ud, void *ptr, size_t osize, size_t nsize)
+{
+	DebugState *ds = ud;
+	MemProfiler *mp = &ds->memprof;
+	MemSite *ms = getmemsite(ds);
+	void *np = mp->frealloc(mp->ud, ptr, osize, nsize);
+	if (!ms) {
+		mp->nlost++;
+	} else if (nsize == 0) {
+		if (ptr) {
+			ms->nfree++;
+			ms->freed += osize;
+		}
+	} else if (np) {
+		if (!ptr) {  /* 'osize' is a type tag then */
+			ms->nalloc++;
+			ms->allocated += nsize;
+		} else if (nsize > osize) {
+			ms->nalloc++;
+			ms->allocated += nsize - osize;
+		} else {
+			ms->freed += osize - nsize;
+		}
+	}
+	return np;
+}
+
+static void stopmemprof(DebugState *ds)
+{
+	MemProfiler *mp = &ds->memprof;
+	if (mp->on) {
+		G(ds->L)->frealloc = mp->frealloc;
+		G(ds->L)->ud = mp->ud;
+		mp->on = 0;
+	}
+}
+
+static void memprof_start(DebugState *ds)
+{
+	MemProfiler *mp = &ds->memprof;
+	global_State *g = G(ds->L);
+	size_t i;
+	if (mp->on) {
+		obpushstr(ds, SIZEDCSTR("memory profiler is already on"));
+		return;
+	}
+	resetfunctable(ds, &mp->ft);
+	if (!mp->sites && !growmemsites(mp)) {
+		DBGTHROW(ds, "out of memory");
+	}
+	for (i = 0; i < mp->sizesites; i++) {
+		mp->sites[i].func = -1;
+	}
+	mp->nsites = 0;
+	mp->nlost = 0;
+	mp->frealloc = g->frealloc;
+	mp->ud = g->ud;
+	g->frealloc = memprof_alloc;
+	g->ud = ds;
+	mp->on = 1;
+	obpushstr(ds, SIZEDCSTR("memory profiler on, previous results cleared"));
+}
+
+static void memprof_stop(DebugState *ds)
+{
+	if (!ds->memprof.on) {
+		obpushstr(ds, SIZEDCSTR("memory profiler is not on"));
+		return;
+	}
+	stopmemprof(ds);
+	obpushstr(ds, SIZEDCSTR("memory profiler off"));
+}
+
+static int cmpmemsite(const void *a, const void *b)
+{
+	const MemSite *ma = a, *mb = b;
+	if (ma->allocated != mb->allocated) {
+		return ma->allocated < mb->allocated ? 1 : -1;
+	}
+	return ma->nalloc < mb->nalloc ? 1 : (ma->nalloc > mb->nalloc ? -1 : 0);
+}
+
+static void memprof_report(DebugState *ds)
+{
+	MemProfiler *mp = &ds->memprof;
+	MemSite *sites;
+	size_t i, n = 0, allocated = 0;
+	int topn = ds->argc > 2 ? atoi(ds->argv[2]) : MEMPROF_TOPN;
+
+	if (!mp->sites || mp->nsites == 0) {
+		obpushstr(ds, SIZEDCSTR("no allocations recorded, use `memprof start` first"));
+		return;
+	}
+	sites = DBGMALLOC(ds, mp->nsites * sizeof(MemSite));
+	for (i = 0; i < mp->sizesites; i++) {
+		if (mp->sites[i].func >= 0) {
+			allocated += mp->sites[i].allocated;
+			sites[n++] = mp->sites[i];
+		}
+	}
+	qsort(sites, n, sizeof(MemSite), cmpmemsite);
+	if (topn <= 0 || (size_t)topn > n) {
+		topn = (int)n;
+	}
+	obpushfstr(ds, "%lu bytes allocated at %lu sites", (unsigned long)allocated,
+		(unsigned long)n);
+	if (mp->nlost > 0) {
+		obpushfstr(ds, ", %lu events not recorded for lack of memory", mp->nlost);
+	}
+	obpushstr(ds, SIZEDCSTR("\n\n allocated bytes   allocs     freed bytes    frees  site\n"));
+	for (i = 0; i < (size_t)topn; i++) {
+		MemSite *ms = &sites[i];
+		const char *name = mp->ft.funcs[ms->func].name;
+		obpushfstr(ds, "%16lu %8lu %15lu %8lu  ", (unsigned long)ms->allocated,
+			ms->nalloc, (unsigned long)ms->freed, ms->nfree);
+		if (ms->func == 0) {
+			obpushfstr(ds, "%s\n", ms->line < 0 ? "(no Lua function)" : name);
+		} else if (ms->line < 0) {
+			obpushfstr(ds, "%s\n", name);
+		} else {
+			/* "source:line in source:linedefined" */
+			const char *colon = strrchr(name, ':');
+			obpushstr(ds, name, colon - name);
+			obpushfstr(ds, ":%d in %s\n", ms->line, name);
+		}
+	}
+	obpushstr(ds, SIZEDCSTR("\nfrees are counted where the collector happened to run.\n"));
+	DBGFREE(ds, sites);
+}
+
+static void cmd_memprof(DebugState *ds)
+{
+	const struct MemprofEntry {
+		const char *what;
+		void (*handler)(DebugState*);
+	}memproftable[] = {
+		{"start", memprof_start},
+		{"stop", memprof_stop},
+		{"report", memprof_report},
+		{NULL, NULL},
+	};
+	const struct MemprofEntry *e = memproftable;
+	while (ds->argc > 1 && e->what) {
+		if (strcmp(e->what, ds->argv[1]) == 0) {
+			e->handler(ds);
+			return;
+		}
+		e++;
+	}
+	obpushstr(ds, SIZEDCSTR("usage: memprof start|stop|report [n]"));
+}
+
+/*
+** Heap snapshots remember the type histogram and the size of every live
+** table, keyed by address. A table freed and another allocated at the
+** same address between two points look like one table that changed size.
+*/
+static void growsnaptables(DebugState *ds, HeapSnapshot *snap)
+{
+	size_t i, h, newsize = snap->sizetables ? snap->sizetables * 2 : 1024;
+	SnapTable *tables = calloc(newsize, sizeof(SnapTable));
+	if (!tables) {
+		DBGTHROW(ds, "out of memory");
+	}
+	for (i = 0; i < snap->sizetables; i++) {
+		if (snap->tables[i].t) {
+			h = tablehash(snap->tables[i].t) & (newsize - 1);
+			while (tables[h].t) {
+				h = (h + 1) & (newsize - 1);
+			}
+			tables[h] = snap->tables[i];
+		}
+	}
+	DBGFREE(ds, snap->tables);
+	snap->tables = tables;
+	snap->sizetables = newsize;
+}
+
+/* the slot of 't', or the free slot where it would go */
+static SnapTable* findsnaptable(HeapSnapshot *snap, const Table *t)
+{
+	size_t h = tablehash(t) & (snap->sizetables - 1);
+	while (snap->tables[h].t && snap->tables[h].t != t) {
+		h = (h + 1) & (snap->sizetables - 1);
+	}
+	return &snap->tables[h];
+}
+
+static void freeheapsnapshot(DebugState *ds)
+{
+	DBGFREE(ds, ds->snap.tables);
+	memset(&ds->snap, 0, sizeof(ds->snap));
+}
+
+static void visitheapsnapshot(void *ud, GCObject *o)
+{
+	HeapStats *hs = ud;
+	HeapSnapshot *snap = &hs->ds->snap;
+	size_t bytes = objsize(o);
+	if (countobject(hs, o, bytes) && o->tt == LUA_TTABLE) {
+		SnapTable *st;
+		if (snap->ntables >= snap->sizetables / 4 * 3) {
+			growsnaptables(hs->ds, snap);
+		}
+		st = findsnaptable(snap, gco2t(o));
+		st->t = gco2t(o);
+		st->bytes = bytes;
+		snap->ntables++;
+	}
+}
+
+static void visitheapdiff(void *ud, GCObject *o)
+{
+	HeapStats *hs = ud;
+	size_t bytes = objsize(o);
+	if (countobject(hs, o, bytes) && o->tt == LUA_TTABLE) {
+		Table *t = gco2t(o);
+		SnapTable *st = findsnaptable(&hs->ds->snap, t);
+		if (st->t) {
+			hs->nmatched++;
+			if (bytes > st->bytes) {
+				pushtoptable(hs, t, bytes - st->bytes, bytes);
+			}
+		} else {
+			hs->nnew++;
+			hs->newbytes += bytes;
+			pushtoptable(hs, t, bytes, bytes);
+		}
+	}
+}
+
+static void heap_snapshot(DebugState *ds)
+{
+	HeapSnapshot *snap = &ds->snap;
+	HeapStats hs;
+	size_t nobjs = 0, nbytes = 0;
+	int i;
+
+	snap->taken = 0;
+	snap->ntables = 0;
+	if (!snap->tables) {
+		growsnaptables(ds, snap);
+	} else {
+		memset(snap->tables, 0, sizeof(SnapTable) * snap->sizetables);
+	}
+	initheapstats(ds, &hs);
+	walkheap(hs.g, visitheapsnapshot, &hs);
+	for (i = 0; i < HT_NTYPES; i++) {
+		snap->count[i] = hs.count[i];
+		snap->bytes[i] = hs.bytes[i];
+		nobjs += hs.count[i];
+		nbytes += hs.bytes[i];
+	}
+	snap->total = gettotalbytes(hs.g);
+	snap->taken = 1;
+	obpushfstr(ds, "snapshot taken: %lu objects, %lu bytes, %lu tables",
+		(unsigned long)nobjs, (unsigned long)nbytes, (unsigned long)snap->ntables);
+}
+
+/* heap diff [n] */
+static void heap_diff(DebugState *ds)
+{
+	HeapSnapshot *snap = &ds->snap;
+	HeapStats hs;
+	PathFinder pf;
+	lu_mem total;
+	int i;
+
+	if (!snap->taken) {
+		obpushstr(ds, SIZEDCSTR("no snapshot, use `heap snapshot` first"));
+		return;
+	}
+	initheapstats(ds, &hs);
+	hs.maxtop = ds->argc > 2 ? atoi(ds->argv[2]) : HEAP_TOPN;
+	if (hs.maxtop <= 0) {
+		hs.maxtop = HEAP_TOPN;
+	} else if (hs.maxtop > HEAP_MAXTOPN) {
+		hs.maxtop = HEAP_MAXTOPN;
+	}
+	hs.top = arenaalloc(ds, sizeof(HeapTable) * hs.maxtop);
+	walkheap(hs.g, visitheapdiff, &hs);
+	total = gettotalbytes(hs.g);
+
+	obpushfstr(ds, "%lu bytes in use, %+ld since the snapshot\n",
+		(unsigned long)total, (long)(total - snap->total));
+	obpushstr(ds, SIZEDCSTR("\ntype               objects      change           bytes        change\n"));
+	for (i = 0; i < HT_NTYPES; i++) {
+		if (hs.count[i] == 0 && snap->count[i] == 0) {
+			continue;
+		}
+		obpushfstr(ds, "%-14s %11lu %+11ld %15lu %+13ld\n", heaptypenames[i],
+			(unsigned long)hs.count[i], (long)(hs.count[i] - snap->count[i]),
+			(unsigned long)hs.bytes[i], (long)(hs.bytes[i] - snap->bytes[i]));
+	}
+	obpushfstr(ds, "\ntables: %lu new (%lu bytes), %lu gone since the snapshot\n",
+		(unsigned long)hs.nnew, (unsigned long)hs.newbytes,
+		(unsigned long)(snap->ntables - hs.nmatched));
+	if (hs.ntop > 0) {
+		preparepaths(ds, &pf, &hs);
+		obpushstr(ds, SIZEDCSTR("\n     growth        bytes  table\n"));
+		for (i = 0; i < hs.ntop; i++) {
+			HeapTable *ht = &hs.top[i];
+			obpushfstr(ds, "%11lu %12lu  %p  ", (unsigned long)ht->rank,
+				(unsigned long)ht->bytes, (void*)ht->t);
+			pushpathof(ds, &pf, ht->t);
+		}
+		notepathbudget(ds, &pf);
+	}
+}
+
+static void cmd_heap(DebugState *ds)
+{
+	const struct HeapEntry {
+		const char *what;
+		void (*handler)(DebugState*);
+	}heaptable[] = {
+		{"snapshot", heap_snapshot},
+		{"diff", heap_diff},
+		{NULL, NULL},
+	};
+	const struct HeapEntry *e = heaptable;
+	while (ds->argc > 1 && e->what) {
+		if (strcmp(e->what, ds->argv[1]) == 0) {
+			e->handler(ds);
+			return;
+		}
+		e++;
+	}
+	obpushstr(ds, SIZEDCSTR("usage: heap snapshot|diff [n]"));
+}
+
+/*
+** Which modules package.loaded holds, and how big their tables are: it
+** changes when a module is loaded or gains functions, mostly.
+*/
+static size_t loadedsig(Table *lt)
+{
+	size_t sig = sizenode(lt);
+	int i;
+	for (i = 0; i < sizenode(lt); i++) {
+		Node *mod = gnode(lt, i);
+		if (ttisstring(gkey(mod)) && ttistable(gval(mod))) {
+			Table *mt = hvalue(gval(mod));
+			sig = sig * 31 + (cast(size_t, mt) >> 4) + sizenode(mt);
+		}
+	}
+	return sig;
+}
+
+/*
+** Name the C functions of the loaded modules. This reads Lua tables, so
+** it runs on the VM thread; the server thread then only reads the copy to
+** tell where a busy VM is. The index is rebuilt only when package.loaded
+** changed, into the buffer not published, which is then published with a
+** single store; a name the server thread got stays valid until the index
+** is rebuilt twice.
+*/
+static void indexcfuncs(DebugState *ds)
+{
+	global_State *g = G(ds->L);
+	const TValue *loaded;
+	TString *key;
+	Table *lt;
+	CFuncIndex *idx;
+	size_t sig;
+	int i, j, n = 0;
+
+	key = findshrstr(g, SIZEDCSTR("_LOADED"), luaS_hash(SIZEDCSTR("_LOADED"), g->seed));
+	loaded = key ? luaH_getshortstr(hvalue(&g->l_registry), key) : luaO_nilobject;
+	if (!ttistable(loaded)) {
+		return;
+	}
+	lt = hvalue(loaded);
+	sig = loadedsig(lt);
+	if (ds->cfnames && sig == ds->cfsig) {
+		return;
+	}
+	if (!ds->cfindex && !(ds->cfindex = calloc(2, sizeof(CFuncIndex)))) {
+		return;
+	}
+	idx = ds->cfnames == &ds->cfindex[0] ? &ds->cfindex[1] : &ds->cfindex[0];
+	for (i = 0; i < sizenode(lt); i++) {
+		Node *mod = gnode(lt, i);
+		const char *modname;
+		Table *mt;
+		if (!ttisstring(gkey(mod)) || !ttistable(gval(mod))) {
+			continue;
+		}
+		modname = svalue(gkey(mod));
+		mt = hvalue(gval(mod));
+		for (j = 0; j < sizenode(mt) && n < CFN_MAX; j++) {
+			Node *fn = gnode(mt, j);
+			const TValue *v = gval(fn);
+			CFuncName *cfn = &idx->names[n];
+			if (!ttisstring(gkey(fn))) {
+				continue;
+			} else if (ttislcf(v)) {
+				cfn->f = fvalue(v);
+			} else if (ttisCclosure(v)) {
+				cfn->f = clCvalue(v)->f;
+			} else {
+				continue;
+			}
+			if (strcmp(modname, "_G") == 0) {
+				snprintf(cfn->name, CFN_NAMESIZE - 1, "%s", svalue(gkey(fn)));
+			} else {
+				snprintf(cfn->name, CFN_NAMESIZE - 1, "%s.%s", modname, svalue(gkey(fn)));
+			}
+			n++;
+		}
+	}
+	idx->n = n;
+	ds->cfsig = sig;
+	__atomic_store_n(&ds->cfnames, idx, __ATOMIC_RELEASE);
+}
+
+/* NULL if 'f' is not in the index */
+static const char* cfuncname(DebugState *ds, lua_CFunction f)
+{
+	CFuncIndex *idx = __atomic_load_n(&ds->cfnames, __ATOMIC_ACQUIRE);
+	int i;
+	if (!idx) {
+		return NULL;
+	}
+	for (i = 0; i < idx->n; i++) {
+		if (idx->names[i].f == f) {
+			return idx->names[i].name;
+		}
+	}
+	return NULL;
+}
+
+static void pushcfuncname(DebugState *ds, lua_CFunction f)
+{
+	const char *name = cfuncname(ds, f);
+	if (name) {
+		obpushfstr(ds, "'%s'", name);
+	} else {
+		obpushfstr(ds, "%p", cast(void*, cast(size_t, f)));
+	}
+}
+
+/* a pause is asked but the VM has not reached a safe point yet */
+static void pushbusy(DebugState *ds)
+{
+	lua_CFunction f = G(ds->L)->cfunc;
+	long ms = cast(long, (monotonicns() - ds->pausesince) / 1000000);
+
+	if (f) {
+		obpushstr(ds, SIZEDCSTR("Lua VM busy in C function "));
+		pushcfuncname(ds, f);
+		obpushfstr(ds, " for %ld ms", ms);
+	} else {
+		obpushfstr(ds, "Lua VM busy for %ld ms", ms);
+	}
+	obpushstr(ds, SIZEDCSTR(", it will pause at the next safe point"));
+}
+
+/*
+** End the session of a client who is gone. What it armed patches code or
+** is updated by the VM, so this runs on the VM thread or while the VM is
+** parked. Nothing is printed: 'obuf' may be the server thread's.
+*/
+static void endsession(DebugState *ds)
+{
+	while (ds->bplist) {
+		freebreakpoint(ds, ds->bplist);
+	}
+	stopcounting(ds);
+	freecounts(ds);
+	if (ds->cov.on) {
+		stopcoverage(ds);
+	}
+	stopmemprof(ds);
+	deletewatches(ds);
+}
+
+/* the client left something only the VM thread may undo while the VM runs */
+static int sessionarmed(DebugState *ds)
+{
+	Counter *ct = &ds->count;
+	return ds->bplist || ds->watch.list || ds->cov.on || ds->memprof.on ||
+		ct->on || ct->nprotos > 0 || ct->retired;
+}
+
+/*
+** The client is gone. A parked VM is cleaned up here and let go. A running
+** VM cleans up at its next safe point instead, see takegone: it may stay
+** in a C function for as long as it likes, e.g. an idle server blocked in
+** accept, and the server thread must get back to accepting clients. A
+** pause the client asked for is dropped.
+*/
+static void dropclient(DebugState *ds)
+{
+	int state = VM_PAUSING;
+
+	stopprofiler(ds);
+	stoptracing(ds);
+	freeheapsnapshot(ds);
+	if (VMPARKED(ds)) {
+		cmd_continue(ds);
+		endsession(ds);
+		return;
+	}
+	ds->why_setpause = 0;
+	__atomic_compare_exchange_n(&ds->vmstate, &state, VM_RUNNING, 0,
+		__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+	if (sessionarmed(ds)) {
+		__atomic_store_n(&ds->clientgone, 1, __ATOMIC_RELEASE);
+		SETPAUSE(ds);
+	}
+}
+
+/*
+** Clean up after a client gone, see dropclient. Called by the VM at a safe
+** point, before any posted command, or by the server thread once the VM
+** is parked.
+*/
+static void takegone(DebugState *ds)
+{
+	if (__atomic_load_n(&ds->clientgone, __ATOMIC_ACQUIRE) &&
+		__atomic_exchange_n(&ds->clientgone, 0, __ATOMIC_ACQ_REL)) {
+		endsession(ds);
+	}
+}
+
+/*
+** Wait a little for the VM to park, so that a VM stuck in a C function
+** gets reported instead of left unanswered.
+*/
+static void cmd_pause(DebugState *ds)
+{
+	long long deadline;
+	int state;
+
+	releasemail(ds);  /* a VM held by a posted command cannot pause */
+	if (ds->mode == 'b' && !VMPARKED(ds)) {
+		ds->why_setpause = SETPAUSE_CLI;
+		markpausing(ds, monotonicns());
+		SETPAUSE(ds);
+		deadline = monotonicns() + ds->conf.pausewait * 1000000LL;
+		while ((state = GETVMSTATE(ds)) != VM_PAUSED && monotonicns() < deadline) {
+			futexwait(&ds->vmstate, state, deadline - monotonicns());
 		}
+		if (state == VM_PAUSED) {
+			obpushfstr(ds, "pause latency %lld us (max %lld us)",
+				ds->pauselatency / 1000, ds->maxpauselatency / 1000);
+		} else {
+			pushbusy(ds);
+		}
+	}
+}
+
+/*
+** Have the running VM run a command at its next safe point, so that
+** breakpoints are set on a busy server without parking it. All code
+** patching stays on the VM thread, next to the loads and collections that
+** decide which Protos are patched. The VM waits only until the output is
+** sent, see releasemail. The command is taken back if the VM parks first,
+** to run it here. A VM that reaches no safe point within 'pausewait', e.g.
+** an idle server blocked in accept, gets the command queued: the reply
+** says so and the command is posted again after it, see queuemail; its
+** output follows when the VM next enters Lua, see takemail.
+*/
+static void postcmd(DebugState *ds, void (*handler)(DebugState*))
+{
+	long long deadline = monotonicns() + ds->conf.pausewait * 1000000LL;
+	int state;
+
+	releasemail(ds);  /* an earlier command of the same read */
+	ds->mailcmd = handler;
+	setmailstate(ds, MAIL_POSTED);
+	SETPAUSE(ds);
+	while ((state = GETMAILSTATE(ds)) == MAIL_POSTED && !VMPARKED(ds) &&
+		monotonicns() < deadline) {
+		futexwait(&ds->mailstate, state, 1000000);  /* parking does not wake us */
+	}
+	if (state == MAIL_POSTED && __atomic_compare_exchange_n(&ds->mailstate, &state,
+		MAIL_EMPTY, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		if (VMPARKED(ds)) {
+			takegone(ds);
+			handler(ds);
+		} else {
+			obpushfstr(ds, "Lua VM reached no safe point in %d ms, command `%s` queued "
+				"until it does", ds->conf.pausewait, ds->argv[0]);
+			ds->mailqueued = 1;
+		}
+		return;
+	}
+	while ((state = GETMAILSTATE(ds)) != MAIL_DONE) {
+		futexwait(&ds->mailstate, state, -1);
+	}
+}
+
+/* The reply to a queued command is sent, hand the command to the VM. */
+static void queuemail(DebugState *ds)
+{
+	if (ds->mailqueued) {
+		ds->mailqueued = 0;
+		setmailstate(ds, MAIL_POSTED);
+		SETPAUSE(ds);
 	}
+}
 
-	if (codepos < 0 || codepos == p->sizecode) {
-		ds->why_setpause = SETPAUSE_STEP;
-	} else {
-		setpseudobp(ds, p, codepos);
-		ds->why_setpause = SETPAUSE_NEXT;
+/*
+** Polled by the server thread while a queued command waits. Returns 1
+** once its output is in 'obuf', to be sent and released by the caller.
+** A VM that parked without taking the command has it run here.
+*/
+static int takemail(DebugState *ds)
+{
+	int state = GETMAILSTATE(ds);
+	if (state == MAIL_DONE) {
+		return 1;
 	}
-	
-	SETPAUSE(ds);
-	ds->luacont = 1;
+	if (state == MAIL_POSTED && VMPARKED(ds) &&
+		__atomic_compare_exchange_n(&ds->mailstate, &state, MAIL_EMPTY, 0,
+		__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		takegone(ds);
+		ds->mailcmd(ds);
+		return 1;
+	}
+	return 0;
 }
 
-static void cmd_finish(DebugState *ds)
+/* The client is gone: take back a command the VM has not started. */
+static void retractmail(DebugState *ds)
 {
-	CallInfo *ci = preparecontlua(ds);
-	ci = ci->previous;
-	while (ci != &ds->L->base_ci) {
-		if (isLua(ci)) {
-			Proto *p = ci_func(ci)->p;
-			int codepos = ci->u.l.savedpc - p->code;
-			setpseudobp(ds, p, codepos);
-			SETPAUSE(ds);
-			ds->why_setpause = SETPAUSE_NEXT;
-			ds->luacont = 1;
-			return;
+	int state = MAIL_POSTED;
+	ds->mailqueued = 0;
+	if (!__atomic_compare_exchange_n(&ds->mailstate, &state, MAIL_EMPTY, 0,
+		__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		while ((state = GETMAILSTATE(ds)) == MAIL_TAKEN) {
+			futexwait(&ds->mailstate, state, -1);
 		}
-		ci = ci->previous;
 	}
+	releasemail(ds);
 }
 
-static void cmd_until(DebugState *ds)
+/* Called from the VM thread at a safe point. */
+static void runmail(DebugState *ds)
 {
-	CallInfo *ci;
-	Proto *p;
-	const Instruction *endcode, *code;
-	Instruction i;
-	int op;
-	int nr_forprep, nr_tforcall;
+	int state = MAIL_POSTED;
+	jmp_buf serverjmp;
 
-	ci = ds->ci;
-	if (ci != ds->citop) {
-		ci = ds->citop;
-		ds->ci = ci;
-		updatecifilepos(ds);
+	if (!__atomic_compare_exchange_n(&ds->mailstate, &state, MAIL_TAKEN, 0,
+		__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		return;
 	}
-	p = ci_func(ci)->p;
-	endcode = p->code + p->sizecode;
-	code = ci->u.l.savedpc;
-	nr_forprep = 0;
-	nr_tforcall = 0;
-	while (code < endcode) {
-		i = *code;
-		op = GET_OPCODE(i);
-		if (op == OP_JMP) {
-			if (code + 1 + GETARG_sBx(i) <= ci->u.l.savedpc) {
-				break;
-			}
-		} else if (op == OP_FORPREP) {
-			nr_forprep++;
-		} else if (op == OP_FORLOOP) {
-			nr_forprep--;
-			if (nr_forprep < 0) {
-				break;
-			}
-		} else if (op == OP_TFORCALL) {
-			nr_tforcall++;
-		} else if (op == OP_TFORLOOP) {
-			nr_tforcall--;
-			if (nr_tforcall < 0) {
-				break;
-			}
-		}
-		code++;
+	/* the server thread waits, so 'obuf' and the arena are ours */
+	memcpy(serverjmp, ds->jmpbuf, sizeof(jmp_buf));
+	if (setjmp(ds->jmpbuf) == 0) {
+		ds->mailcmd(ds);
+	} else {
+		obpushfstr(ds, "error: %s", ds->fatalerrmsg);
 	}
-	
-	if (code == endcode) {
-		obpushstr(ds, SIZEDCSTR("`until` should be used in a loop"));
-		return;
+	memcpy(ds->jmpbuf, serverjmp, sizeof(jmp_buf));
+	setmailstate(ds, MAIL_DONE);
+	while ((state = GETMAILSTATE(ds)) == MAIL_DONE) {
+		futexwait(&ds->mailstate, state, -1);
 	}
-
-	preparecontlua(ds);
-	setpseudobp(ds, p, (code + 1) - p->code);
-	ds->why_setpause = SETPAUSE_NEXT;
-	SETPAUSE(ds);
-	ds->luacont = 1;
 }
 
-static void cmd_continue(DebugState *ds)
+/*
+** Say why request 'start' overran: still calling functions means a hot
+** loop, a counter that stopped means a loop without calls or a blocking C
+** function.
+*/
+static void describeoverrun(DebugState *ds, long long start, long long now,
+	char *buff, size_t size)
 {
-	BreakPoint *bp;
-	CallInfo *ci = ds->ci;
-	if (ci != ds->citop) {
-		ci = ds->citop;
-		ds->ci = ci;
-		updatecifilepos(ds);
-	}
-	bp = ds->rtbp;
-	if (bp) {
-		bp->p->code[bp->codepos] = bp->code; /*restore user opcode */
-		if (bp->id != ID_PSEUDOBP) {
-			ds->restorebp = bp;
+	Watchdog *wd = &ds->wd;
+	lua_CFunction f = G(ds->L)->cfunc;
+	long long since = wd->lastprogress > start ? wd->lastprogress : start;
+	unsigned long ncalls = wd->lastcalls - __atomic_load_n(&wd->reqcalls, __ATOMIC_RELAXED);
+	size_t len;
+
+	len = snprintf(buff, size, "watchdog: request running for %lld ms, %lu calls",
+		(now - start) / 1000000, ncalls);
+	if (len >= size) {
+		return;
+	} else if (now - since < 2 * WD_TICK * 1000000LL) {
+		snprintf(buff + len, size - len, ", still calling functions");
+	} else if (f) {
+		const char *name = cfuncname(ds, f);
+		if (name) {
+			snprintf(buff + len, size - len, ", none for %lld ms, in C function '%s'",
+				(now - since) / 1000000, name);
+		} else {
+			snprintf(buff + len, size - len, ", none for %lld ms, in C function %p",
+				(now - since) / 1000000, cast(void*, cast(size_t, f)));
 		}
-		ci->u.l.savedpc--;
-		SETPAUSE(ds);
-		ds->why_setpause = SETPAUSE_NEXT;
+	} else {
+		snprintf(buff + len, size - len, ", none for %lld ms, looping in Lua code",
+			(now - since) / 1000000);
 	}
-	ds->luacont = 1;
 }
 
-static void delete_breaks(DebugState *ds)
+/*
+** Run by the server thread between commands and while it waits for a
+** client. It only reads what the VM publishes, so the VM never waits on it.
+*/
+static void watchdogcheck(DebugState *ds)
 {
-	int num = 0;
-	if (ds->argc > 2) {
-		int i;
-		BreakPoint *bp;
-		int id;
-		for (i = 2; i < ds->argc; i++) {
-			id = atoi(ds->argv[i]);
-			if (id > 0 && id <= MAX_BREAKPOINT) {
-				bp = getbreakpoint(ds, id);
-			} else {
-				bp = NULL;
-			}
-			if (bp) {
-				bp->p->code[bp->codepos] = bp->code;
-				if (ds->rtbp == bp) {
-					ds->rtbp = NULL;
-				}
-				if (ds->restorebp == bp) {
-					ds->restorebp = NULL;
-				}
-				num++;
-			} else {
-				obpushfstr(ds, "breakpoint #%s not found.\n", ds->argv[i]);
-			}
-		}
+	Watchdog *wd = &ds->wd;
+	unsigned long calls;
+	long long start, now;
+
+	if (wd->budget <= 0 || VMPARKED(ds)) {
+		return;
+	}
+	now = monotonicns();
+	calls = __atomic_load_n(&G(ds->L)->ncalls, __ATOMIC_RELAXED);
+	if (calls != wd->lastcalls) {
+		wd->lastcalls = calls;
+		wd->lastprogress = now;
+	}
+	start = __atomic_load_n(&wd->reqstart, __ATOMIC_SEQ_CST);
+	if (start == 0 || start == wd->firedfor || now - start < wd->budget * 1000000LL) {
+		return;
+	}
+	wd->firedfor = start;
+	wd->noverruns++;
+	describeoverrun(ds, start, now, wd->headline, sizeof(wd->headline));
+	/* the VM thread may be using 'obuf'; a client which cannot be told gets a capture */
+	if (ds->fdout >= 0 &&
+		writefull(ds->fdout, wd->headline, strlen(wd->headline)) == 0 &&
+		writefull(ds->fdout, SIZEDCSTR(", pausing\n")) == 0) {
+		ds->why_setpause = SETPAUSE_CLI;
+		markpausing(ds, now);
+		SETPAUSE(ds);
 	} else {
-		BreakPoint *bp = ds->bplist;
-		BreakPoint *tail = NULL;
-		while (bp) {
-			bp->p->code[bp->codepos] = bp->code;
-			tail = bp;
-			bp = bp->next;
-		}
-		num = ds->nr_bp;
-		if (tail) {
-			tail->next = ds->freebp;
-			ds->freebp = ds->bplist;
-			ds->bplist = NULL;
-			ds->nr_bp = 0;
-		}
-		ds->rtbp = NULL;
-		ds->restorebp = NULL;
+		__atomic_store_n(&wd->capture, 1, __ATOMIC_SEQ_CST);
+		SETDBGEV(ds->L, DBGEV_SAMPLE);
 	}
-	obpushfstr(ds, "deleted %d breakpoint(s)", num);
 }
 
-static void cmd_delete(DebugState *ds)
+/* Called from the VM thread for an overrun seen with no client attached. */
+static void watchdogcapture(DebugState *ds, lua_State *L)
 {
-	if (strncmp(ds->argv[1], SIZEDCSTR("breaks")) == 0) {
-		delete_breaks(ds);
+	Watchdog *wd = &ds->wd;
+	StackFrame frames[WD_MAXFRAMES];
+	char line[256];
+	char filename[64];
+	size_t len;
+	int i, n, fd;
+
+	if (!__atomic_exchange_n(&wd->capture, 0, __ATOMIC_SEQ_CST)) {
+		return;
+	}
+	if (!wd->report && !(wd->report = malloc(WD_REPORTSIZE))) {
+		return;
+	}
+	__atomic_store_n(&wd->sizereport, 0, __ATOMIC_SEQ_CST);
+	n = luaG_capturestack(L, 0, frames, WD_MAXFRAMES);
+	len = snprintf(wd->report, WD_REPORTSIZE, "%s\n", wd->headline);
+	for (i = 0; i < n && len < WD_REPORTSIZE; i++) {
+		luaG_symbolize(L, frames, n, i, line, sizeof(line));
+		len += snprintf(wd->report + len, WD_REPORTSIZE - len, "#%d %s\n", i, line);
+	}
+	if (len >= WD_REPORTSIZE) {
+		len = WD_REPORTSIZE - 1;
 	}
+
+	snprintf(filename, sizeof(filename), "ldb-%d.watchdog", getpid());
+	fd = open(filename, O_WRONLY | O_CREAT | O_APPEND, 0644);
+	if (fd >= 0) {
+		wd->logerr = writefull(fd, wd->report, len);
+		close(fd);
+	} else {
+		wd->logerr = errno;
+	}
+	__atomic_store_n(&wd->sizereport, len, __ATOMIC_SEQ_CST);
 }
 
-static void cmd_pause(DebugState *ds)
+static void cmd_watchdog(DebugState *ds)
 {
-	if (ds->mode == 'b' && ds->luacont == -1) {
-		ds->why_setpause = SETPAUSE_CLI;
-		SETPAUSE(ds);
+	Watchdog *wd = &ds->wd;
+	long long start;
+	size_t len;
+	int ms;
+
+	if (ds->argc == 1) {
+		if (wd->budget <= 0) {
+			obpushstr(ds, SIZEDCSTR("watchdog is off"));
+			return;
+		}
+		obpushfstr(ds, "watchdog budget %d ms, %lu overruns", wd->budget, wd->noverruns);
+		start = __atomic_load_n(&wd->reqstart, __ATOMIC_SEQ_CST);
+		if (start != 0) {
+			obpushfstr(ds, ", current request running for %lld ms",
+				(monotonicns() - start) / 1000000);
+		}
+		len = __atomic_load_n(&wd->sizereport, __ATOMIC_SEQ_CST);
+		if (len > 0) {
+			obpushstr(ds, SIZEDCSTR("\nlast capture:\n"));
+			obpushstr(ds, wd->report, len);
+			if (wd->logerr) {
+				obpushfstr(ds, "(not saved to ldb-%d.watchdog: %s)", (int)getpid(),
+					strerror(wd->logerr));
+			}
+		}
+		return;
+	}
+	if (strcmp(ds->argv[1], "off") == 0) {
+		wd->budget = 0;
+		CLEARDBGEV(ds->L, DBGEV_CALLS);
+		obpushstr(ds, SIZEDCSTR("watchdog off"));
+		return;
+	}
+	ms = atoi(ds->argv[1]);
+	if (ms <= 0) {
+		obpushstr(ds, SIZEDCSTR("usage: watchdog [<ms>|off]"));
+	} else if (ds->mode != 'b') {
+		obpushstr(ds, SIZEDCSTR("watchdog is only available in background mode"));
+	} else {
+		wd->budget = ms;
+		SETDBGEV(ds->L, DBGEV_CALLS);
+		obpushfstr(ds, "watchdog budget %d ms, mark requests with debug.markrequest()", ms);
 	}
 }
 
@@ -2070,24 +7228,34 @@ static void cmd_quit(DebugState *ds)
 }
 
 const CmdEntry cmdtable[] = {
-	{"print", "p", cmd_print},
-	{"break", "b", cmd_break},
-	{"tb", "tb", cmd_tb},
-	{"enable", "ea", cmd_enable},
-	{"disable", "da", cmd_disable},
-	{"next", "n", cmd_next},
-	{"step", "s", cmd_step},
-	{"finish", "fi", cmd_finish},
-	{"until", "un", cmd_until},
-	{"backtrace", "bt", cmd_backtrace},
-	{"frame", "f", cmd_frame},
-	{"delete", "d", cmd_delete},
-	{"list", "l", cmd_list},
-	{"continue", "c", cmd_continue},
-	{"info", "i", cmd_info},
-	{"pause", "pa", cmd_pause},
-	{"quit", "q", cmd_quit},
-	{NULL, NULL, NULL}
+	{"print", "p", cmd_print, 0},
+	{"break", "b", cmd_break, CMD_INVM},
+	{"tb", "tb", cmd_tb, CMD_INVM},
+	{"enable", "ea", cmd_enable, CMD_INVM},
+	{"disable", "da", cmd_disable, CMD_INVM},
+	{"next", "n", cmd_next, 0},
+	{"step", "s", cmd_step, 0},
+	{"finish", "fi", cmd_finish, 0},
+	{"until", "un", cmd_until, 0},
+	{"backtrace", "bt", cmd_backtrace, 0},
+	{"frame", "f", cmd_frame, 0},
+	{"delete", "d", cmd_delete, CMD_INVM},
+	{"list", "l", cmd_list, 0},
+	{"continue", "c", cmd_continue, 0},
+	{"info", "i", cmd_info, 0},
+	{"pause", "pa", cmd_pause, CMD_SERVER},
+	{"profile", "pr", cmd_profile, 0},
+	{"count", "co", cmd_count, 0},
+	{"coverage", "cov", cmd_coverage, 0},
+	{"trace", "tr", cmd_trace, 0},
+	{"memprof", "mp", cmd_memprof, 0},
+	{"heap", "hp", cmd_heap, 0},
+	{"watch", "w", cmd_watch, 0},
+	{"eval", "e", cmd_eval, 0},
+	{"set", "set", cmd_set, 0},
+	{"watchdog", "wd", cmd_watchdog, CMD_SERVER},
+	{"quit", "q", cmd_quit, CMD_SERVER},
+	{NULL, NULL, NULL, 0}
 };
 
 static char* parsequotedarg(char *s, char quote)
@@ -2127,12 +7295,15 @@ static size_t parsecmd(DebugState *ds)
 		return 1;
 	}
 	
-	memcpy(ds->argvbuf, ds->ibuf, nparsed);
-	e = ds->argvbuf + nparsed - 1; 
+	/* words are separated by at least one character */
+	ds->argv = arenaalloc(ds, (nparsed / 2 + 1) * sizeof(const char*));
+	s = arenaalloc(ds, nparsed);
+	memcpy(s, ds->ibuf, nparsed);
+	ds->cmdline = ds->ibuf;
+	e = s + nparsed - 1;
 
 	ds->argc = 0;
 	arg = NULL;
-	s = ds->argvbuf;
 	while (s < e) {
 		char c = *s;
 		if (c == '\'' || c == '\"') {
@@ -2178,6 +7349,9 @@ static void dispatchcmd(DebugState *ds)
 	const char *cmdname;
 	const CmdEntry *e;
 
+	if (VMPARKED(ds)) {
+		takegone(ds);  /* the VM parked before it could */
+	}
 	if (ds->argc == 0) {
 		obpushstr(ds, SIZEDCSTR("invalid command line"));
 		return;
@@ -2188,12 +7362,15 @@ static void dispatchcmd(DebugState *ds)
 	while (e->name) {
 		if (strcmp(e->name, cmdname) == 0 ||
 			strcmp(e->shortcut, cmdname) == 0) {
-			if (e->handler != cmd_pause && e->handler != cmd_quit && 
-				ds->mode == 'b' && ds->luacont == -1) {
-				obpushstr(ds, SIZEDCSTR("Lua VM is running, use command `pause` to pause it."));			
-			} else {
+			if (ds->mode != 'b' || (e->flags & CMD_SERVER) || VMPARKED(ds)) {
 				e->handler(ds);
-			}	
+			} else if (e->flags & CMD_INVM) {
+				postcmd(ds, e->handler);
+			} else if (GETVMSTATE(ds) == VM_PAUSING) {
+				pushbusy(ds);
+			} else {
+				obpushstr(ds, SIZEDCSTR("Lua VM is running, use command `pause` to pause it."));
+			}
 			return;
 		}
 		e++;
@@ -2223,10 +7400,21 @@ static int processinput(DebugState *ds)
 	}
 
 	fds.fd = ds->fdin;
-	fds.events = POLLIN;
+	if (ds->sizeibuf > 0) {
+		goto parseagain;  /* left over when the VM last continued */
+	}
 again:
+	fds.events = mailwaiting(ds) ? 0 : POLLIN;  /* hangups still show */
 	pollret = poll(&fds, 1, 1);
 	if (pollret == 0) {
+		if (mailwaiting(ds) && takemail(ds)) {
+			arenareset(ds);
+			return 0;
+		}
+		if (__atomic_load_n(&ds->trace.streaming, __ATOMIC_RELAXED)) {
+			streamtrace(ds);
+		}
+		watchdogcheck(ds);
 		goto again;
 	} else if (pollret < 0) {
 		if (errno == EINTR) {
@@ -2239,22 +7427,7 @@ again:
 	nread = read(fd, ds->ibuf + ds->sizeibuf, ds->capibuf - ds->sizeibuf);
 	if (nread > 0) {
 		ds->sizeibuf += (size_t)nread;
-parseagain:
-		nparsed = parsecmd(ds);
-		if (nparsed > 0) {
-			dispatchcmd(ds);
-			if (ds->fdin < 0) {
-				return -2;
-			}
-			ds->sizeibuf -= nparsed;
-			if (ds->sizeibuf > 0) {
-				memmove(ibuf, ibuf + nparsed, ds->sizeibuf);
-				goto parseagain;
-			}
-			return 0;
-		} else {
-			goto again;
-		}
+		goto parseagain;
 		
 	} else if (nread == 0) {
 		return -1;
@@ -2275,11 +7448,36 @@ parseagain:
 		}
 	}
 	return 0;
+
+parseagain:
+	if (mailwaiting(ds)) {
+		goto again;  /* the VM owns 'obuf' until the queued command is done */
+	}
+	nparsed = parsecmd(ds);
+	if (nparsed == 0) {
+		goto again;
+	}
+	dispatchcmd(ds);
+	if (!ds->mailqueued) {
+		arenareset(ds);
+	}
+	if (ds->fdin < 0) {
+		return -2;
+	}
+	ds->sizeibuf -= nparsed;
+	if (ds->sizeibuf > 0) {
+		memmove(ibuf, ibuf + nparsed, ds->sizeibuf);
+		/* what follows a continue or a queued command waits for it */
+		if (!ds->resume && !ds->mailqueued) {
+			goto parseagain;
+		}
+	}
+	return 0;
 }
 
 static void fg_interact(DebugState *ds)
 {	
-	while (ds->luacont != 1) {
+	while (!ds->resume) {
 		if (setjmp(ds->jmpbuf) == 0) {
 			int err = processinput(ds);
 			if (err != 0) {
@@ -2294,17 +7492,18 @@ static void fg_interact(DebugState *ds)
 			exit(-1);
 		}
 	}
-	ds->luacont = -1;
+	ds->resume = 0;
+	setvmstate(ds, VM_RUNNING);
 }
 
+/* Park until the server thread lets the VM continue. */
 static void bg_interact(DebugState *ds)
 {
-	while (ds->luacont != 1) {
-		pthread_mutex_lock(&ds->mutex);
-		pthread_cond_wait(&ds->cond, &ds->mutex);
-		pthread_mutex_unlock(&ds->mutex);
+	int state;
+	while ((state = GETVMSTATE(ds)) != VM_RESUMING) {
+		futexwait(&ds->vmstate, state, -1);
 	}
-	ds->luacont = -1;
+	setvmstate(ds, VM_RUNNING);
 }
 
 static void accept_and_serve(DebugState *ds, int listen_fd)
@@ -2315,6 +7514,13 @@ static void accept_and_serve(DebugState *ds, int listen_fd)
 	socklen_t socklen = sizeof(sa);
 	ds->fdin = -1;
 	while (ds->fdin < 0) {
+		if (ds->wd.budget > 0) {
+			struct pollfd pfd = {listen_fd, POLLIN, 0};
+			if (poll(&pfd, 1, WD_TICK) <= 0) {
+				watchdogcheck(ds);
+				continue;
+			}
+		}
 		fd = accept(listen_fd, (struct sockaddr*)&sa, &socklen);
 		if (fd >= 0) {
 			ds->fdin = fd;
@@ -2325,7 +7531,11 @@ static void accept_and_serve(DebugState *ds, int listen_fd)
 				fcntl(fd, F_SETFL, flags);
 			}
 			ds->sizeibuf = 0;
-			obpushstr(ds, SIZEDCSTR("Lua VM is runnning, use `pause` to pause it.\n"));
+			if (GETVMSTATE(ds) == VM_PAUSED) {
+				obpushfstr(ds, "Lua VM paused at %s:%d\n", ds->rtsrcname, ds->rtline);
+			} else {
+				obpushstr(ds, SIZEDCSTR("Lua VM is runnning, use `pause` to pause it.\n"));
+			}
 			obflush(ds);
 		}
 	}
@@ -2339,19 +7549,19 @@ static void accept_and_serve(DebugState *ds, int listen_fd)
 					ds->fdin = -1;
 					ds->fdout = -1;
 				}
-				if (ds->luacont == 0) {
-					cmd_continue(ds);
-				}
-				ds->argc = 2;
-				delete_breaks(ds);
+				retractmail(ds);
+				arenareset(ds);
+				dropclient(ds);
 			}
-			if (ds->luacont == 1) {
+			if (ds->resume) {
 				obpushstr(ds, SIZEDCSTR("Lua VM continuing ... "));
-				pthread_mutex_lock(&ds->mutex);
-				pthread_cond_signal(&ds->cond);
-				pthread_mutex_unlock(&ds->mutex);
+				obflush(ds);
+				resumevm(ds);
+			} else {
+				obflush(ds);
+				releasemail(ds);
+				queuemail(ds);
 			}
-			obflush(ds);
 			
 		} else {
 			obsetfstr(ds, "fatal error: %s", ds->fatalerrmsg);
@@ -2412,6 +7622,14 @@ static int onpanic(lua_State *L)
 	return 0;
 }
 
+static int startserverthread(DebugState *ds, int listen_fd)
+{
+	pthread_t pth;
+	ds->fdout = -1;
+	ds->fdin = listen_fd;
+	return pthread_create(&pth, NULL, server_thread, ds);
+}
+
 static int starttcpserver(DebugState *ds, const char *addr)
 {
 	struct sockaddr_in sa;	
@@ -2436,12 +7654,7 @@ static int starttcpserver(DebugState *ds, const char *addr)
 	}
 
 	if (ds->mode == 'b') {
-		pthread_t pth;
-		ds->fdout = -1;
-		ds->fdin = listen_fd;
-		pthread_mutex_init(&ds->mutex, NULL);
-		pthread_cond_init(&ds->cond, NULL);
-		err = pthread_create(&pth, NULL, server_thread, ds);
+		err = startserverthread(ds, listen_fd);
 		if (err != 0) {
 			goto errored;
 		}
@@ -2477,6 +7690,117 @@ errored:
 	
 }
 
+/*
+** A pause asked from a signal handler or another thread: set by
+** luaG_requestpause, taken by luaG_dbgevent. Signals are per process, so
+** a single VM, the last one armed, receives them.
+*/
+static volatile int pauserequested;
+static long long pauserequestedat;  /* ns */
+static global_State *volatile pausetarget;
+static char pausesockpath[sizeof(((struct sockaddr_un*)0)->sun_path)];
+static int pausesigno;  /* armed signal, 0 if none */
+static struct sigaction oldpauseaction;  /* its action before arming */
+
+/* the socket of a lazy server, "/tmp/ldbg-<pid>.sock" by default */
+static int startunixserver(DebugState *ds)
+{
+	struct sockaddr_un sa;
+	int listen_fd;
+	int err;
+
+	listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listen_fd < 0) {
+		return errno;
+	}
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	if (pausesockpath[0]) {
+		memcpy(sa.sun_path, pausesockpath, sizeof(sa.sun_path));
+	} else {
+		snprintf(sa.sun_path, sizeof(sa.sun_path), "/tmp/ldbg-%d.sock", (int)getpid());
+	}
+	unlink(sa.sun_path);
+	if (bind(listen_fd, (struct sockaddr*)&sa, sizeof(sa)) < 0 || listen(listen_fd, 1) < 0) {
+		err = errno;
+		close(listen_fd);
+		return err;
+	}
+	err = startserverthread(ds, listen_fd);
+	if (err != 0) {
+		close(listen_fd);
+		unlink(sa.sun_path);
+		return err;
+	}
+	trackloaded(ds);
+	ds->lazy = 0;
+	ds->bysignal = 1;
+	G(ds->L)->panic = onpanic;
+	return 0;
+}
+
+/*
+** Called at a safe point for a requested pause. A lazy state starts its
+** server first; the VM then waits for a client like in background mode.
+*/
+static void takepauserequest(DebugState *ds)
+{
+	if (ds->lazy && startunixserver(ds) != 0) {
+		return;  /* nobody to talk to, keep running */
+	}
+	ds->why_setpause = SETPAUSE_CLI;
+	markpausing(ds, __atomic_load_n(&pauserequestedat, __ATOMIC_SEQ_CST));
+}
+
+static void onpausesignal(int signo)
+{
+	global_State *g = pausetarget;
+	(void)signo;
+	if (g) {
+		__atomic_store_n(&pauserequestedat, monotonicns(), __ATOMIC_SEQ_CST);
+		__atomic_store_n(&pauserequested, 1, __ATOMIC_SEQ_CST);
+		__atomic_fetch_or(cast(uintptr_t*, &g->dbgstate), DBGEV_PAUSE, __ATOMIC_SEQ_CST);
+	}
+}
+
+/*
+** Ask the VM to pause at its next instruction. Only atomic operations are
+** used, so this can be called from a signal handler or any thread.
+*/
+void luaG_requestpause(lua_State *L)
+{
+	if (G(L)->dbgstate) {
+		__atomic_store_n(&pauserequestedat, monotonicns(), __ATOMIC_SEQ_CST);
+		__atomic_store_n(&pauserequested, 1, __ATOMIC_SEQ_CST);
+		SETDBGEV(L, DBGEV_PAUSE);
+	}
+}
+
+/* 'dbgstate' keeps events in the low bits, DBGEV_MASK + 1 must divide the address */
+static DebugState* newdebugstate(lua_State *L, char mode)
+{
+	void *mem;
+	DebugState *ds;
+	if (posix_memalign(&mem, DBGEV_MASK + 1, sizeof(DebugState)) != 0) {
+		return NULL;
+	}
+	ds = mem;
+	memset(ds, 0, sizeof(*ds));
+	ds->mode = mode;
+	ds->fdin = -1;
+	ds->fdout = -1;
+	ds->conf = DBGCONF;
+	ds->pseudobp.id = ID_PSEUDOBP;
+	ds->pseudobp.sites = &ds->pseudosite;
+	ds->pseudosite.codepos = -1;
+	ds->bpid = 1;
+	ds->why_setpause = 0;
+	ds->interact = mode == 'b' ? bg_interact : fg_interact;
+	ds->vmstate = VM_RUNNING;
+	ds->L = L;
+	return ds;
+}
+
 int luaG_startserver(lua_State *L, char mode, const char *addr)
 {
 	DebugState *ds;
@@ -2486,25 +7810,22 @@ int luaG_startserver(lua_State *L, char mode, const char *addr)
 		mode = 'i';
 	}
 
-	ds = malloc(sizeof(DebugState));
+	if (G(L)->dbgstate) {
+		if (!GETDS(L)->lazy) {
+			return EALREADY;
+		}
+		free(GETDS(L));  /* only armed, it holds nothing yet */
+		G(L)->dbgstate = NULL;
+	}
+	ds = newdebugstate(L, mode);
 	if (ds == NULL) {
 		err = ENOMEM;
 		goto errored;
 	}
-	memset(ds, 0, sizeof(*ds));
-	ds->mode = mode;
-	ds->fdin = -1;
-	ds->fdout = -1;
-	ds->conf = DBGCONF;
-	ds->pseudobp.id = ID_PSEUDOBP;
-	ds->pseudobp.codepos = -1;
-	ds->bpid = 1;
-	ds->why_setpause = 0;
-	ds->interact = mode == 'b' ? bg_interact : fg_interact;
-	ds->luacont = -1;
-	ds->L = L;
 	G(L)->dbgstate = ds;
 	G(L)->panic = onpanic;
+	indexcfuncs(ds);
+	trackloaded(ds);
 
 	if (mode != 'i') {
 		err = starttcpserver(ds, addr);
@@ -2523,20 +7844,135 @@ int luaG_startserver(lua_State *L, char mode, const char *addr)
 
 errored:
 	if (ds != NULL) {
+		G(L)->dbgstate = NULL;
+		freeprotorefs(&ds->protos);
 		free(ds);
 	}
 	return err;
 }
 
+/*
+** Let 'signo' (none if 0) or luaG_requestpause pause the VM in any mode.
+** Without a server, the debugger is only armed: it costs nothing until a
+** pause is requested, which starts a background server on the Unix socket
+** 'path' (NULL for the default) and waits there for a client.
+*/
+static void disarmpause(void)
+{
+	if (pausesigno > 0) {
+		sigaction(pausesigno, &oldpauseaction, NULL);
+		pausesigno = 0;
+	}
+}
+
+int luaG_armpause(lua_State *L, int signo, const char *path)
+{
+	struct sigaction sa;
+
+	if (path && strlen(path) >= sizeof(pausesockpath)) {
+		return ENAMETOOLONG;
+	}
+	if (!G(L)->dbgstate) {
+		DebugState *ds = newdebugstate(L, 'b');
+		if (ds == NULL) {
+			return ENOMEM;
+		}
+		ds->lazy = 1;
+		G(L)->dbgstate = ds;
+	}
+	memset(pausesockpath, 0, sizeof(pausesockpath));
+	if (path) {
+		strcpy(pausesockpath, path);
+	}
+	pausetarget = G(L);
+	if (signo > 0) {
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_handler = onpausesignal;
+		sa.sa_flags = SA_RESTART;
+		sigemptyset(&sa.sa_mask);
+		disarmpause();
+		if (sigaction(signo, &sa, &oldpauseaction) < 0) {
+			return errno;
+		}
+		pausesigno = signo;
+	}
+	return 0;
+}
+
+/*
+** Errors stop in the debugger only in a session started by
+** luaG_startserver, and in background mode only while a client is
+** attached. Otherwise, or inside `eval`, they propagate as usual.
+*/
+int luaG_stopsonerror(lua_State *L)
+{
+	DebugState *ds = GETDS(L);
+	if (ds->evaluating || ds->lazy || ds->bysignal) {
+		return 0;
+	}
+	return ds->mode != 'b' || ds->fdout >= 0;
+}
+
+/*
+** The state 'L' is being closed, its objects are freed already: signals
+** and the profiler thread must no longer reach it, no hook may point into
+** it, and what the debugger keeps about its source files goes before they
+** do.
+*/
+void luaG_closedebug(lua_State *L)
+{
+	DebugState *ds;
+	if (pausetarget == G(L)) {
+		pausetarget = NULL;
+		disarmpause();
+	}
+	if (!G(L)->dbgstate) {
+		return;
+	}
+	ds = GETDS(L);
+	stopprofiler(ds);
+	stoptracing(ds);
+	stopcounting(ds);
+	stopmemprof(ds);
+	freeprotorefs(&ds->protos);
+	while (ds->fclist) {
+		FileContent *fc = ds->fclist;
+		ds->fclist = fc->next;
+		freefilecontent(fc);
+	}
+}
+
 
 void luaG_interrupt(lua_State *L, int bpid)
 {
 	DebugState *ds = GETDS(L);
 	int pauselua = 1;
 	BreakPoint *bp = NULL;
+	BreakSite *site = NULL;
 
-	if (bpid != 0) {
+	if (bpid >= PROBE_BASE) {
+		hitprobe(ds, L, bpid - PROBE_BASE);
+		return;
+	}
+	if (bpid != 0 && L->ci->u.l.savedpc[-1] != CREATE_Ax(OP_INTERRUPT, bpid)) {
+		/* fetched before a posted command or a client gone removed it, run the user code */
+		L->ci->u.l.savedpc--;
+		return;
+	}
+	if (ds->evaluating && bpid <= WATCH_BASE) {
+		if (bpid != 0) {
+			luaG_runerror(L, "breakpoint reached, eval stopped");
+		}
+		return;
+	}
+	if (bpid > WATCH_BASE) {
+		pauselua = hitwatch(ds, L, bpid);
+	} else if (bpid != 0) {
+		Proto *p = ci_func(L->ci)->p;
 		bp = getbreakpoint(ds, bpid);
+		if (bp) {
+			site = findbreaksite(bp, p, pcRel(L->ci->u.l.savedpc, p));
+		}
 		
 	} else {
 		int why = ds->why_setpause;
@@ -2545,11 +7981,13 @@ void luaG_interrupt(lua_State *L, int bpid)
 		if (rbp) {
 			if (rbp->flags & BP_TEMP) {
 				freebreakpoint(ds, rbp);
-			} else {
+			} else if (!(rbp->flags & BP_DISABLED)) {
 				/* restore interrupt code */
-				rbp->p->code[rbp->codepos] = CREATE_Ax(OP_INTERRUPT, rbp->id);
+				BreakSite *rsite = ds->restoresite;
+				rsite->p->code[rsite->codepos] = CREATE_Ax(OP_INTERRUPT, rbp->id);
 			}
 			ds->restorebp = NULL;
+			ds->restoresite = NULL;
 		}
 		
 		if (why == SETPAUSE_STEP) {
@@ -2583,6 +8021,7 @@ void luaG_interrupt(lua_State *L, int bpid)
 			ds->L = L;
 		}
 		ds->rtbp = bp;
+		ds->rtsite = site;
 		updatecitop(ds);
 
 		ci = ds->ci;
@@ -2594,12 +8033,513 @@ void luaG_interrupt(lua_State *L, int bpid)
 		ds->oldline = p->lineinfo[ds->oldpc - p->code];
 		
 		updatecifilepos(ds);
-		obpushfstr(ds, "Lua VM paused at %s:%d\n", getstr(ds->rtsrcfile->filepath), ds->rtline);
+		indexcfuncs(ds);
+		obpushfstr(ds, "Lua VM paused at %s:%d", ds->rtsrcname, ds->rtline);
+		if (!isLua(L->ci) && G(L)->cfunc) {
+			obpushstr(ds, SIZEDCSTR(", in C function "));
+			pushcfuncname(ds, G(L)->cfunc);
+		}
+		obpushstr(ds, SIZEDCSTR("\n"));
 		listrtsrc(ds);
 		obflush(ds);
-		ds->luacont = 0;
+		if (GETVMSTATE(ds) == VM_PAUSING) {
+			ds->pauselatency = monotonicns() - ds->pausesince;
+			if (ds->pauselatency > ds->maxpauselatency) {
+				ds->maxpauselatency = ds->pauselatency;
+			}
+		}
+		setvmstate(ds, VM_PAUSED);
 		ds->interact(ds);
 	}
 }
 
 
+/*
+** Some bit of luaG_maypause is set: count the instruction about to run,
+** take a profiler sample, follow a store trapped by a watchpoint and/or
+** pause.
+*/
+void luaG_dbgevent(lua_State *L)
+{
+	DebugState *ds = GETDS(L);
+	uintptr_t ev = cast(uintptr_t, G(L)->dbgstate) & DBGEV_MASK;
+	if (ev & DBGEV_COUNT) {
+		countinstr(ds, L);
+	}
+	if (ev & DBGEV_SAMPLE) {
+		CLEARDBGEV(L, DBGEV_SAMPLE);
+		if (ds->prof.ring) {
+			takesample(ds, L);
+		}
+		watchdogcapture(ds, L);
+	}
+	if (ev & DBGEV_PAUSE) {
+		takegone(ds);
+		runmail(ds);
+		if (!ds->evaluating && __atomic_exchange_n(&pauserequested, 0, __ATOMIC_SEQ_CST)) {
+			takepauserequest(ds);
+		}
+		if (ds->watch.site && watchpending(ds, L)) {
+			ds->why_setpause = 0;
+			luaG_interrupt(L, 0);  /* report the store */
+			return;
+		}
+		if (ds->watch.fhits) {
+			reportfieldstores(ds);
+			ds->why_setpause = 0;
+			luaG_interrupt(L, 0);
+			if (ds->watch.site) {
+				SETPAUSE(ds);
+			}
+			return;
+		}
+		if (ds->why_setpause == 0) {  /* only a posted command or a trapped store */
+			if (!ds->watch.site) {
+				UNSETPAUSE(ds);
+				runmail(ds);  /* posted before the bit was cleared */
+			}
+			return;
+		}
+		luaG_interrupt(L, 0);
+		if (ds->watch.site) {
+			SETPAUSE(ds);
+		}
+	}
+}
+
+
+/*
+** 'v' as text, for the old value of a watched field: the object may be
+** gone when the store is reported. It does not allocate, and objects
+** other than strings are not dereferenced.
+*/
+static void valuetext(const TValue *v, char *buff, size_t size)
+{
+	switch (ttype(v)) {
+	case LUA_TNIL:
+		snprintf(buff, size, "nil");
+		break;
+	case LUA_TBOOLEAN:
+		snprintf(buff, size, "%s", bvalue(v) ? "true" : "false");
+		break;
+	case LUA_TNUMINT:
+		lua_integer2str(buff, size, ivalue(v));
+		break;
+	case LUA_TNUMFLT:
+		lua_number2str(buff, size, fltvalue(v));
+		break;
+	case LUA_TSHRSTR:
+	case LUA_TLNGSTR: {
+		size_t len = vslen(v), n = size - 6;  /* room for the quotes and "..." */
+		if (len < n) {
+			n = len;
+		}
+		snprintf(buff, size, "'%.*s%s'", (int)n, svalue(v), n < len ? "..." : "");
+		break; }
+	case LUA_TLIGHTUSERDATA:
+		snprintf(buff, size, "userdata: %p", pvalue(v));
+		break;
+	case LUA_TLCF:
+		snprintf(buff, size, "function: %p", cast(void*, fvalue(v)));
+		break;
+	default:
+		snprintf(buff, size, "%s: %p", ttypename(ttnov(v)), cast(void*, gcvalue(v)));
+	}
+}
+
+/*
+** A store into 't', marked by a field watchpoint, is about to run; 'raw'
+** if it ignores metamethods. Keep the old value of each watched field it
+** writes, to be reported at the next instruction. This runs on the VM
+** thread while the server thread may own 'obuf', so nothing is printed.
+*/
+void luaG_watchstore(lua_State *L, Table *t, const TValue *key, int raw)
+{
+	DebugState *ds = GETDS(L);
+	Watcher *wr;
+	WatchPoint *w;
+	const TValue *slot;
+
+	if (!ds || ds->evaluating) {
+		return;  /* an evaluation stores unreported */
+	}
+	wr = &ds->watch;
+	slot = luaH_get(t, key);
+	if (!raw && ttisnil(slot) && fasttm(L, t->metatable, TM_NEWINDEX)) {
+		return;  /* '__newindex' runs instead, whatever it stores is seen then */
+	}
+	for (w = wr->list; w; w = w->next) {
+		unsigned int bit = 1u << (w->id - 1);
+		if (w->kind == WATCH_FIELD && w->t == t && fieldkeyis(w, key)) {
+			if (!(wr->fhits & bit)) {
+				valuetext(slot, w->oldtext, sizeof(w->oldtext));
+				wr->fhits |= bit;
+			}
+		}
+	}
+	if (wr->fhits) {
+		SETPAUSE(ds);
+	}
+}
+
+static int onstack(lua_State *L, CallInfo *ci)
+{
+	CallInfo *c;
+	for (c = L->ci; c && c != ci; c = c->previous);
+	return c != NULL;
+}
+
+/*
+** Frames of 'L' were dropped by an error, or 'L' yielded or died. A
+** trapped store left in a dropped frame or a suspended thread is no longer
+** waited for, and the local watchpoints of dropped frames are deleted
+** rather than left to match a CallInfo reused by another call.
+*/
+void luaG_unwound(lua_State *L)
+{
+	DebugState *ds = GETDS(L);
+	Watcher *wr = &ds->watch;
+	WatchPoint *w, *next;
+	int dead = L->status != LUA_OK && L->status != LUA_YIELD;
+	int deleted = 0;
+
+	if (ds->evaluating) {
+		return;
+	}
+	if (wr->site && wr->L == L && (L->status != LUA_OK || !onstack(L, wr->ci))) {
+		rearmwatch(ds);
+		wr->site = NULL;
+	}
+	for (w = wr->list; w; w = next) {
+		next = w->next;
+		if (w->kind == WATCH_LOCAL && w->L == L && (dead || !onstack(L, w->ci))) {
+			obpushfstr(ds, "watchpoint #%d deleted, `%s` went out of scope\n",
+				w->id, w->expr);
+			deletewatchpoint(ds, w);
+			deleted = 1;
+		}
+	}
+	if (deleted) {
+		ds->why_setpause = SETPAUSE_CLI;
+		SETPAUSE(ds);
+	}
+}
+
+
+/*
+** Mark the start, or with 'start' 0 the end, of a request for the
+** watchdog. Returns 0 if the debugger is not running.
+*/
+int luaG_markrequest(lua_State *L, int start)
+{
+	DebugState *ds;
+	if (!G(L)->dbgstate) {
+		return 0;
+	}
+	ds = GETDS(L);
+	if (start) {
+		__atomic_store_n(&ds->wd.reqcalls,
+			__atomic_load_n(&G(L)->ncalls, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+		__atomic_store_n(&ds->wd.reqstart, monotonicns(), __ATOMIC_SEQ_CST);
+	} else {
+		__atomic_store_n(&ds->wd.reqstart, 0, __ATOMIC_SEQ_CST);
+	}
+	return 1;
+}
+
+
+/*
+** The VM is back in a C function from a call it made, e.g. to a table.sort
+** comparator. Take a requested pause here, showing the innermost Lua
+** frame, rather than wait for the C function to return to Lua.
+*/
+void luaG_safepoint(lua_State *L)
+{
+	DebugState *ds = GETDS(L);
+	CallInfo *ci;
+
+	watchdogcapture(ds, L);
+	takegone(ds);
+	runmail(ds);
+	if (!L->allowhook || ds->evaluating || ds->watch.site || ds->L != L) {
+		return;  /* in a hook or finalizer, or not the debugged thread */
+	}
+	if (__atomic_exchange_n(&pauserequested, 0, __ATOMIC_SEQ_CST)) {
+		takepauserequest(ds);
+	}
+	if (ds->why_setpause != SETPAUSE_CLI) {
+		return;
+	}
+	for (ci = L->ci; ci != &L->base_ci && !isLua(ci); ci = ci->previous);
+	if (ci != &L->base_ci) {
+		luaG_interrupt(L, 0);
+	}
+}
+
+
+/*
+** A Lua function is called or returns while tracing is on. This runs on
+** every call, so the function's pattern match is cached in the table.
+*/
+void luaG_tracecall(lua_State *L, CallInfo *ci, int event)
+{
+	DebugState *ds = GETDS(L);
+	Tracer *tr = &ds->trace;
+	int func = internfunc(&tr->ft, ci);
+	FuncEntry *f = &tr->ft.funcs[func];
+	TraceEvent *ev;
+	CallInfo *below;
+	size_t head = tr->head;
+	int depth = 0;
+
+	if (func == 0) {
+		__atomic_fetch_add(&tr->nuntraced, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	if (f->traced < 0) {
+		f->traced = strstr(f->name, tr->pattern) != NULL;
+	}
+	if (!f->traced) {
+		return;
+	}
+	if (__atomic_load_n(&tr->streaming, __ATOMIC_RELAXED) &&
+		head - __atomic_load_n(&tr->tail, __ATOMIC_ACQUIRE) > tr->ringmask) {
+		tr->ndropped++;
+		return;
+	}
+	ev = &tr->ring[head & tr->ringmask];
+	ev->ts = tracetime();
+	ev->L = L;
+	ev->func = func;
+	ev->what = event;
+	/* from the stack, so unwinds and coroutine switches cannot skew it */
+	for (below = ci->previous; below != &L->base_ci &&
+		depth < TRACE_MAXINDENT; below = below->previous) {
+		depth++;
+	}
+	ev->depth = depth;
+	__atomic_store_n(&tr->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+** Record up to 'n' frames of 'L' from 'level' (0 is the running function)
+** outwards, and return how many were recorded. Nothing is allocated; the
+** frames name Protos, not closures, so symbolize them while the code is
+** still loaded.
+*/
+int luaG_capturestack(lua_State *L, int level, StackFrame *frames, int n)
+{
+	CallInfo *ci;
+	int i = 0;
+
+	for (ci = L->ci; ci != &L->base_ci && level > 0; ci = ci->previous) {
+		level--;
+	}
+	for (; ci != &L->base_ci && i < n; ci = ci->previous, i++) {
+		StackFrame *fr = &frames[i];
+		if (isLua(ci)) {
+			fr->f = ci_func(ci)->p;
+			fr->pc = currentpc(ci);
+		} else {
+			fr->f = ttislcf(ci->func) ? cast(void*, cast(size_t, fvalue(ci->func))) :
+				cast(void*, cast(size_t, clCvalue(ci->func)->f));
+			fr->pc = -1;
+		}
+		fr->flags = 0;
+		if (ci->callstatus & CIST_TAIL) {
+			fr->flags |= STACKFRAME_TAIL;
+		}
+		if (ci->callstatus & CIST_FIN) {
+			fr->flags |= STACKFRAME_FIN;
+		}
+		if (ci->callstatus & CIST_HOOKED) {
+			fr->flags |= STACKFRAME_HOOKED;
+		}
+	}
+	return i;
+}
+
+/*
+** Format frame 'i' of a capture of 'n' frames as "file:line: in name",
+** like `backtrace`. The name is decoded from the calling frame, 'i + 1'.
+** Files loaded by path are shown with their full path.
+*/
+const char* luaG_symbolize(lua_State *L, const StackFrame *frames, int n, int i,
+	char *buff, size_t size)
+{
+	const StackFrame *fr = &frames[i];
+	const StackFrame *caller = i + 1 < n ? &frames[i + 1] : NULL;
+	Proto *p = fr->pc >= 0 ? cast(Proto*, fr->f) : NULL;
+	const char *namewhat = NULL, *name = NULL;
+	char src[LUA_IDSIZE];
+	const char *path = "[C]";
+	size_t len;
+
+	if (p) {
+		SrcFile *srcfile = luaE_protosrcfile(L, p);
+		if (srcfile) {
+			path = srcfile->filepath;
+		} else {
+			luaO_chunkid(src, p->source ? getstr(p->source) : "=?", LUA_IDSIZE);
+			path = src;
+		}
+	}
+	if (fr->flags & STACKFRAME_FIN) {
+		namewhat = "metamethod";
+		name = "__gc";
+	} else if (!(fr->flags & STACKFRAME_TAIL) && caller && caller->pc >= 0) {
+		if (caller->flags & STACKFRAME_HOOKED) {
+			namewhat = "hook";
+			name = "?";
+		} else {
+			namewhat = funcnamefrompc(L, cast(Proto*, caller->f), caller->pc, &name);
+		}
+	}
+
+	if (p && getfuncline(p, fr->pc) > 0) {
+		snprintf(buff, size, "%s:%d: in ", path, getfuncline(p, fr->pc));
+	} else {
+		snprintf(buff, size, "%s: in ", path);
+	}
+	len = strlen(buff);
+	if (namewhat) {
+		snprintf(buff + len, size - len, "%s '%s'", namewhat, name);
+	} else if (p && p->linedefined == 0) {
+		snprintf(buff + len, size - len, "main chunk");
+	} else if (p) {
+		snprintf(buff + len, size - len, "function <%s:%d>", path, p->linedefined);
+	} else {
+		snprintf(buff + len, size - len, "?");
+	}
+	return buff;
+}
+
+
+/*
+** A file has been (re)loaded: track the new version, bind the pending
+** breakpoints it matches, re-apply its breakpoints to it and forget the
+** cached text, which may have changed on disk. An armed debugger tracks
+** nothing until its server starts, see trackloaded.
+*/
+void luaG_srcloaded(lua_State *L, SrcFile *srcfile, Proto *p)
+{
+	DebugState *ds = GETDS(L);
+	BreakPoint *bp;
+	FileContent **pfc;
+
+	if (ds->lazy) {
+		return;
+	}
+	if (ds->nr_pendingbp > 0) {
+		resolvependingbps(ds, srcfile);
+	}
+	if (trackprotos(&ds->protos, srcfile, p, NULL)) {
+		for (bp = ds->bplist; bp; bp = bp->next) {
+			if (bp->srcfile == srcfile) {
+				addbreaksite(bp, p);
+			}
+		}
+		if (ds->cov.on) {
+			coverversion(ds, srcfile, p);
+		}
+	} else {
+		untrackprotos(&ds->protos, p);
+	}
+	for (pfc = &ds->fclist; *pfc; pfc = &(*pfc)->next) {
+		FileContent *fc = *pfc;
+		if (fc->srcfile == srcfile) {
+			*pfc = fc->next;
+			freefilecontent(fc);
+			break;
+		}
+	}
+}
+
+/* the sites of breakpoints and watchpoints in 'p', whose code goes with it */
+static void forgetsites(DebugState *ds, Proto *p)
+{
+	BreakPoint *bp;
+	BreakSite **psite, *site;
+	WatchPoint *w, *wnext;
+	WatchSite **pwsite, *wsite;
+
+	for (bp = ds->bplist; bp; bp = bp->next) {
+		psite = &bp->sites;
+		while ((site = *psite) != NULL) {
+			if (site->p != p) {
+				psite = &site->next;
+				continue;
+			}
+			*psite = site->next;
+			if (ds->rtsite == site) {
+				ds->rtbp = NULL;
+				ds->rtsite = NULL;
+			}
+			if (ds->restoresite == site) {
+				ds->restorebp = NULL;
+				ds->restoresite = NULL;
+			}
+			DBGFREE(ds, site);
+		}
+	}
+	if (ds->pseudosite.p == p) {
+		if (ds->rtsite == &ds->pseudosite) {
+			ds->rtbp = NULL;
+			ds->rtsite = NULL;
+		}
+		ds->pseudosite.p = NULL;
+		ds->pseudosite.codepos = -1;
+	}
+	for (w = ds->watch.list; w; w = wnext) {
+		wnext = w->next;
+		if (w->kind == WATCH_LOCAL && w->p == p) {
+			freewatchpoint(ds, w);  /* no activation of 'p' is left */
+			continue;
+		}
+		pwsite = &w->sites;
+		while ((wsite = *pwsite) != NULL) {
+			if (wsite->p != p) {
+				pwsite = &wsite->next;
+				continue;
+			}
+			*pwsite = wsite->next;
+			if (ds->watch.site == wsite) {
+				ds->watch.site = NULL;
+			}
+			DBGFREE(ds, wsite);
+		}
+	}
+}
+
+/*
+** 'p' is about to be freed, called by luaF_freeproto before it releases
+** anything. Forget it with everything patched in it; its nested functions
+** still alive become versions of their own.
+*/
+void luaG_freeproto(lua_State *L, Proto *p)
+{
+	DebugState *ds = GETDS(L);
+	ProtoRef *ref = unlinkprotoref(&ds->protos, p);
+	int i;
+
+	if (ref) {
+		for (i = 0; i < p->sizep; i++) {
+			ProtoRef *child = findprotoref(&ds->protos, p->p[i]);
+			if (child && child->parent == p) {
+				child->parent = NULL;
+			}
+		}
+		if (!ref->parent) {
+			droplineindex(ref->srcfile, p);
+		}
+		for (i = 0; i < ds->cov.nprobes; i++) {
+			if (ds->cov.probes[i].p == p) {
+				ds->cov.probes[i].p = NULL;
+			}
+		}
+		DBGFREE(ds, ref);
+	}
+	forgetsites(ds, p);
+	forgetcallnames(ds, p);
+	retirecounts(ds, p);
+}
@@ -39,8 +39,59 @@ LUAI_FUNC void luaG_traceexec (lua_State *L);
 
 LUAI_FUNC void luaG_interrupt(lua_State *L, int bpid);
 LUAI_FUNC int luaG_startserver(lua_State *L, char mode, const char *addr);
+LUAI_FUNC void luaG_srcloaded(lua_State *L, SrcFile *srcfile, Proto *p);
+LUAI_FUNC void luaG_freeproto(lua_State *L, Proto *p);
+LUAI_FUNC void luaG_freesrcfile(SrcFile *srcfile);
+LUAI_FUNC int luaG_stopsonerror(lua_State *L);
+LUAI_FUNC int luaG_armpause(lua_State *L, int signo, const char *path);
+LUAI_FUNC void luaG_requestpause(lua_State *L);
+LUAI_FUNC int luaG_markrequest(lua_State *L, int start);
+LUAI_FUNC void luaG_closedebug(lua_State *L);
 
-#define luaG_maypause(L)  if(1) { if (cast(uintptr_t, G(L)->dbgstate) & 0x01) luaG_interrupt(L, 0); }
+/* a frame recorded by luaG_capturestack */
+typedef struct StackFrame {
+  const void *f;  /* the Proto of a Lua function, or the C function */
+  int pc;  /* -1 for a C function */
+  int flags;
+} StackFrame;
+
+#define STACKFRAME_TAIL		0x01  /* called by a tail call */
+#define STACKFRAME_FIN		0x02  /* a finalizer */
+#define STACKFRAME_HOOKED	0x04  /* running a hook */
+
+LUAI_FUNC int luaG_capturestack(lua_State *L, int level, StackFrame *frames,
+                                int n);
+LUAI_FUNC const char *luaG_symbolize(lua_State *L, const StackFrame *frames,
+                                     int n, int i, char *buff, size_t size);
+
+/* events kept in the low bits of 'dbgstate', checked by vmfetch */
+#define DBGEV_PAUSE		0x01
+#define DBGEV_SAMPLE	0x02
+#define DBGEV_COUNT		0x04
+#define DBGEV_TRACE		0x08  /* checked by luaD_precall/luaD_poscall instead */
+#define DBGEV_CALLS		0x10  /* the watchdog is on, luaD_precall counts calls */
+#define DBGEV_FETCH		(DBGEV_PAUSE | DBGEV_SAMPLE | DBGEV_COUNT)
+#define DBGEV_MASK		0x1F
+
+/* events for luaG_tracecall */
+#define LUAG_TRACECALL	0
+#define LUAG_TRACERET	1
+#define LUAG_TRACETAIL	2  /* the frame is replaced by a tail call */
+
+LUAI_FUNC void luaG_dbgevent(lua_State *L);
+LUAI_FUNC void luaG_safepoint(lua_State *L);
+LUAI_FUNC void luaG_tracecall(lua_State *L, CallInfo *ci, int event);
+LUAI_FUNC void luaG_watchstore(lua_State *L, Table *t, const TValue *key,
+                              int raw);
+LUAI_FUNC void luaG_unwound(lua_State *L);
+
+#define luaG_maypause(L)  (cast(uintptr_t, G(L)->dbgstate) & DBGEV_FETCH)
+#define luaG_tracing(L)   (cast(uintptr_t, G(L)->dbgstate) & DBGEV_TRACE)
+#define luaG_countcalls(L)  (cast(uintptr_t, G(L)->dbgstate) & DBGEV_CALLS)
+
+/* in 'marked' of a table with a watched field, above the bits of lgc.h */
+#define WATCHEDBIT		4
+#define luaG_iswatched(t)  (ttistable(t) && (hvalue(t)->marked & (1 << WATCHEDBIT)))
 
 
 #endif
@@ -108,7 +108,7 @@ static void seterrorobj (lua_State *L, int errcode, StkId oldtop) {
 
 
 l_noret luaD_throw (lua_State *L, int errcode) {
-  if (errcode > LUA_YIELD && G(L)->dbgstate) {
+  if (errcode > LUA_YIELD && G(L)->dbgstate && luaG_stopsonerror(L)) {
     G(L)->panic(L);
     abort();
   } 
@@ -139,6 +139,7 @@ l_noret luaD_throw (lua_State *L, int errcode) {
 
 int luaD_rawrunprotected (lua_State *L, Pfunc f, void *ud) {
   unsigned short oldnCcalls = L->nCcalls;
+  lua_CFunction oldcfunc = G(L)->dbgstate ? G(L)->cfunc : NULL;
   struct lua_longjmp lj;
   lj.status = LUA_OK;
   lj.previous = L->errorJmp;  /* chain new error handler */
@@ -148,6 +149,8 @@ int luaD_rawrunprotected (lua_State *L, Pfunc f, void *ud) {
   );
   L->errorJmp = lj.previous;  /* restore old error handler */
   L->nCcalls = oldnCcalls;
+  if (G(L)->dbgstate)  /* an error may skip the restore in 'luaD_precall' */
+    G(L)->cfunc = oldcfunc;
   return lj.status;
 }
 
@@ -380,6 +383,8 @@ static int moveresults (lua_State *L, const TValue *firstResult, StkId res,
 int luaD_poscall (lua_State *L, CallInfo *ci, StkId firstResult, int nres) {
   StkId res;
   int wanted = ci->nresults;
+  if (luaG_tracing(L) && isLua(ci))
+    luaG_tracecall(L, ci, LUAG_TRACERET);
   if (L->hookmask & (LUA_MASKRET | LUA_MASKLINE)) {
     if (L->hookmask & LUA_MASKRET) {
       ptrdiff_t fr = savestack(L, firstResult);  /* hook may change stack */
@@ -427,6 +432,8 @@ int luaD_precall (lua_State *L, StkId func, int nresults) {
       int n;  /* number of returns */
       checkstackp(L, LUA_MINSTACK, func);  /* ensure minimum stack size */
       ci = next_ci(L);  /* now 'enter' new function */
+      if (luaG_countcalls(L))  /* the watchdog's progress counter */
+        G(L)->ncalls++;
       ci->nresults = nresults;
       ci->func = func;
       ci->top = L->top + LUA_MINSTACK;
@@ -435,7 +442,14 @@ int luaD_precall (lua_State *L, StkId func, int nresults) {
       if (L->hookmask & LUA_MASKCALL)
         luaD_hook(L, LUA_HOOKCALL, -1);
       lua_unlock(L);
-      n = (*f)(L);  /* do the actual call */
+      if (G(L)->dbgstate) {  /* for the debugger to tell where the VM is busy */
+        lua_CFunction outer = G(L)->cfunc;
+        G(L)->cfunc = f;
+        n = (*f)(L);  /* do the actual call */
+        G(L)->cfunc = outer;
+      }
+      else
+        n = (*f)(L);  /* do the actual call */
       lua_lock(L);
       api_checknelems(L, n);
       luaD_poscall(L, ci, L->top - n, n);
@@ -455,6 +469,8 @@ int luaD_precall (lua_State *L, StkId func, int nresults) {
         base = func + 1;
       }
       ci = next_ci(L);  /* now 'enter' new function */
+      if (luaG_countcalls(L))  /* the watchdog's progress counter */
+        G(L)->ncalls++;
       ci->nresults = nresults;
       ci->func = func;
       ci->u.l.base = base;
@@ -462,6 +478,8 @@ int luaD_precall (lua_State *L, StkId func, int nresults) {
       lua_assert(ci->top <= L->stack_last);
       ci->u.l.savedpc = p->code;  /* starting point */
       ci->callstatus = CIST_LUA;
+      if (luaG_tracing(L))
+        luaG_tracecall(L, ci, LUAG_TRACECALL);
       if (L->hookmask & LUA_MASKCALL)
         callhook(L, ci);
       return 0;
@@ -502,6 +520,8 @@ void luaD_call (lua_State *L, StkId func, int nResults) {
   if (!luaD_precall(L, func, nResults))  /* is a Lua function? */
     luaV_execute(L);  /* call it */
   L->nCcalls--;
+  if (luaG_maypause(L) && !isLua(L->ci))  /* back in a C function */
+    luaG_safepoint(L);
 }
 
 
@@ -595,6 +615,8 @@ static int recover (lua_State *L, int status) {
   L->nny = 0;  /* should be zero to be yieldable */
   luaD_shrinkstack(L);
   L->errfunc = ci->u.c.old_errfunc;
+  if (G(L)->dbgstate)
+    luaG_unwound(L);
   return 1;  /* continue running the coroutine */
 }
 
@@ -652,6 +674,7 @@ static void resume (lua_State *L, void *ud) {
 LUA_API int lua_resume (lua_State *L, lua_State *from, int nargs) {
   int status;
   unsigned short oldnny = L->nny;  /* save "number of non-yieldable" calls */
+  lua_State *oldrunning = G(L)->running;
   lua_lock(L);
   if (L->status == LUA_OK) {  /* may be starting a coroutine */
     if (L->ci != &L->base_ci)  /* not in base level? */
@@ -665,6 +688,7 @@ LUA_API int lua_resume (lua_State *L, lua_State *from, int nargs) {
   luai_userstateresume(L, nargs);
   L->nny = 0;  /* allow yields */
   api_checknelems(L, (L->status == LUA_OK) ? nargs + 1 : nargs);
+  G(L)->running = L;
   status = luaD_rawrunprotected(L, resume, &nargs);
   if (status == -1)  /* error calling 'lua_resume'? */
     status = LUA_ERRRUN;
@@ -681,6 +705,9 @@ LUA_API int lua_resume (lua_State *L, lua_State *from, int nargs) {
     else lua_assert(status == L->status);  /* normal end or yield */
   }
   L->nny = oldnny;  /* restore 'nny' */
+  G(L)->running = oldrunning;
+  if (status != LUA_OK && G(L)->dbgstate)  /* yielded or dead */
+    luaG_unwound(L);
   L->nCcalls--;
   lua_assert(L->nCcalls == ((from) ? from->nCcalls : 0));
   lua_unlock(L);
@@ -739,6 +766,8 @@ int luaD_pcall (lua_State *L, Pfunc func, void *u,
     L->allowhook = old_allowhooks;
     L->nny = old_nny;
     luaD_shrinkstack(L);
+    if (G(L)->dbgstate)
+      luaG_unwound(L);
   }
   L->errfunc = old_errfunc;
   return status;
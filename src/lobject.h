@@ -426,16 +426,21 @@ typedef struct Proto {
   struct LClosure *cache;  /* last-created closure with this prototype */
   TString  *source;  /* used for debug information */
   GCObject *gclist;
-  struct SrcFile *srcfile;
 } Proto;
 
 /*
 ** Source file
 */
 typedef struct SrcFile {
-  TString *filepath;
-  Proto *p;
+  const char *filepath;  /* chunk name without the leading '@' */
+  size_t pathlen;
+  const char *basename;  /* last component of 'filepath' */
+  unsigned int hash;  /* hash of 'filepath' */
+  unsigned int bhash;  /* hash of 'basename' */
+  struct SrcFile *hnext;  /* chain in the by-path index */
+  struct SrcFile *bnext;  /* chain in the by-basename index */
   void *ud;
+  void *lineidx;  /* line index of each loaded version, built by the debugger */
 }SrcFile;
 
 
@@ -193,9 +193,6 @@ static void init_registry (lua_State *L, global_State *g) {
   /* registry[LUA_RIDX_GLOBALS] = table of globals */
   sethvalue(L, &temp, luaH_new(L));  /* temp = new table (global table) */
   luaH_setint(L, registry, LUA_RIDX_GLOBALS, &temp);
-  /* registry[LUA_RIDX_SRCFILES] = table of globals */
-  sethvalue(L, &temp, luaH_new(L));  /* temp = new table (global table) */
-  luaH_setint(L, registry, LUA_RIDX_SRCFILES, &temp);
 }
 
 
@@ -242,10 +239,14 @@ static void preinit_thread (lua_State *L, global_State *g) {
 }
 
 
+static void freesrcindex (lua_State *L);
+
 static void close_state (lua_State *L) {
   global_State *g = G(L);
   luaF_close(L, L->stack);  /* close all upvalues for this thread */
   luaC_freeallobjects(L);  /* collect all objects */
+  luaG_closedebug(L);
+  freesrcindex(L);
   if (g->version)  /* closing a fully built state? */
     luai_userstateclose(L);
   luaM_freearray(L, G(L)->strt.hash, G(L)->strt.size);
@@ -311,6 +312,7 @@ LUA_API lua_State *lua_newstate (lua_Alloc f, void *ud) {
   g->frealloc = f;
   g->ud = ud;
   g->mainthread = L;
+  g->running = L;
   g->seed = makeseed(L);
   g->gcrunning = 0;  /* no GC while building state */
   g->GCestimate = 0;
@@ -331,6 +333,10 @@ LUA_API lua_State *lua_newstate (lua_Alloc f, void *ud) {
   g->gcfinnum = 0;
   g->gcpause = LUAI_GCPAUSE;
   g->gcstepmul = LUAI_GCMUL;
+  g->dbgstate = NULL;
+  g->cfunc = NULL;
+  g->ncalls = 0;
+  g->srcindex = NULL;
   for (i=0; i < LUA_NUMTAGS; i++) g->mt[i] = NULL;
   if (luaD_rawrunprotected(L, f_luaopen, NULL) != LUA_OK) {
     /* memory allocation error: free partial state */
@@ -347,55 +353,234 @@ LUA_API void lua_close (lua_State *L) {
   close_state(L);
 }
 
-static TValue* getsrcfile(lua_State *L, const char *filepath, int insert)
+/*
+** Index of source files. Every '@file' chunk gets one SrcFile, which is
+** chained both by its full path and by its basename, so the debugger can
+** resolve "foo.lua" or "lib/foo.lua" without the whole chunk name and
+** without creating Lua strings. The index is created by the first load.
+*/
+typedef struct SrcIndex {
+	SrcFile **bypath;
+	SrcFile **bybase;
+	int size;  /* size of both hash arrays (a power of 2) */
+	int nuse;
+} SrcIndex;
+
+#define MINSRCINDEXSIZE		32
+
+
+static const char* pathbasename(const char *path, size_t len)
+{
+	const char *s = path + len;
+	while (s > path && s[-1] != '/') {
+		s--;
+	}
+	return s;
+}
+
+static void resizesrcindex(lua_State *L, SrcIndex *si, int newsize)
 {
-	TValue key;
-	TValue *val;
-	TValue *gt;
-	
-	setsvalue(L, &key, luaS_new(L, filepath));
-	gt = (TValue*)luaH_getint(hvalue(&G(L)->l_registry), LUA_RIDX_SRCFILES);
-	if (insert) {
-		val = luaH_set(L, hvalue(gt), &key);
-	} else {
-		val = (TValue*)luaH_get(hvalue(gt), &key);
+	SrcFile **bypath = luaM_newvector(L, newsize, SrcFile*);
+	SrcFile **bybase = luaM_newvector(L, newsize, SrcFile*);
+	int i;
+
+	for (i = 0; i < newsize; i++) {
+		bypath[i] = NULL;
+		bybase[i] = NULL;
+	}
+	for (i = 0; i < si->size; i++) {
+		SrcFile *srcfile = si->bypath[i];
+		while (srcfile) {
+			SrcFile *next = srcfile->hnext;
+			int h = lmod(srcfile->hash, newsize);
+			int bh = lmod(srcfile->bhash, newsize);
+			srcfile->hnext = bypath[h];
+			bypath[h] = srcfile;
+			srcfile->bnext = bybase[bh];
+			bybase[bh] = srcfile;
+			srcfile = next;
+		}
 	}
+	luaM_freearray(L, si->bypath, si->size);
+	luaM_freearray(L, si->bybase, si->size);
+	si->bypath = bypath;
+	si->bybase = bybase;
+	si->size = newsize;
+}
 
-	if (val != luaO_nilobject && insert) {
-		SrcFile *srcfile = pvalue(val);
-		if (!ttislightuserdata(val)) {
-			srcfile = luaM_malloc(L, sizeof(SrcFile));
-			srcfile->filepath = tsvalue(&key);
-			srcfile->ud = NULL;
-			srcfile->p = NULL;
-			setpvalue(val, srcfile);
+static void freesrcindex(lua_State *L)
+{
+	SrcIndex *si = G(L)->srcindex;
+	int i;
+	if (!si) {
+		return;
+	}
+	for (i = 0; i < si->size; i++) {
+		SrcFile *srcfile = si->bypath[i];
+		while (srcfile) {
+			SrcFile *next = srcfile->hnext;
+			if (srcfile->lineidx) {
+				luaG_freesrcfile(srcfile);
+			}
+			luaM_freemem(L, srcfile, sizeof(SrcFile) + srcfile->pathlen + 1);
+			srcfile = next;
 		}
 	}
-	return val;
+	luaM_freearray(L, si->bypath, si->size);
+	luaM_freearray(L, si->bybase, si->size);
+	luaM_free(L, si);
+	G(L)->srcindex = NULL;
 }
 
+static SrcFile* findsrcfile(SrcIndex *si, const char *filepath, size_t len,
+                            unsigned int h)
+{
+	SrcFile *srcfile = si->bypath[lmod(h, si->size)];
+	while (srcfile) {
+		if (srcfile->hash == h && srcfile->pathlen == len &&
+			memcmp(srcfile->filepath, filepath, len) == 0) {
+			return srcfile;
+		}
+		srcfile = srcfile->hnext;
+	}
+	return NULL;
+}
 
-void attachsrcfile(Proto *p, SrcFile *srcfile)
+static SrcFile* newsrcfile(lua_State *L, const char *filepath, size_t len,
+                           unsigned int h)
 {
-	int i;
-	p->srcfile = srcfile;
-	for (i = 0; i < p->sizep; i++) {
-		attachsrcfile(p->p[i], srcfile);
+	global_State *g = G(L);
+	SrcIndex *si = g->srcindex;
+	SrcFile *srcfile;
+	char *path;
+	int bh;
+
+	if (!si) {
+		si = luaM_new(L, SrcIndex);
+		si->bypath = si->bybase = NULL;
+		si->size = si->nuse = 0;
+		g->srcindex = si;
+		resizesrcindex(L, si, MINSRCINDEXSIZE);
+	} else if (si->nuse >= si->size) {
+		resizesrcindex(L, si, si->size * 2);
 	}
+
+	srcfile = cast(SrcFile*, luaM_malloc(L, sizeof(SrcFile) + len + 1));
+	path = cast(char*, srcfile + 1);
+	memcpy(path, filepath, len);
+	path[len] = '\0';
+	srcfile->filepath = path;
+	srcfile->pathlen = len;
+	srcfile->basename = pathbasename(path, len);
+	srcfile->hash = h;
+	srcfile->bhash = luaS_hash(srcfile->basename,
+	                           len - (srcfile->basename - path), g->seed);
+	srcfile->ud = NULL;
+	srcfile->lineidx = NULL;
+
+	srcfile->hnext = si->bypath[lmod(h, si->size)];
+	si->bypath[lmod(h, si->size)] = srcfile;
+	bh = lmod(srcfile->bhash, si->size);
+	srcfile->bnext = si->bybase[bh];
+	si->bybase[bh] = srcfile;
+	si->nuse++;
+	return srcfile;
 }
 
+
 void luaE_addsrcfile(lua_State *L, const char *filepath, Proto *p)
 {
-	TValue *val = getsrcfile(L, filepath, 1);
-	SrcFile *srcfile = pvalue(val);
-	srcfile->p = p;
-	attachsrcfile(p, srcfile);
+	size_t len = strlen(filepath);
+	unsigned int h = luaS_hash(filepath, len, G(L)->seed);
+	SrcFile *srcfile = NULL;
+	if (G(L)->srcindex) {
+		srcfile = findsrcfile(G(L)->srcindex, filepath, len, h);
+	}
+	if (!srcfile) {
+		srcfile = newsrcfile(L, filepath, len, h);
+	}
+	if (G(L)->dbgstate) {
+		luaG_srcloaded(L, srcfile, p);
+	}
+}
+
+
+/*
+** Source file of any function of a chunk, found through the chunk name it
+** shares with its top-level function; NULL if it was not loaded from a
+** file. Nothing is recorded in the Proto itself, so loading costs the
+** same however deeply the chunk nests its functions.
+*/
+SrcFile* luaE_protosrcfile(lua_State *L, const Proto *p)
+{
+	SrcIndex *si = G(L)->srcindex;
+	const char *source;
+	size_t len;
+	if (!si || !p->source) {
+		return NULL;
+	}
+	source = getstr(p->source);
+	len = tsslen(p->source);
+	if (len < 1 || source[0] != '@') {
+		return NULL;
+	}
+	return findsrcfile(si, source + 1, len - 1,
+	                   luaS_hash(source + 1, len - 1, G(L)->seed));
 }
 
 
-SrcFile* luaE_getsrcfile(lua_State *L, const char *filepath)
+/*
+** Does 'filepath' name 'srcfile', either entirely or as a trailing part of
+** its path starting at a '/' boundary?
+*/
+int luaE_srcfilematch(const SrcFile *srcfile, const char *filepath, size_t len)
 {
-	TValue *val = getsrcfile(L, filepath, 0);
-	return val != luaO_nilobject ? pvalue(val) : NULL;
+	const char *tail;
+	if (srcfile->pathlen < len) {
+		return 0;
+	}
+	tail = srcfile->filepath + (srcfile->pathlen - len);
+	return memcmp(tail, filepath, len) == 0 &&
+		(tail == srcfile->filepath || tail[-1] == '/' || *filepath == '/');
 }
 
+
+/*
+** Look up a source file by its exact chunk name first; otherwise by path
+** suffix, so that "foo.lua" or "lib/foo.lua" match "/srv/app/lib/foo.lua"
+** (only at '/' boundaries). The number of matches is stored in 'nmatch'
+** (if not NULL); when several files match, none is returned.
+*/
+SrcFile* luaE_getsrcfile(lua_State *L, const char *filepath, int *nmatch)
+{
+	global_State *g = G(L);
+	SrcIndex *si = g->srcindex;
+	SrcFile *srcfile, *found = NULL;
+	size_t len, blen;
+	const char *base;
+	unsigned int bh;
+	int n = 0;
+
+	if (si) {
+		len = strlen(filepath);
+		found = findsrcfile(si, filepath, len, luaS_hash(filepath, len, g->seed));
+		if (found) {
+			n = 1;
+		} else {
+			base = pathbasename(filepath, len);
+			blen = len - (base - filepath);
+			bh = luaS_hash(base, blen, g->seed);
+			for (srcfile = si->bybase[lmod(bh, si->size)]; srcfile;
+				 srcfile = srcfile->bnext) {
+				if (srcfile->bhash == bh && luaE_srcfilematch(srcfile, filepath, len)) {
+					found = srcfile;
+					n++;
+				}
+			}
+		}
+	}
+	if (nmatch) {
+		*nmatch = n;
+	}
+	return n == 1 ? found : NULL;
+}
@@ -146,13 +146,16 @@ typedef struct global_State {
   int gcstepmul;  /* GC 'granularity' */
   lua_CFunction panic;  /* to be called in unprotected errors */
   struct lua_State *mainthread;
+  struct lua_State *running;  /* thread running now, kept by 'lua_resume' */
   const lua_Number *version;  /* pointer to version number */
   TString *memerrmsg;  /* memory-error message */
   TString *tmname[TM_N];  /* array with tag-method names */
   struct Table *mt[LUA_NUMTAGS];  /* metatables for basic types */
   TString *strcache[STRCACHE_N][STRCACHE_M];  /* cache for strings in API */
   struct DebugState *dbgstate;
-  struct SrcFile *srcfiles[200] ;  /* TODO */
+  lua_CFunction volatile cfunc;  /* innermost C function running, or NULL */
+  unsigned long ncalls;  /* calls made while the watchdog is on, its progress counter */
+  struct SrcIndex *srcindex;  /* index of '@file' chunks, NULL until used */
 } global_State;
 
 
@@ -233,7 +236,11 @@ LUAI_FUNC void luaE_freeCI (lua_State *L);
 LUAI_FUNC void luaE_shrinkCI (lua_State *L);
 
 LUAI_FUNC void luaE_addsrcfile(lua_State *L, const char *filename, Proto *p);
-LUAI_FUNC SrcFile* luaE_getsrcfile(lua_State *L, const char *filename);
+LUAI_FUNC SrcFile* luaE_getsrcfile(lua_State *L, const char *filename,
+                                   int *nmatch);
+LUAI_FUNC int luaE_srcfilematch(const SrcFile *srcfile, const char *filepath,
+                                size_t len);
+LUAI_FUNC SrcFile* luaE_protosrcfile(lua_State *L, const Proto *p);
 
 #endif
 
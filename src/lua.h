@@ -82,8 +82,7 @@ typedef struct lua_State lua_State;
 /* predefined values in the registry */
 #define LUA_RIDX_MAINTHREAD	1
 #define LUA_RIDX_GLOBALS	2
-#define LUA_RIDX_SRCFILES	3
-#define LUA_RIDX_LAST		LUA_RIDX_SRCFILES
+#define LUA_RIDX_LAST		LUA_RIDX_GLOBALS
 
 
 /* type of numbers in Lua */
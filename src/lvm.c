@@ -230,6 +230,8 @@ void luaV_finishset (lua_State *L, const TValue *t, TValue *key,
       return;
     }
     t = tm;  /* else repeat assignment over 'tm' */
+    if (luaG_iswatched(t))
+      luaG_watchstore(L, hvalue(t), key, 0);
     if (luaV_fastset(L, t, key, slot, luaH_get, val))
       return;  /* done */
     /* else loop */
@@ -757,7 +759,8 @@ void luaV_finishOp (lua_State *L) {
   i = *(ci->u.l.savedpc++); \
   if (L->hookmask & (LUA_MASKLINE | LUA_MASKCOUNT)) \
     Protect(luaG_traceexec(L)); \
-  luaG_maypause(L); \
+  if (luaG_maypause(L)) \
+    Protect(luaG_dbgevent(L)); \
   ra = RA(i); /* WARNING: any stack reallocation invalidates 'ra' */ \
   lua_assert(base == ci->u.l.base); \
   lua_assert(base <= L->top && L->top < L->stack + L->stacksize); \
@@ -777,8 +780,9 @@ void luaV_finishOp (lua_State *L) {
   else Protect(luaV_finishget(L,t,k,v,slot)); }
 
 
-/* same for 'luaV_settable' */
+/* same for 'luaV_settable'; a table with a watched field tells the debugger */
 #define settableProtected(L,t,k,v) { const TValue *slot; \
+  if (luaG_iswatched(t)) luaG_watchstore(L,hvalue(t),k,0); \
   if (!luaV_fastset(L,t,k,slot,luaH_get,v)) \
     Protect(luaV_finishset(L,t,k,v,slot)); }
 
@@ -1159,6 +1163,8 @@ void luaV_execute (lua_State *L) {
           /* last stack slot filled by 'precall' */
           StkId lim = nci->u.l.base + getproto(nfunc)->numparams;
           int aux;
+          if (luaG_tracing(L))
+            luaG_tracecall(L, oci, LUAG_TRACETAIL);
           /* close all upvalues from previous call */
           if (cl->p->sizep > 0) luaF_close(L, oci->u.l.base);
           /* move new frame into old one */
@@ -1316,7 +1322,7 @@ void luaV_execute (lua_State *L) {
         vmbreak;
       }
 	  vmcase(OP_INTERRUPT) {
-        luaG_interrupt(L, GETARG_Ax(i));
+        Protect(luaG_interrupt(L, GETARG_Ax(i)));
         vmbreak;
 	  }
     }